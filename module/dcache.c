@@ -4,8 +4,8 @@
  * Copyright (C) 1997 by Bill Hawes
  * Copyright (C) 2004 Miroslav Spousta
  *
- * Routines to support directory cacheing using the page cache.
- * This cache code is almost directly taken from smbfs/ncpfs.
+ * Routines to support directory cacheing.  The listing is kept in a
+ * per-directory index (by name and by position), see shfs_names_*().
  *
  */
 
@@ -19,198 +19,394 @@
 #include <linux/mm.h>
 #include <linux/dirent.h>
 #include <linux/pagemap.h>
+#include <linux/slab.h>
 #include <asm/page.h>
 
 #include "shfs_fs.h"
 #include "shfs_fs_sb.h"
+#include "shfs_fs_i.h"
 #include "shfs_debug.h"
 
 /*
- * Force the next attempt to use the cache to be a timeout.
- * If we can't find the page that's fine, it will cause a refresh.
+ * Force the next readdir/lookup to ask the server.
  */
 void
 shfs_invalid_dir_cache(struct inode * dir)
 {
-	struct shfs_sb_info *info = info_from_inode(dir);
-	union  shfs_dir_cache *cache = NULL;
-	struct page *page = NULL;
+	shfs_names_drop(dir);
+}
 
-	page = grab_cache_page(&dir->i_data, 0);
-	if (!page)
-		goto out;
+/*
+ * Age all dentries for 'parent', those not seen in the listing being
+ * read will be revalidated (see shfs_d_revalidate()).
+ */
+void
+shfs_invalidate_dircache_entries(struct dentry *parent)
+{
+	struct shfs_inode_info *i = parent->d_inode->i_private;
+
+	i->list_gen++;
+}
+
+/*
+ * Name index: the names and attributes of the last complete listing,
+ * by name for lookups (positive or not) without s_stat, and by
+ * position for readdir.  It ages like a dentry.  Our own changes to
+ * the directory are applied to it (shfs_names_update()), others make
+ * it to be dropped.
+ *
+ * The installed index is read and changed under dir->i_mutex only
+ * (lookup, readdir, directory operations); names_lock guards the
+ * pointer to it.
+ */
+struct shfs_names *
+shfs_names_alloc(struct inode *dir)
+{
+	struct shfs_inode_info *i = dir->i_private;
+	struct shfs_names *names;
 
-	if (!PageUptodate(page))
-		goto out_unlock;
+	names = kmalloc(sizeof(*names), GFP_KERNEL);
+	if (!names)
+		return NULL;
+	names->hash = kcalloc(1 << SHFS_NAMES_BITS, sizeof(struct shfs_name *), GFP_KERNEL);
+	if (!names->hash) {
+		kfree(names);
+		return NULL;
+	}
+	atomic_set(&names->refs, 1);
+	names->time = jiffies;
+	spin_lock(&i->names_lock);
+	names->gen = i->names_gen;
+	spin_unlock(&i->names_lock);
+	names->count = 0;
+	names->bits = SHFS_NAMES_BITS;
+	names->pos = NULL;
+	names->chunks = 0;
+	names->pages = NULL;
+	return names;
+}
 
-	cache = kmap(page);
-	cache->head.time = jiffies - SHFS_MAX_AGE(info);
+static void
+names_free(struct shfs_names *names)
+{
+	struct shfs_names_page *p;
+	int i;
 
-	kunmap(page);
-	SetPageUptodate(page);
-out_unlock:
-	unlock_page(page);
-	page_cache_release(page);
-out:
-	return;
+	while ((p = names->pages)) {
+		names->pages = p->next;
+		free_page((unsigned long)p);
+	}
+	for (i = 0; i < names->chunks; i++)
+		kfree(names->pos[i]);
+	kfree(names->pos);
+	kfree(names->hash);
+	kfree(names);
+}
+
+/* the name index of dir with a reference, or NULL */
+struct shfs_names *
+shfs_names_get(struct inode *dir)
+{
+	struct shfs_inode_info *i = dir->i_private;
+	struct shfs_names *names;
+
+	spin_lock(&i->names_lock);
+	names = i->names;
+	if (names)
+		atomic_inc(&names->refs);
+	spin_unlock(&i->names_lock);
+	return names;
+}
+
+void
+shfs_names_put(struct shfs_names *names)
+{
+	if (names && atomic_dec_and_test(&names->refs))
+		names_free(names);
+}
+
+/* double the hash table, keep the old one if there is no memory */
+static void
+names_grow(struct shfs_names *names)
+{
+	struct shfs_name **hash, *n, *next;
+	int i, size = 1 << names->bits;
+
+	hash = kcalloc(size * 2, sizeof(struct shfs_name *), GFP_KERNEL);
+	if (!hash)
+		return;
+	for (i = 0; i < size; i++) {
+		for (n = names->hash[i]; n; n = next) {
+			next = n->next;
+			n->next = hash[n->hash & (size * 2 - 1)];
+			hash[n->hash & (size * 2 - 1)] = n;
+		}
+	}
+	kfree(names->hash);
+	names->hash = hash;
+	names->bits++;
+}
+
+/* room for one more position, NULL if there is no memory */
+static struct shfs_name **
+names_slot(struct shfs_names *names)
+{
+	struct shfs_name ***pos;
+	int c = names->count / SHFS_NAMES_CHUNK;
+
+	if (c == names->chunks) {
+		pos = kmalloc((c + 1) * sizeof(*pos), GFP_KERNEL);
+		if (!pos)
+			return NULL;
+		pos[c] = kmalloc(SHFS_NAMES_CHUNK * sizeof(**pos), GFP_KERNEL);
+		if (!pos[c]) {
+			kfree(pos);
+			return NULL;
+		}
+		if (c)
+			memcpy(pos, names->pos, c * sizeof(*pos));
+		kfree(names->pos);
+		names->pos = pos;
+		names->chunks++;
+	}
+	return &names->pos[c][names->count % SHFS_NAMES_CHUNK];
+}
+
+/* size bytes in the last page, or a new one */
+static void *
+names_mem(struct shfs_names *names, unsigned int size)
+{
+	struct shfs_names_page *p = names->pages;
+	void *mem;
+
+	size = ALIGN(size, sizeof(long));
+	if (!p || p->used + size > PAGE_SIZE - sizeof(*p)) {
+		p = (struct shfs_names_page *)__get_free_page(GFP_KERNEL);
+		if (!p)
+			return NULL;
+		p->next = names->pages;
+		p->used = 0;
+		names->pages = p;
+	}
+	mem = p->data + p->used;
+	p->used += size;
+	return mem;
+}
+
+static struct shfs_name *
+names_add(struct shfs_names *names, struct qstr *name, struct shfs_fattr *fattr)
+{
+	struct shfs_name *n, **head, **slot;
+
+	slot = names_slot(names);
+	if (!slot)
+		return NULL;
+	n = names_mem(names, sizeof(*n) + name->len + 1);
+	if (!n)
+		return NULL;
+	n->fattr = *fattr;
+	n->hash = full_name_hash(name->name, name->len);
+	n->len = name->len;
+	memcpy(n->name, name->name, name->len);
+	n->name[n->len] = '\0';
+	head = &names->hash[n->hash & ((1 << names->bits) - 1)];
+	n->next = *head;
+	*head = n;
+	*slot = n;
+	n->idx = names->count++;
+	if (names->count > (2 << names->bits) && names->bits < SHFS_NAMES_MAXBITS)
+		names_grow(names);
+	return n;
+}
+
+static struct shfs_name *
+names_find(struct shfs_names *names, struct qstr *name)
+{
+	unsigned int hash = full_name_hash(name->name, name->len);
+	struct shfs_name *n;
+
+	for (n = names->hash[hash & ((1 << names->bits) - 1)]; n; n = n->next) {
+		if (n->hash == hash && n->len == name->len && !memcmp(n->name, name->name, n->len))
+			return n;
+	}
+	return NULL;
+}
+
+/* leave a hole, the positions of the others do not change */
+static void
+names_unlink(struct shfs_names *names, struct shfs_name *n)
+{
+	struct shfs_name **p = &names->hash[n->hash & ((1 << names->bits) - 1)];
+
+	while (*p != n)
+		p = &(*p)->next;
+	*p = n->next;
+	names->pos[n->idx / SHFS_NAMES_CHUNK][n->idx % SHFS_NAMES_CHUNK] = NULL;
 }
 
 /*
- * Mark all dentries for 'parent' as invalid, forcing them to be re-read
+ * Apply our change of dir to its index: name now has fattr, or is
+ * gone if fattr is NULL.  The index is dropped if it cannot be kept
+ * up to date.
  */
 void
-shfs_invalidate_dircache_entries(struct dentry *parent)
+shfs_names_update(struct inode *dir, struct qstr *name, struct shfs_fattr *fattr)
 {
-	struct shfs_sb_info *info = info_from_dentry(parent);
-	struct list_head *next;
-	struct dentry *dentry;
-
-	//spin_lock(&dcache_lock);
-	mutex_lock(&info->shfs_mutex);
-	next = parent->d_subdirs.next;
-	while (next != &parent->d_subdirs) {
-		//dentry = list_entry(next, struct dentry, d_child);
-		dentry = list_entry(next, struct dentry, d_u.d_child);
-		dentry->d_fsdata = NULL;
-		shfs_age_dentry(info, dentry);
-		next = next->next;
+	struct shfs_names *names = shfs_names_get(dir);
+	struct shfs_name *n;
+
+	if (!names)
+		return;
+	n = names_find(names, name);
+	if (n && fattr) {
+		n->fattr = *fattr;
+	} else if (n) {
+		names_unlink(names, n);
+	} else if (fattr && !names_add(names, name, fattr)) {
+		shfs_names_drop(dir);
 	}
-	//spin_unlock(&dcache_lock);
-	mutex_unlock(&info->shfs_mutex);
+	shfs_names_put(names);
+}
+
+/* old in old_dir was renamed to new in new_dir */
+void
+shfs_names_move(struct inode *old_dir, struct qstr *old, struct inode *new_dir, struct qstr *new)
+{
+	struct shfs_names *names = shfs_names_get(old_dir);
+	struct shfs_name *n = NULL;
+	struct shfs_fattr fattr;
+
+	if (names && (n = names_find(names, old))) {
+		fattr = n->fattr;
+		names_unlink(names, n);
+	}
+	shfs_names_put(names);
+	if (n)
+		shfs_names_update(new_dir, new, &fattr);
+	else
+		shfs_names_drop(new_dir);
+}
+
+/* install a finished listing, unless dir changed while it was read */
+void
+shfs_names_set(struct inode *dir, struct shfs_names *names)
+{
+	struct shfs_inode_info *i = dir->i_private;
+	struct shfs_names *old = names;
+
+	spin_lock(&i->names_lock);
+	if (names->gen == i->names_gen) {
+		old = i->names;
+		i->names = names;
+	}
+	spin_unlock(&i->names_lock);
+	shfs_names_put(old);
+}
+
+void
+shfs_names_drop(struct inode *dir)
+{
+	struct shfs_inode_info *i = dir->i_private;
+	struct shfs_names *old;
+
+	spin_lock(&i->names_lock);
+	old = i->names;
+	i->names = NULL;
+	i->names_gen++;
+	spin_unlock(&i->names_lock);
+	shfs_names_put(old);
 }
 
 /*
- * dget, but require that fpos and parent matches what the dentry contains.
- * dentry is not known to be a valid pointer at entry.
+ * 0 and the attributes if name was in the listing, -ENOENT if it was
+ * not, -EAGAIN if there is no fresh listing of dir.  *time is when the
+ * listing was made.
  */
-struct dentry *
-shfs_dget_fpos(struct dentry *dentry, struct dentry *parent, unsigned long fpos)
-{
-	struct dentry *dent = dentry;
-	struct list_head *next;
-
-	if (d_validate(dent, parent)) {
-		if ((unsigned long)dent->d_fsdata == fpos) {
-			if (!dent->d_inode) {
-				dput(dent);
-				dent = NULL;
-			}
-			return dent;
-		}
-		dput(dent);
+int
+shfs_names_lookup(struct inode *dir, struct qstr *name, struct shfs_fattr *fattr, unsigned long *time)
+{
+	struct shfs_sb_info *info = info_from_inode(dir);
+	struct shfs_inode_info *i = dir->i_private;
+	struct shfs_names *names;
+	struct shfs_name *n;
+	int result = -EAGAIN;
+
+	spin_lock(&i->names_lock);
+	names = i->names;
+	if (!names || jiffies - names->time >= SHFS_MAX_AGE(info))
+		goto out;
+	n = names_find(names, name);
+	if (n) {
+		*fattr = n->fattr;
+		result = 0;
+	} else {
+		result = -ENOENT;
 	}
+	*time = names->time;
+out:
+	spin_unlock(&i->names_lock);
+	return result;
+}
 
-	/* If a pointer is invalid, we search the dentry. */
-	//spin_lock(&dcache_lock);
-	next = parent->d_subdirs.next;
-	while (next != &parent->d_subdirs) {
-		//dent = list_entry(next, struct dentry, d_child);
-		dent = list_entry(next, struct dentry, d_u.d_child);
-		if ((unsigned long)dent->d_fsdata == fpos) {
-			/*if (dent->d_inode)
-				dget_locked(dent);
-			else*/
-				dent = NULL;
-			goto out_unlock;
-		}
-		next = next->next;
+/* continue readdir at f_pos from the index */
+void
+shfs_names_readdir(struct file *filp, void *dirent, filldir_t filldir, struct shfs_names *names)
+{
+	struct shfs_name *n;
+	unsigned long i;
+
+	while ((i = filp->f_pos - 2) < names->count) {
+		n = names->pos[i / SHFS_NAMES_CHUNK][i % SHFS_NAMES_CHUNK];
+		if (n && filldir(dirent, n->name, n->len, filp->f_pos, n->fattr.f_ino, DT_UNKNOWN))
+			break;
+		filp->f_pos += 1;
 	}
-	dent = NULL;
-out_unlock:
-	//spin_unlock(&dcache_lock);
-	return dent;
 }
 
 /*
- * Create dentry/inode for this file and add it to the dircache.
+ * Add a row of the listing being read to the index and pass it to
+ * filldir if it is at f_pos.  Dentries and inodes are made by lookup,
+ * only those already in the dcache are refreshed here.  Returns 0 if
+ * the rest of the listing is not needed.
  */
 int
 shfs_fill_cache(struct file *filp, void *dirent, filldir_t filldir,
-	       struct shfs_cache_control *ctrl, struct qstr *qname,
+	       struct shfs_cache_control *ctl, struct qstr *qname,
 	       struct shfs_fattr *entry)
 {
 	struct dentry *newdent, *dentry = filp->f_dentry;
-	struct inode *newino, *inode = dentry->d_inode;
-	struct shfs_cache_control ctl = *ctrl;
-	int valid = 0;
-	int hashed = 0;
+	struct inode *inode = dentry->d_inode;
+	struct shfs_name *n;
 	ino_t ino = 0;
 
-//	struct inode *lower_inode = get_lower_inode(dentry);
-
 	qname->hash = full_name_hash(qname->name, qname->len);
 
-	if (dentry->d_op && dentry->d_op->d_hash)
-//		if (dentry->d_op->d_hash(dentry, lower_inode, qname) != 0)
-			goto end_advance;
-
 	newdent = d_lookup(dentry, qname);
-
-	if (!newdent) {
-		newdent = d_alloc(dentry, qname);
-		if (!newdent)
-			goto end_advance;
-	} else {
-		hashed = 1;
-		memcpy((char *) newdent->d_name.name, qname->name,
-		       newdent->d_name.len);
-	}
-
-	if (!newdent->d_inode) {
-		shfs_renew_times(newdent);
-		entry->f_ino = iunique(inode->i_sb, 2);
-		newino = shfs_iget(inode->i_sb, entry);
-		if (newino) {
+	if (newdent) {
+		if (newdent->d_inode) {
+			shfs_set_inode_attr(newdent->d_inode, entry);
+			ino = newdent->d_inode->i_ino;
 			shfs_new_dentry(newdent);
-			d_instantiate(newdent, newino);
-			if (!hashed)
-				d_rehash(newdent);
 		}
-	} else {
-		shfs_set_inode_attr(newdent->d_inode, entry);
-	}
-
-        if (newdent->d_inode) {
-		ino = newdent->d_inode->i_ino;
-		newdent->d_fsdata = (void *) ctl.fpos;
-		shfs_new_dentry(newdent);
+		dput(newdent);
 	}
+	/* same number as in the previous listing */
+	if (!ino && ctl->old && (n = names_find(ctl->old, qname)))
+		ino = n->fattr.f_ino;
+	if (!ino)
+		ino = iunique(inode->i_sb, 2);
+	entry->f_ino = ino;
 
-	if (ctl.idx >= SHFS_DIRCACHE_SIZE) {
-		if (ctl.page) {
-			kunmap(ctl.page);
-			SetPageUptodate(ctl.page);
-			unlock_page(ctl.page);
-			page_cache_release(ctl.page);
-		}
-		ctl.cache = NULL;
-		ctl.idx  -= SHFS_DIRCACHE_SIZE;
-		ctl.ofs  += 1;
-		ctl.page  = grab_cache_page(&inode->i_data, ctl.ofs);
-		if (ctl.page)
-			ctl.cache = kmap(ctl.page);
-	}
-	if (ctl.cache) {
-		ctl.cache->dentry[ctl.idx] = newdent;
-		valid = 1;
+	if (ctl->names && !names_add(ctl->names, qname, entry)) {
+		shfs_names_put(ctl->names);
+		ctl->names = NULL;
 	}
-	dput(newdent);
-
-end_advance:
-	if (!valid)
-		ctl.valid = 0;
-	if (!ctl.filled && (ctl.fpos == filp->f_pos)) {
-		if (!ino)
-			ino = find_inode_number(dentry, qname);
-		if (!ino)
-			ino = iunique(inode->i_sb, 2);
-		ctl.filled = filldir(dirent, qname->name, qname->len,
+	if (!ctl->filled && (ctl->fpos == filp->f_pos)) {
+		ctl->filled = filldir(dirent, qname->name, qname->len,
 				     filp->f_pos, ino, DT_UNKNOWN);
-		if (!ctl.filled)
+		if (!ctl->filled)
 			filp->f_pos += 1;
 	}
-	ctl.fpos += 1;
-	ctl.idx  += 1;
-	*ctrl = ctl;
-	return (ctl.valid || !ctl.filled);
+	ctl->fpos += 1;
+	return (ctl->names || !ctl->filled);
 }
@@ -13,6 +13,7 @@
 #include <asm/uaccess.h>
 #include <linux/mutex.h>
 #include <linux/stat.h>
+#include <linux/pagemap.h>
 
 #include "shfs_fs.h"
 #include "shfs_fs_i.h"
@@ -39,9 +40,8 @@ shfs_dir_open(struct inode *inode, struct file *filp)
 
 /*
  * Read a directory, using filldir to fill the dirent memory.
- * info->fops.readdir does the actual reading from the shfs server.
- *
- * The cache code is almost directly taken from shfs/ncpfs
+ * info->fops.readdir does the actual reading from the shfs server,
+ * a sweep started on a fresh listing continues from its index.
  */
 static int 
 shfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
@@ -50,14 +50,10 @@ shfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	struct shfs_sb_info *info = info_from_dentry(dentry);
 	struct inode *dir = dentry->d_inode;
 	char name[SHFS_PATH_MAX];
-	union shfs_dir_cache *cache = NULL;
 	struct shfs_cache_control ctl;
-	struct page *page = NULL;
+	struct shfs_names *names;
 	int result;
 
-	ctl.page = NULL;
-	ctl.cache = NULL;
-
 	DEBUG("%s (%d)\n", dentry->d_name.name, (unsigned int)filp->f_pos);
 
 	result = 0;
@@ -82,116 +78,62 @@ shfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	if (result)
 		goto out;
 
-
-	page = grab_cache_page(&dir->i_data, 0);
-	if (!page)
-		goto read_really;
-
-	ctl.cache = cache = kmap(page);
-	ctl.head = cache->head;
-
-	if (!PageUptodate(page) || !ctl.head.eof) {
-		DEBUG("%s, page uptodate=%d, eof=%d\n", dentry->d_name.name, PageUptodate(page), ctl.head.eof);
-		goto init_cache;
-	}
-
-	if (filp->f_pos == 2) {
-		if (jiffies - ctl.head.time >= SHFS_MAX_AGE(info))
-			goto init_cache;
+	names = shfs_names_get(dir);
+	if (names && (filp->f_pos > 2 || jiffies - names->time < SHFS_MAX_AGE(info))) {
+		shfs_names_readdir(filp, dirent, filldir, names);
+		shfs_names_put(names);
+		goto out;
 	}
 
-	if (filp->f_pos > ctl.head.end)
-		goto finished;
-
-	ctl.fpos = filp->f_pos + (SHFS_DIRCACHE_START - 2);
-	ctl.ofs  = ctl.fpos / SHFS_DIRCACHE_SIZE;
-	ctl.idx  = ctl.fpos % SHFS_DIRCACHE_SIZE;
-
-	for (;;) {
-		if (ctl.ofs != 0) {
-			ctl.page = find_lock_page(&dir->i_data, ctl.ofs);
-			if (!ctl.page)
-				goto invalid_cache;
-			ctl.cache = kmap(ctl.page);
-			if (!PageUptodate(ctl.page))
-				goto invalid_cache;
-		}
-		while (ctl.idx < SHFS_DIRCACHE_SIZE) {
-			struct dentry *dent;
-			int res;
-
-			dent = shfs_dget_fpos(ctl.cache->dentry[ctl.idx],
-					     dentry, filp->f_pos);
-			if (!dent)
-				goto invalid_cache;
-			res = filldir(dirent, dent->d_name.name,
-				      dent->d_name.len, filp->f_pos,
-				      dent->d_inode->i_ino, DT_UNKNOWN);
-			dput(dent);
-			if (res)
-				goto finished;
-			filp->f_pos += 1;
-			ctl.idx += 1;
-			if (filp->f_pos > ctl.head.end)
-				goto finished;
-		}
-		if (ctl.page) {
-			kunmap(ctl.page);
-			SetPageUptodate(ctl.page);
-			unlock_page(ctl.page);
-			page_cache_release(ctl.page);
-			ctl.page = NULL;
-		}
-		ctl.idx  = 0;
-		ctl.ofs += 1;
-	}
-invalid_cache:
-	if (ctl.page) {
-		kunmap(ctl.page);
-		unlock_page(ctl.page);
-		page_cache_release(ctl.page);
-		ctl.page = NULL;
-	}
-	ctl.cache = cache;
-init_cache:
+	result = -ENAMETOOLONG;
+	if (get_name(dentry, name) < 0)
+		goto out_put;
 	shfs_invalidate_dircache_entries(dentry);
-	ctl.head.time = jiffies;
-	ctl.head.eof = 0;
+	ctl.names = shfs_names_alloc(dir);
+	ctl.old = names;
 	ctl.fpos = 2;
-	ctl.ofs = 0;
-	ctl.idx = SHFS_DIRCACHE_START;
 	ctl.filled = 0;
-	ctl.valid  = 1;
-read_really:
-	result = -ENAMETOOLONG;
-	if (get_name(dentry, name) < 0)
-		goto out;
 	result = info->fops.readdir(info, name, filp, dirent, filldir, &ctl);
-	if (ctl.idx == -1)
-		goto invalid_cache;	/* retry */
-	ctl.head.end = ctl.fpos - 1;
-	ctl.head.eof = ctl.valid;
-finished:
-	if (page) {
-		cache->head = ctl.head;
-		kunmap(page);
-		SetPageUptodate(page);
-		unlock_page(page);
-		page_cache_release(page);
-	}
-	if (ctl.page) {
-		kunmap(ctl.page);
-		SetPageUptodate(ctl.page);
-		unlock_page(ctl.page);
-		page_cache_release(ctl.page);
+	if (ctl.names) {
+		if (result >= 0)
+			shfs_names_set(dir, ctl.names);
+		else
+			shfs_names_put(ctl.names);
 	}
+out_put:
+	shfs_names_put(names);
 out:
 	return result;
 }
 
+/* dentry from a listing made at time ages with it */
+static void
+set_lookup_time(struct dentry *dentry, int listed, unsigned long time)
+{
+	if (listed)
+		dentry->d_time = time;
+	else
+		shfs_renew_times(dentry);
+}
+
+/* the inode number readdir reported for a listed name, if still free */
+static ino_t
+lookup_ino(struct super_block *sb, struct shfs_fattr *fattr, int listed)
+{
+	struct inode *inode;
+
+	if (listed) {
+		inode = ilookup(sb, fattr->f_ino);
+		if (!inode)
+			return fattr->f_ino;
+		iput(inode);
+	}
+	return iunique(sb, 2);
+}
+
 /*
- * shouldn't be called too often since we instantiate dentry
- * in fill_cache()
+ * Names of a freshly listed directory are looked up in its index,
+ * dentries and inodes are made here rather than in fill_cache()
  */
 static struct dentry*
 shfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
@@ -200,39 +142,48 @@ shfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 	char name[SHFS_PATH_MAX];
 	struct shfs_fattr fattr;
 	struct inode *inode;
-	int result;
+	struct page *data = NULL;
+	unsigned long time = 0;
+	int result, listed = 1;
 	
 	DEBUG("%s\n", dentry->d_name.name);
-	if (get_name(dentry, name) < 0)
-		return ERR_PTR(-ENAMETOOLONG);
-
-	result = info->fops.stat(info, name, &fattr);
+	result = shfs_names_lookup(dir, &dentry->d_name, &fattr, &time);
+	if (result == -EAGAIN) {
+		if (get_name(dentry, name) < 0)
+			return ERR_PTR(-ENAMETOOLONG);
+		result = shfs_stat(info, name, &fattr, &data);
+		listed = 0;
+	}
 	if (result < 0) {
 		DEBUG("!%d\n", result);
-		dentry->d_op = &shfs_dentry_operations;
+		shfs_new_dentry(dentry);
 		d_add(dentry, NULL);
-		shfs_renew_times(dentry);
+		set_lookup_time(dentry, listed, time);
 		if (result == -EINTR)
 			return ERR_PTR(result);
 		return NULL; 
 	}
 
-	fattr.f_ino = iunique(dentry->d_sb, 2);
+	fattr.f_ino = lookup_ino(dir->i_sb, &fattr, listed);
 	inode = shfs_iget(dir->i_sb, &fattr);
 	if (inode) {
-		dentry->d_op = &shfs_dentry_operations;
+		if (data)
+			shfs_set_inline(inode, data);
+		shfs_new_dentry(dentry);
 		d_add(dentry, inode);
-		shfs_renew_times(dentry);
+		set_lookup_time(dentry, listed, time);
+	} else if (data) {
+		page_cache_release(data);
 	}
 	
 	return NULL; 
 }
 
+/* fattr of the change that made dentry, stat if the server sent none */
 static int
-shfs_instantiate(struct dentry *dentry)
+shfs_instantiate(struct dentry *dentry, struct shfs_fattr *fattr)
 {
 	struct shfs_sb_info *info = info_from_dentry(dentry);
-	struct shfs_fattr fattr;
 	struct inode *inode;
 	char name[SHFS_PATH_MAX];
 	int result;
@@ -241,19 +192,23 @@ shfs_instantiate(struct dentry *dentry)
 	if (get_name(dentry, name) < 0)
 		return -ENAMETOOLONG;
 
-	result = info->fops.stat(info, name, &fattr);
-	if (result < 0) {
-		VERBOSE("!%d\n", result);
-		goto out;
+	if (!fattr->f_mode) {
+		result = shfs_stat(info, name, fattr, NULL);
+		if (result < 0) {
+			VERBOSE("!%d\n", result);
+			shfs_invalid_dir_cache(dentry->d_parent->d_inode);
+			goto out;
+		}
 	}
 
 	shfs_renew_times(dentry);
-	fattr.f_ino = iunique(dentry->d_sb, 2);
-	inode = shfs_iget(dentry->d_sb, &fattr);
+	fattr->f_ino = iunique(dentry->d_sb, 2);
+	inode = shfs_iget(dentry->d_sb, fattr);
 	result = -EACCES;
 	if (!inode)
 		goto out;
-	dentry->d_op = &shfs_dentry_operations;
+	shfs_names_update(dentry->d_parent->d_inode, &dentry->d_name, fattr);
+	shfs_new_dentry(dentry);
 	d_instantiate(dentry, inode);
 	result = 0;
 out:
@@ -264,6 +219,7 @@ static int
 shfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 	struct shfs_sb_info *info = info_from_dentry(dentry);
+	struct shfs_fattr fattr;
 	char name[SHFS_PATH_MAX];
 	int result;
 	
@@ -272,20 +228,22 @@ shfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	if (get_name(dentry, name) < 0)
 		return -ENAMETOOLONG;
 
-	result = info->fops.mkdir(info, name);
-	if (result < 0)
+	fattr.f_mode = 0;
+	result = info->fops.mkdir(info, name, &fattr);
+	if (result < 0) {
+		shfs_invalid_dir_cache(dir);
 		return result;
-
-	shfs_invalid_dir_cache(dir);
-	return shfs_instantiate(dentry);
+	}
+	return shfs_instantiate(dentry, &fattr);
 }
 
 static int
 shfs_create(struct inode* dir, struct dentry *dentry, umode_t mode, bool excl)
 {
 	struct shfs_sb_info *info = info_from_dentry(dentry);
+	struct shfs_fattr fattr;
 	char name[SHFS_PATH_MAX];
-	int result, forced_write = 0;
+	int result, mask, forced_write = 0;
 	
 	if (info->readonly)
 		return -EROFS;
@@ -296,13 +254,21 @@ shfs_create(struct inode* dir, struct dentry *dentry, umode_t mode, bool excl)
 		forced_write = 1;
 		mode |= S_IWUSR;
 	}
-	result = info->fops.create(info, name, mode);
+	fattr.f_mode = 0;
+	result = info->fops.create(info, name, mode, &fattr);
+	if (result < 0) {
+		shfs_invalid_dir_cache(dir);
+		return result;
+	}
+	result = shfs_instantiate(dentry, &fattr);
 	if (result < 0)
 		return result;
-	
-	shfs_invalid_dir_cache(dir);
-	result = shfs_instantiate(dentry);
-	if (forced_write && dentry->d_inode && dentry->d_inode->i_private)
+	/* ours, and empty: the open that follows needs no s_open */
+	mask = 1 << O_WRONLY;
+	if (mode & S_IRUSR)
+		mask |= 1 << O_RDONLY | 1 << O_RDWR;
+	shfs_set_open(dentry->d_inode, mask);
+	if (forced_write)
 		((struct shfs_inode_info *)dentry->d_inode->i_private)->unset_write_on_close = 1;
 	return result;
 }
@@ -322,9 +288,12 @@ shfs_rmdir(struct inode* dir, struct dentry *dentry)
 		return -ENAMETOOLONG;
 
 	result = info->fops.rmdir(info, name);
-	if (!result)
+	if (!result) {
 		shfs_renew_times(dentry);
-	shfs_invalid_dir_cache(dir);
+		shfs_names_update(dir, &dentry->d_name, NULL);
+	} else {
+		shfs_invalid_dir_cache(dir);
+	}
 	return result;
 }
 
@@ -349,9 +318,11 @@ shfs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_
 	if (!result) {
 		shfs_renew_times(old_dentry);
 		shfs_renew_times(new_dentry);
+		shfs_names_move(old_dir, &old_dentry->d_name, new_dir, &new_dentry->d_name);
+	} else {
+		shfs_invalid_dir_cache(old_dir);
+		shfs_invalid_dir_cache(new_dir);
 	}
-	shfs_invalid_dir_cache(old_dir);
-	shfs_invalid_dir_cache(new_dir);
 	return result;
 }
 
@@ -368,9 +339,12 @@ shfs_unlink(struct inode *dir, struct dentry *dentry)
 		return -ENAMETOOLONG;
 
 	result = info->fops.unlink(info, name);
-	if (!result)
+	if (!result) {
 		shfs_renew_times(dentry);
-	shfs_invalid_dir_cache(dir);
+		shfs_names_update(dir, &dentry->d_name, NULL);
+	} else {
+		shfs_invalid_dir_cache(dir);
+	}
 	return result;
 }
 
@@ -378,6 +352,7 @@ static int
 shfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentry)
 {
 	struct shfs_sb_info *info = info_from_dentry(old_dentry);
+	struct shfs_fattr fattr;
 	char old[SHFS_PATH_MAX], new[SHFS_PATH_MAX];
 	int result;
 
@@ -389,17 +364,20 @@ shfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentr
 	if (get_name(new_dentry, new) < 0)
 		return -ENAMETOOLONG;
 	
-	result = info->fops.link(info, old, new);
-	if (result < 0)
+	fattr.f_mode = 0;
+	result = info->fops.link(info, old, new, &fattr);
+	if (result < 0) {
+		shfs_invalid_dir_cache(dir);
 		return result;
-	shfs_invalid_dir_cache(dir);
-	return shfs_instantiate(new_dentry);
+	}
+	return shfs_instantiate(new_dentry, &fattr);
 }
 
 static int
 shfs_symlink(struct inode *dir, struct dentry *dentry, const char *oldname)
 {
 	struct shfs_sb_info *info = info_from_dentry(dentry);
+	struct shfs_fattr fattr;
 	char old[SHFS_PATH_MAX], new[SHFS_PATH_MAX];
 	int result;
 
@@ -412,28 +390,26 @@ shfs_symlink(struct inode *dir, struct dentry *dentry, const char *oldname)
 		return -ENAMETOOLONG;
 	strcpy(old, oldname);
 	
-	result = info->fops.symlink(info, old, new);
-	if (result < 0)
+	fattr.f_mode = 0;
+	result = info->fops.symlink(info, old, new, &fattr);
+	if (result < 0) {
+		shfs_invalid_dir_cache(dir);
 		return result;
-
-	shfs_invalid_dir_cache(dir);
-	return shfs_instantiate(dentry);
+	}
+	return shfs_instantiate(dentry, &fattr);
 }
 
 /*
- * Initialize a new dentry
+ * Initialize a new dentry, or one seen in a listing of its parent
  */
 void
 shfs_new_dentry(struct dentry *dentry)
 {
+	struct shfs_inode_info *i = dentry->d_parent->d_inode->i_private;
+
 	dentry->d_op = &shfs_dentry_operations;
 	dentry->d_time = jiffies;
-}
-
-void
-shfs_age_dentry(struct shfs_sb_info *info, struct dentry *dentry)
-{
-	dentry->d_time = jiffies - SHFS_MAX_AGE(info);
+	dentry->d_fsdata = (void *)i->list_gen;
 }
 
 /*
@@ -464,15 +440,21 @@ shfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 	age = jiffies - dentry->d_time;
 	
 	result = (age <= SHFS_MAX_AGE(info));
+	if (!IS_ROOT(dentry)) {
+		struct shfs_inode_info *i = dentry->d_parent->d_inode->i_private;
+
+		/* the parent was listed since, without it */
+		if ((unsigned long)dentry->d_fsdata != i->list_gen)
+			result = 0;
+	}
 	DEBUG("valid: %d\n", result);
 	if (!inode)
 		return result;	/* negative dentry */
-	mutex_lock(&info->shfs_mutex);
+	/* shfs_revalidate_inode() takes refresh_mutex itself */
 	if (is_bad_inode(inode))
 		result = 0;
 	else if (!result)
 		result = (shfs_revalidate_inode(dentry) == 0);
-	mutex_unlock(&info->shfs_mutex);
 	return result;
 }
 
@@ -490,9 +472,18 @@ shfs_d_delete(const struct dentry *dentry)
 	return 0;
 }
 
+/* lazyattr changes go before the inode does */
+static void
+shfs_d_iput(struct dentry *dentry, struct inode *inode)
+{
+	shfs_flush_attr(dentry, inode);
+	iput(inode);
+}
+
 static struct dentry_operations shfs_dentry_operations = {
 	.d_revalidate	= shfs_d_revalidate,
 	.d_delete		= shfs_d_delete,
+	.d_iput		= shfs_d_iput,
 };
 
 struct file_operations shfs_dir_operations = {
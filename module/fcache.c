@@ -1,8 +1,10 @@
 /*
  * fcache.c
  *
- * File cache: read/write operations are grouped together in chunks
- * and done together.
+ * File cache: the read streams (read-ahead windows) of a file, data go
+ * straight to the page cache (see shfs_file_readpage()).  A file has a
+ * few of them, so that readers of different parts of it do not reset
+ * each other's window.
  */
 
 #ifdef MODVERSIONS
@@ -12,35 +14,48 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "shfs_fs.h"
 #include "shfs_fs_sb.h"
 #include "shfs_fs_i.h"
 #include "shfs_debug.h"
 
-#define SHFS_FCACHE_READ  	0
-#define SHFS_FCACHE_WRITE 	1
+#define SHFS_FCACHE_STREAMS	8	/* in a file */
 
-struct shfs_file {
-	int		type:2;		/* why does gcc complain for 1-bit? */
-	int		new:1;
-	off_t		offset;
+struct shfs_stream {
+	struct list_head list;		/* sorted by offset */
+	off_t		offset;		/* last window */
 	unsigned long	count;
-	char          	*data;
+	unsigned long	used;		/* cache->clock when last used */
+};
+
+struct shfs_file {
+	unsigned long	clock;
+	struct list_head streams;
+	int		nr;
 };
 
 struct kmem_cache *file_cache = NULL;
+static struct kmem_cache *stream_cache = NULL;
+struct workqueue_struct *fcache_wq = NULL;
 
 void
 fcache_init(void)
 {
 	file_cache = kmem_cache_create("shfs_file", sizeof(struct shfs_file), 0, 0, NULL);
 	DEBUG("file_cache: %p\n", file_cache);
+	stream_cache = kmem_cache_create("shfs_stream", sizeof(struct shfs_stream), 0, 0, NULL);
+	DEBUG("stream_cache: %p\n", stream_cache);
+	fcache_wq = alloc_workqueue("shfs_fcache", WQ_UNBOUND, 0);
 }
 
 void
 fcache_finish(void)
 {
+	if (fcache_wq)
+		destroy_workqueue(fcache_wq);
+	kmem_cache_destroy(stream_cache);
 	kmem_cache_destroy(file_cache);
 }
 
@@ -58,26 +73,67 @@ alloc_fcache(struct shfs_sb_info *info)
 	spin_unlock(&info->fcache_lock);
 				
 	cache = (struct shfs_file *)KMEM_ALLOC("fcache", file_cache, GFP_KERNEL);
-	if (!cache)
-		return NULL;
-	cache->data = vmalloc(info->fcache_size);
-	if (!cache->data) {
-		KMEM_FREE("fcache", file_cache, cache);
+	if (!cache) {
+		spin_lock(&info->fcache_lock);
+		info->fcache_free++;
+		spin_unlock(&info->fcache_lock);
 		return NULL;
 	}
-	cache->type = SHFS_FCACHE_READ;
-	cache->new = 1;
-	cache->offset = 0;
-	cache->count = 0;
+	cache->clock = 0;
+	INIT_LIST_HEAD(&cache->streams);
+	cache->nr = 0;
 
 	return cache;
 }
 
+static struct shfs_stream *
+alloc_stream(struct shfs_file *cache, off_t offset)
+{
+	struct shfs_stream *e, *p;
+
+	e = (struct shfs_stream *)KMEM_ALLOC("stream", stream_cache, GFP_KERNEL);
+	if (!e)
+		return NULL;
+	e->offset = offset;
+	e->count = 0;
+	e->used = ++cache->clock;
+	list_for_each_entry(p, &cache->streams, list) {
+		if (p->offset > offset)
+			break;
+	}
+	list_add_tail(&e->list, &p->list);
+	cache->nr++;
+	return e;
+}
+
+static void
+free_stream(struct shfs_file *cache, struct shfs_stream *e)
+{
+	list_del(&e->list);
+	cache->nr--;
+	KMEM_FREE("stream", stream_cache, e);
+}
+
+static struct shfs_stream *
+lru_stream(struct shfs_file *cache)
+{
+	struct shfs_stream *e, *lru = NULL;
+
+	list_for_each_entry(e, &cache->streams, list) {
+		if (!lru || e->used < lru->used)
+			lru = e;
+	}
+	return lru;
+}
+
 static void
 free_fcache(struct shfs_sb_info *info, struct shfs_file *cache)
 {
+	struct shfs_stream *e, *n;
+
 	DEBUG("release\n");
-	vfree(cache->data);
+	list_for_each_entry_safe(e, n, &cache->streams, list)
+		free_stream(cache, e);
 	KMEM_FREE("fcache", file_cache, cache);
 
 	spin_lock(&info->fcache_lock);
@@ -105,72 +161,30 @@ fcache_file_open(struct file *f)
 		VERBOSE("inode without info\n");
 		return -EINVAL;
 	}
+	p->cache_users++;
 	if (!p->cache)
 		p->cache = alloc_fcache(info_from_dentry(f->f_dentry));
 	return 0;
 }
 
 int 
-fcache_file_sync(struct file *f)
+fcache_file_close(struct file *f)
 {
-	struct inode *inode;
 	struct shfs_inode_info *p;
-	struct shfs_file *cache;
-	int result;
 
-	if (!f->f_dentry || !(inode = f->f_dentry->d_inode)) {
-		VERBOSE("invalid\n");
-		return -EINVAL;
-	}
-	DEBUG("ino: %lu\n", inode->i_ino);
-	if (S_ISDIR(inode->i_mode)) {
-		VERBOSE("dir in file cache?\n");
-		return -EINVAL;
-	}
-	p = (struct shfs_inode_info *)inode->i_private;
+	p = (struct shfs_inode_info *)f->f_dentry->d_inode->i_private;
 	if (!p) {
 		VERBOSE("inode without info\n");
 		return -EINVAL;
 	}
-	if (!p->cache)
+	/* streams of the other readers stay */
+	if (--p->cache_users > 0)
 		return 0;
-
-	cache = p->cache;
-	result = 0;
-	if (cache->count && cache->type == SHFS_FCACHE_WRITE) {
-		char name[SHFS_PATH_MAX];
-		struct shfs_sb_info *info = info_from_dentry(f->f_dentry);
-
-		DEBUG("sync\n");
-		if (get_name(f->f_dentry, name) < 0)
-			return -ENAMETOOLONG;
-		result = info->fops.write(info, name, cache->offset, cache->count, cache->data, inode->i_ino);
-		cache->type = SHFS_FCACHE_READ;
-		cache->count = 0;
-	}
-	return result < 0 ? result : 0;
-}
-
-int 
-fcache_file_close(struct file *f)
-{
-	int result;
-
-	result = fcache_file_sync(f);
-	if (result == 0) {
-		struct shfs_inode_info *p;
-
-		p = (struct shfs_inode_info *)f->f_dentry->d_inode->i_private;
-		if (!p) {
-			VERBOSE("inode without info\n");
-			return -EINVAL;
-		}
-		if (!p->cache)
-			return 0;
+	if (p->cache) {
 		free_fcache(info_from_dentry(f->f_dentry), p->cache);
 		p->cache = NULL;
 	}
-	return result < 0 ? result : 0;
+	return 0;
 }
 
 int
@@ -178,6 +192,7 @@ fcache_file_clear(struct inode *inode)
 {
 	struct shfs_inode_info *p;
 	struct shfs_file *cache;
+	struct shfs_stream *e, *n;
 
 	if (!inode || S_ISDIR(inode->i_mode)) {
 		DEBUG("invalid\n");
@@ -193,201 +208,74 @@ fcache_file_clear(struct inode *inode)
 		return 0;
 
 	cache = p->cache;
-	if (cache->count) {
-		if (cache->type == SHFS_FCACHE_WRITE) {
-			VERBOSE("Aieeee, out of sync\n");
-		} else {
-			cache->count = 0;
-		}
-	}
+	list_for_each_entry_safe(e, n, &cache->streams, list)
+		free_stream(cache, e);
 	return 0;
 }
 
-int 
-fcache_file_read(struct file *f, unsigned offset, unsigned count, char *buffer)
+/*
+ * Number of pages to read at page index.  The window of a read stream
+ * doubles while it goes on sequentially, other reads get one page and
+ * start a stream of their own (POSIX_FADV_RANDOM: always one page,
+ * POSIX_FADV_SEQUENTIAL: streams start with the largest window).
+ */
+int
+fcache_file_window(struct file *f, unsigned long index)
 {
-	char name[SHFS_PATH_MAX];
 	struct shfs_sb_info *info;
-	unsigned readahead, c, o, x, y, z, read = 0;
 	struct inode *inode;
 	struct shfs_inode_info *p;
 	struct shfs_file *cache;
-	int result = 0;
+	struct shfs_stream *e;
+	unsigned long pages, max;
+	off_t offset;
 
-	DEBUG("[%u, %u]\n", offset, count);
 	if (!f->f_dentry || !(inode = f->f_dentry->d_inode)) {
 		VERBOSE("invalid\n");
-		return -EINVAL;
-	}
-	if (get_name(f->f_dentry, name) < 0)
-		return -ENAMETOOLONG;
-	DEBUG("ino: %lu\n", inode->i_ino);
-	if (S_ISDIR(inode->i_mode)) {
-		VERBOSE("dir in file cache?\n");
-		return -EINVAL;
+		return 1;
 	}
+	DEBUG("ino: %lu [%lu]\n", inode->i_ino, index);
 	p = (struct shfs_inode_info *)inode->i_private;
 	if (!p) {
 		VERBOSE("inode without info\n");
-		return -EINVAL;
-			return result;
+		return 1;
 	}
 	info = info_from_dentry(f->f_dentry);
 	if (!p->cache) {
 		p->cache = alloc_fcache(info);
 		if (!p->cache)
-			return info->fops.read(info, name, offset, count, buffer, 0);
+			return 1;
 	}
 
 	cache = p->cache;
-	/* hit? */
-	if (offset >= cache->offset && offset < (cache->offset + cache->count)) {
-		o = offset - cache->offset;
-		c = count > cache->count - o ? cache->count - o : count;
-		memcpy(buffer, cache->data + o, c);
-		buffer += c;
-		offset += c;
-		count -= c;
-		read += c;
-	}
-
-	if (count && cache->type == SHFS_FCACHE_WRITE) {
-		info->fops.write(info, name, cache->offset, cache->count, cache->data, inode->i_ino);
-		cache->type = SHFS_FCACHE_READ;
-		cache->offset = offset;
-		cache->count = 0;
-	}
-
-	while (count) {
-		o = offset & PAGE_MASK;
-		x = offset - o;
-		if (cache->offset + cache->count == offset)
-			readahead = cache->count;
-		else {
-			cache->offset = o;
-			cache->count = 0;
-			readahead = 0;
-		}
-		if (readahead < (x + count))
-			readahead = x + count;
-		readahead = (readahead+PAGE_SIZE-1) & PAGE_MASK;
-		if (readahead > info->fcache_size)
-			readahead = info->fcache_size;
-		if (o % readahead) {	 /* HD */
-			y = o, z = readahead;
-			while (y && z)
-				if (y > z) y %= z; else z %= y;
-			readahead = y > z ? y : z;
-		}
-		if (cache->count + readahead > info->fcache_size) {
-			cache->offset = o;
-			cache->count = 0;
-		}
-		DEBUG("[%u, %u]\n", o, readahead);
-		result = info->fops.read(info, name, o, readahead, cache->data+cache->count, 0);
-		if (result < 0) {
-			cache->count = 0;
-			return result;
-		}
-
-		c = result - x;
-		if (c > count)
-			c = count;
-		memcpy(buffer, cache->data + cache->count + x, c);
-		buffer += c;
-		offset += c;
-		count -= c;
-		read += c;
-		cache->count += result;
-	}
-	return read;
-}
-
-int 
-fcache_file_write(struct file *f, unsigned offset, unsigned count, char *buffer)
-{
-	struct dentry *dentry = f->f_dentry;
-	char name[SHFS_PATH_MAX];
-	struct shfs_sb_info *info;
-	unsigned o, c, wrote = 0;
-	struct inode *inode;
-	struct shfs_inode_info *p;
-	struct shfs_file *cache;
-	int result = 0;
-
-	DEBUG("[%u, %u]\n", offset, count);
-	if (!(inode = dentry->d_inode)) {
-		VERBOSE("invalid\n");
-		return -EINVAL;
-	}
-	if (get_name(dentry, name) < 0)
-		return -ENAMETOOLONG;
-	DEBUG("ino: %lu\n", inode->i_ino);
-	if (S_ISDIR(inode->i_mode)) {
-		VERBOSE("dir in file cache?\n");
-		return -EINVAL;
-	}
-	p = (struct shfs_inode_info *)inode->i_private;
-	if (!p) {
-		VERBOSE("inode without info\n");
-		return -EINVAL;
-	}
-	info = info_from_dentry(dentry);
-	if (!p->cache) {
-		p->cache = alloc_fcache(info);
-		if (!p->cache)
-			return info->fops.write(info, name, offset, count, buffer, inode->i_ino);
-	}
-
-	cache = p->cache;
-	if (cache->type == SHFS_FCACHE_READ) {
-		cache->offset = offset;
-		cache->count = 0;
-		cache->type = SHFS_FCACHE_WRITE;
-	}
-
-	DEBUG("1 [%lu, %lu]\n", cache->offset, cache->count);
-	if (offset >= cache->offset && offset < (cache->offset + cache->count)) {
-		o = offset - cache->offset;
-		c = count > info->fcache_size - o ? info->fcache_size - o : count;
-		memcpy(cache->data + o, buffer, c);
-		if (o + c > cache->count)
-			cache->count = o + c;
-		buffer += c;
-		offset += c;
-		count -= c;
-		wrote += c;
-	}
-	DEBUG("2 [%lu, %lu]\n", cache->offset, cache->count);
-	if (count && offset == cache->offset+cache->count) {
-		o = offset - cache->offset;
-		c = count > info->fcache_size - cache->count ? info->fcache_size - cache->count : count;
-		memcpy(cache->data + o, buffer, c);
-		cache->count += c;
-		buffer += c;
-		offset += c;
-		count -= c;
-		wrote += c;
-	}
-	DEBUG("3 [%lu, %lu]\n", cache->offset, cache->count);
-	while (count) {
-		result = info->fops.write(info, name, cache->offset, cache->count, cache->data, inode->i_ino);
-		if (result < 0)
+	max = info->fcache_size >> PAGE_CACHE_SHIFT;
+	offset = index << PAGE_CACHE_SHIFT;
+	if (f->f_mode & FMODE_RANDOM)
+		return 1;
+	/* short windows (pages already cached) still count as sequential */
+	list_for_each_entry(e, &cache->streams, list) {
+		if (offset > e->offset && offset <= e->offset + e->count)
 			break;
-		c = count > info->fcache_size ? info->fcache_size : count;
-		memcpy(cache->data, buffer, c);
-		cache->offset = offset;
-		cache->count = c;
-		buffer += c;
-		offset += c;
-		count -= c;
-		wrote += c;
 	}
-	DEBUG("4 [%lu, %lu]\n", cache->offset, cache->count);
-	if (cache->new && wrote) {
-		result = info->fops.write(info, name, cache->offset, 1, cache->data, inode->i_ino);
-		cache->new = 0;
+	if (&e->list != &cache->streams) {
+		pages = (e->count >> PAGE_CACHE_SHIFT) * 2;
+		e->used = ++cache->clock;
+	} else {
+		pages = 1;
+		if (f->f_ra.ra_pages > f->f_mapping->backing_dev_info->ra_pages)
+			pages = max;
+		if (cache->nr >= SHFS_FCACHE_STREAMS)
+			free_stream(cache, lru_stream(cache));
+		e = alloc_stream(cache, offset);
 	}
-
-	return result >= 0 ? wrote : result;
+	if (pages > max)
+		pages = max;
+	if (!pages)
+		pages = 1;
+	if (e) {
+		e->offset = offset;
+		e->count = pages << PAGE_CACHE_SHIFT;
+	}
+	DEBUG("[%lu, %lu]\n", index, pages);
+	return pages;
 }
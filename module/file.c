@@ -5,10 +5,14 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/highmem.h>
 #include <asm/uaccess.h>
 #include <asm/fcntl.h>
 #include <linux/mutex.h>
 #include <linux/stat.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
 
 #include "shfs_fs.h"
 #include "shfs_fs_sb.h"
@@ -16,141 +20,458 @@
 #include "shfs_debug.h"
 #include "proc.h"
 
+/*
+ * Read locked pages in a row from the remote file, then mark them
+ * uptodate, unlock and release them.  iov has room for nr entries.
+ */
 static int
-shfs_file_readpage(struct file *f, struct page *p)
+read_pages(struct dentry *dentry, struct page **pages, struct kvec *iov, int nr)
 {
-	struct dentry *dentry = f->f_dentry;
 	struct shfs_sb_info *info = info_from_dentry(dentry);
-	char *buffer;
+	char name[SHFS_PATH_MAX];
 	unsigned long offset, count;
-	int result;
-	
-	page_cache_get(p);
+	int n, result;
 
-	buffer = kmap(p);
-	offset = p->index << PAGE_CACHE_SHIFT;
-	count = PAGE_SIZE;
+	for (n = 0; n < nr; n++) {
+		iov[n].iov_base = kmap(pages[n]);
+		iov[n].iov_len = PAGE_CACHE_SIZE;
+	}
+	offset = pages[0]->index << PAGE_CACHE_SHIFT;
+	count = nr << PAGE_CACHE_SHIFT;
+	DEBUG("[%lu, %lu]\n", offset, count);
 
-	mutex_lock(&info->shfs_mutex);
-	do {
-		DEBUG("\n");
-		if (info->fcache_size) {
-			result = fcache_file_read(f, offset, count, buffer);
-		} else {
-			char name[SHFS_PATH_MAX];
-			if (get_name(f->f_dentry, name) < 0) {
-				mutex_unlock(&info->shfs_mutex);
-				result = -ENAMETOOLONG;
-				goto io_error;
-			}
-			result = info->fops.read(info, name, offset, count, buffer, 0);
+	if (!get_name(dentry, name)) {
+		result = -ENAMETOOLONG;
+	} else if (info->fops.readv) {
+		/* iov is consumed, page addresses are kept in pages[] */
+		result = info->fops.readv(info, name, offset, count, iov, nr);
+	} else {
+		for (n = 0, result = 0; n < nr && result >= 0; n++) {
+			result = info->fops.read(info, name, offset, PAGE_CACHE_SIZE, iov[n].iov_base, 0);
+			offset += PAGE_CACHE_SIZE;
 		}
-		if (result < 0) {
-			VERBOSE("!%d\n", result);
-			mutex_unlock(&info->shfs_mutex);
-			goto io_error;
+		result = result < 0 ? result : count;
+	}
+	if (result < 0)
+		VERBOSE("!%d\n", result);
+
+	for (n = 0; n < nr; n++) {
+		if (result >= 0) {
+			int c = result - (n << PAGE_CACHE_SHIFT);
+
+			if (c < 0)
+				c = 0;
+			if (c < PAGE_CACHE_SIZE)
+				memset(page_address(pages[n]) + c, 0, PAGE_CACHE_SIZE - c);
+			flush_dcache_page(pages[n]);
+			SetPageUptodate(pages[n]);
 		}
-		count -= result;
-		offset += result;
-		buffer += result;
-		dentry->d_inode->i_atime = CURRENT_TIME;
-		ROUND_TO_MINS(dentry->d_inode->i_atime);
-		if (!result)
-			break;
-	} while (count);
-
-	mutex_unlock(&info->shfs_mutex);
-	memset(buffer, 0, count);
-	flush_dcache_page(p);
-	SetPageUptodate(p);
-	result = 0;
-io_error:
-	kunmap(p);
-	unlock_page(p);	
-	page_cache_release(p);
+		kunmap(pages[n]);
+		unlock_page(pages[n]);
+		page_cache_release(pages[n]);
+	}
 	return result;
 }
 
-static int
-shfs_file_writepage(struct page *p, struct writeback_control *wbc)
+/* the shell server's dd reads in blocks of the request size */
+static inline int
+aligned_reads(struct shfs_sb_info *info)
 {
-	return -EFAULT;
+	return !info->range && !info->sftp;
 }
 
 /*
-static int
-shfs_file_preparewrite(struct file *f, struct page *p, unsigned offset, unsigned to)
+ * Pages in a row, in one request, or in requests aligned to their size
+ * if the server needs that (see aligned_reads())
+ */
+static void
+read_run(struct dentry *dentry, struct page **pages, struct kvec *iov, int nr)
 {
-	DEBUG("[%p, %u, %u]\n", p, offset, to);
-	return 0;
+	int n;
+
+	if (!aligned_reads(info_from_dentry(dentry))) {
+		if (nr)
+			read_pages(dentry, pages, iov, nr);
+		return;
+	}
+	while (nr) {
+		for (n = nr; pages[0]->index % n; n--)
+			;
+		read_pages(dentry, pages, iov, n);
+		pages += n;
+		nr -= n;
+	}
+}
+
+/* run of read-ahead pages being read in the background, see queue_run() */
+struct shfs_prefetch {
+	struct work_struct work;
+	struct file	*file;
+	int		nr;
+	struct page	*pages[0];	/* followed by nr struct kvec */
+};
+
+static void
+prefetch_work(struct work_struct *work)
+{
+	struct shfs_prefetch *pf = container_of(work, struct shfs_prefetch, work);
+
+	read_run(pf->file->f_dentry, pf->pages, (struct kvec *)(pf->pages + pf->nr), pf->nr);
+	fput(pf->file);
+	kfree(pf);
+}
+
+/*
+ * Start reading nr locked pages in a row, not waiting for them.  Readers
+ * wait on the page lock.  With no memory for it they are read one by
+ * one right away.
+ */
+static void
+queue_run(struct file *f, struct page **pages, int nr)
+{
+	struct shfs_prefetch *pf = NULL;
+	struct kvec iov;
+	int n;
+
+	if (fcache_wq)
+		pf = kmalloc(sizeof(*pf) + nr * (sizeof(struct page *) + sizeof(struct kvec)), GFP_KERNEL);
+	if (!pf) {
+		for (n = 0; n < nr; n++)
+			read_pages(f->f_dentry, pages + n, &iov, 1);
+		return;
+	}
+	DEBUG("[%lu, %d]\n", pages[0]->index, nr);
+	INIT_WORK(&pf->work, prefetch_work);
+	get_file(f);
+	pf->file = f;
+	pf->nr = nr;
+	memcpy(pf->pages, pages, nr * sizeof(struct page *));
+	queue_work(fcache_wq, &pf->work);
 }
 
+/*
+ * Read a window of pages starting at p straight into the page cache.  The
+ * window size comes from fcache, pages cached (or locked) already cut it
+ * short, and kept aligned to its size if the server needs that.
+ */
 static int
-shfs_file_commitwrite(struct file *f, struct page *p, unsigned offset, unsigned to)
+shfs_file_readpage(struct file *f, struct page *p)
 {
 	struct dentry *dentry = f->f_dentry;
+	struct inode *inode = dentry->d_inode;
 	struct shfs_sb_info *info = info_from_dentry(dentry);
-	struct inode *inode = p->mapping->host;
 	struct shfs_inode_info *i = (struct shfs_inode_info *)inode->i_private;
-	char *buffer = kmap(p) + offset;
-	int written = 0, result;
-	unsigned count = to - offset;
-	struct timespec time;
+	struct page *page1, **pages = &page1;
+	struct kvec iov1, *iov = &iov1;
+	unsigned long last;
+	int n, nr = 1, result;
 	
-	DEBUG("[%p, %u, %u]\n", p, offset, to);
-	offset += p->index << PAGE_CACHE_SHIFT;
-	mutex_lock(&info->shfs_mutex);
-	if (info->readonly) {
-		result = -EROFS;
-		goto error;
+	page_cache_get(p);
+
+	if (info->fcache_size) {
+		mutex_lock(&i->cache_mutex);
+		nr = fcache_file_window(f, p->index);
+		mutex_unlock(&i->cache_mutex);
+	}
+	last = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	if (p->index + nr > last)
+		nr = last > p->index ? last - p->index : 1;
+	if (nr > 1) {
+		pages = kmalloc(nr * sizeof(struct page *), GFP_KERNEL);
+		iov = kmalloc(nr * sizeof(struct kvec), GFP_KERNEL);
+		if (!pages || !iov) {
+			kfree(pages);
+			kfree(iov);
+			pages = &page1;
+			iov = &iov1;
+			nr = 1;
+		}
+	}
+	pages[0] = p;
+	for (n = 1; n < nr; n++) {
+		pages[n] = grab_cache_page_nowait(p->mapping, p->index + n);
+		if (!pages[n])
+			break;
+		if (PageUptodate(pages[n])) {
+			unlock_page(pages[n]);
+			page_cache_release(pages[n]);
+			break;
+		}
+	}
+	nr = n;
+	while (aligned_reads(info) && p->index % n)
+		n--;
+	for (; nr > n; nr--) {
+		unlock_page(pages[nr-1]);
+		page_cache_release(pages[nr-1]);
 	}
 
-	do {
-		if (info->fcache_size) {
-			result = fcache_file_write(f, offset, count, buffer);
-		} else {
-			char name[SHFS_PATH_MAX];
-			if (get_name(dentry, name) < 0) {
-				result = -ENAMETOOLONG;
-				goto error;
+	result = read_pages(dentry, pages, iov, nr);
+	if (pages != &page1) {
+		kfree(pages);
+		kfree(iov);
+	}
+	if (result < 0)
+		return result;
+
+	inode->i_atime = CURRENT_TIME;
+	ROUND_TO_MINS(inode->i_atime);
+	return 0;
+}
+
+/*
+ * Read-ahead of the VM (page faults too): the pages go to the page cache
+ * locked and each run of them in a row is read in the background, so
+ * that the VM's asynchronous read-ahead does not hold up the reader
+ */
+static int
+shfs_file_readpages(struct file *f, struct address_space *mapping,
+		    struct list_head *list, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct page *p, **pages;
+	int n = 0;
+
+	pages = kmalloc(nr_pages * sizeof(struct page *), GFP_KERNEL);
+	if (!pages) {
+		/* pages left are dropped, readpage gets them later */
+		return -ENOMEM;
+	}
+	DEBUG("[%lu, %u]\n", list_entry(list->prev, struct page, lru)->index, nr_pages);
+
+	/* list is in reverse order of index */
+	while (!list_empty(list)) {
+		p = list_entry(list->prev, struct page, lru);
+		list_del(&p->lru);
+		if (add_to_page_cache_lru(p, mapping, p->index, GFP_KERNEL)) {
+			page_cache_release(p);
+			continue;
+		}
+		if (n && p->index != pages[n-1]->index + 1) {
+			queue_run(f, pages, n);
+			n = 0;
+		}
+		pages[n++] = p;
+	}
+	if (n)
+		queue_run(f, pages, n);
+	kfree(pages);
+
+	inode->i_atime = CURRENT_TIME;
+	ROUND_TO_MINS(inode->i_atime);
+	return 0;
+}
+
+/*
+ * Send pages in a row to the remote file in one write and end their
+ * writeback.  Pages are unlocked and under writeback already, the part
+ * past EOF is not sent.
+ */
+static int
+write_pages(struct inode *inode, struct page **pages, int nr)
+{
+	struct dentry *dentry;
+	char name[SHFS_PATH_MAX];
+	loff_t offset = page_offset(pages[0]), size = i_size_read(inode);
+	unsigned long count = nr << PAGE_CACHE_SHIFT;
+	char *buffer, *data;
+	int n, result = 0;
+
+	/* writeback must not recurse into the filesystem: no vmap() */
+	if (nr > 1) {
+		buffer = kmalloc(nr << PAGE_CACHE_SHIFT, GFP_NOFS | __GFP_NOWARN);
+		if (!buffer) {
+			for (n = 0; n < nr; n++) {
+				int r = write_pages(inode, pages + n, 1);
+				if (r < 0)
+					result = r;
+			}
+			return result;
+		}
+		for (n = 0; n < nr; n++) {
+			memcpy(buffer + (n << PAGE_CACHE_SHIFT), kmap(pages[n]), PAGE_CACHE_SIZE);
+			kunmap(pages[n]);
+		}
+	} else {
+		buffer = kmap(pages[0]);
+	}
+	if (offset + count > size)
+		count = size > offset ? size - offset : 0;
+	DEBUG("[%lu, %lu]\n", (unsigned long)offset, count);
+
+	dentry = count ? d_find_alias(inode) : NULL;
+	if (!count) {
+		result = 0;
+	} else if (!dentry) {
+		result = -EIO;
+	} else if (!get_name(dentry, name)) {
+		result = -ENAMETOOLONG;
+	} else {
+		for (data = buffer; count; data += result) {
+			result = shfs_write(inode, name, offset, count, data);
+			if (result <= 0) {
+				result = result < 0 ? result : -EIO;
+				break;
 			}
-			result = info->fops.write(info, name, offset, count, buffer, dentry->d_inode->i_ino);
+			offset += result;
+			count -= result;
 		}
+	}
+	dput(dentry);
+	if (result < 0)
+		VERBOSE("!%d\n", result);
+
+	if (nr > 1)
+		kfree(buffer);
+	else
+		kunmap(pages[0]);
+	for (n = 0; n < nr; n++) {
 		if (result < 0) {
-			VERBOSE("!%d\n", result);
-			goto error;
+			SetPageError(pages[n]);
+			mapping_set_error(inode->i_mapping, result);
 		}
-		count -= result;
-		offset += result;
-		buffer += result;
-		written += result;
-		if (!result)
-			break;
+		end_page_writeback(pages[n]);
+	}
+	return result < 0 ? result : 0;
+}
+
+static int
+shfs_file_writepage(struct page *p, struct writeback_control *wbc)
+{
+	set_page_writeback(p);
+	unlock_page(p);
+	return write_pages(p->mapping->host, &p, 1);
+}
+
+/* dirty pages in a row gathered by shfs_file_writepages() */
+struct shfs_wrun {
+	struct inode	*inode;
+	struct page	**pages;
+	int		nr, max;
+	int		result;
+};
 
-	} while (count);
+static void
+wrun_flush(struct shfs_wrun *w)
+{
+	int n, result;
+
+	if (!w->nr)
+		return;
+	result = write_pages(w->inode, w->pages, w->nr);
+	if (result < 0)
+		w->result = result;
+	for (n = 0; n < w->nr; n++)
+		page_cache_release(w->pages[n]);
+	w->nr = 0;
+}
 
-	memset(buffer, 0, count);
-	result = 0;
-error:
-	mutex_unlock(&info->shfs_mutex);
-	kunmap(p);
-
-	DEBUG("[%u, %lld]\n", offset, inode->i_size);
-	time = CURRENT_TIME;
-	ROUND_TO_MINS(time);
-	if (!timespec_equal(&time, &inode->i_mtime)) {
-		inode->i_atime = inode->i_mtime = time;
-		if (i)
-			i->oldmtime = 0;        // force inode reload
+static int
+wrun_add(struct page *p, struct writeback_control *wbc, void *data)
+{
+	struct shfs_wrun *w = (struct shfs_wrun *)data;
+
+	if (w->nr && (w->nr == w->max || p->index != w->pages[w->nr-1]->index + 1))
+		wrun_flush(w);
+	page_cache_get(p);
+	set_page_writeback(p);
+	unlock_page(p);
+	w->pages[w->nr++] = p;
+	return 0;
+}
+
+/*
+ * Dirty pages in a row go out in one s_write of up to cachesize pages
+ * (one page if the file cache is off)
+ */
+static int
+shfs_file_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct shfs_sb_info *info = info_from_inode(mapping->host);
+	struct page *page1;
+	struct shfs_wrun w;
+	int result;
+
+	w.inode = mapping->host;
+	w.nr = 0;
+	w.result = 0;
+	w.max = info->fcache_size >> PAGE_CACHE_SHIFT;
+	w.pages = NULL;
+	if (w.max > 1)
+		w.pages = kmalloc(w.max * sizeof(struct page *), GFP_NOFS);
+	if (!w.pages) {
+		w.pages = &page1;
+		w.max = 1;
 	}
-	if (offset > inode->i_size) {
-		inode->i_size = offset;
-		if (i)
-			i->oldmtime = 0;        // force inode reload
+	result = write_cache_pages(mapping, wbc, wrun_add, &w);
+	wrun_flush(&w);
+	if (w.pages != &page1)
+		kfree(w.pages);
+	return result < 0 ? result : w.result;
+}
+
+/* a page partly written is read first, unless it lies past EOF */
+static int
+shfs_file_write_begin(struct file *f, struct address_space *mapping, loff_t pos,
+		      unsigned len, unsigned flags, struct page **pagep, void **fsdata)
+{
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	struct page *p;
+	struct kvec iov;
+	int result;
+
+again:
+	p = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT, flags);
+	if (!p)
+		return -ENOMEM;
+	*pagep = p;
+	if (PageUptodate(p) || len == PAGE_CACHE_SIZE)
+		return 0;
+	if (page_offset(p) >= i_size_read(mapping->host)) {
+		zero_user_segments(p, 0, from, from + len, PAGE_CACHE_SIZE);
+		return 0;
 	}
-	return result;
+
+	page_cache_get(p);
+	result = read_pages(f->f_dentry, &p, &iov, 1);
+	lock_page(p);
+	if (p->mapping != mapping) {
+		unlock_page(p);
+		page_cache_release(p);
+		goto again;
+	}
+	if (result >= 0 && !PageUptodate(p))
+		result = -EIO;
+	if (result < 0) {
+		unlock_page(p);
+		page_cache_release(p);
+	}
+	return result < 0 ? result : 0;
+}
+
+/* data goes to the server on writeback, see shfs_file_writepages() */
+static int
+shfs_file_write_end(struct file *f, struct address_space *mapping, loff_t pos,
+		    unsigned len, unsigned copied, struct page *p, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(p)) {
+		/* short copy into a page not read: let the caller retry */
+		if (copied < len)
+			copied = 0;
+		else
+			SetPageUptodate(p);
+	}
+	if (copied) {
+		if (pos + copied > inode->i_size)
+			i_size_write(inode, pos + copied);
+		set_page_dirty(p);
+	}
+	unlock_page(p);
+	page_cache_release(p);
+	return copied;
 }
-*/
 
 static int
 shfs_file_permission(struct inode *inode, int mask)
@@ -163,6 +484,35 @@ shfs_file_permission(struct inode *inode, int mask)
 	return 0;
 }
 
+/*
+ * s_open only checks access and looks for files with content but no
+ * size (/proc), its verdict is kept for as long as attributes are
+ */
+void
+shfs_set_open(struct inode *inode, int mask)
+{
+	struct shfs_sb_info *info = info_from_inode(inode);
+	struct shfs_inode_info *i = (struct shfs_inode_info *)inode->i_private;
+
+	if (!time_before(jiffies, i->open_time + SHFS_MAX_AGE(info)))
+		i->open_ok = 0;
+	i->open_ok |= mask;
+	i->open_time = jiffies;
+}
+
+/* no need to ask s_open: known, or anyone may open a file with size */
+static int
+open_known(struct shfs_sb_info *info, struct inode *inode, int mode)
+{
+	struct shfs_inode_info *i = (struct shfs_inode_info *)inode->i_private;
+	int mask = mode == O_RDONLY ? S_IROTH : mode == O_WRONLY ? S_IWOTH : S_IROTH|S_IWOTH;
+
+	if ((i->open_ok & (1 << mode)) && time_before(jiffies, i->open_time + SHFS_MAX_AGE(info)))
+		return 1;
+	return S_ISREG(inode->i_mode) && inode->i_size && (inode->i_mode & mask) == mask
+		&& time_before(jiffies, i->oldmtime + SHFS_MAX_AGE(info));
+}
+
 static int
 shfs_file_open(struct inode *inode, struct file *f)
 {
@@ -178,7 +528,13 @@ shfs_file_open(struct inode *inode, struct file *f)
 	if (!get_name(dentry, name))
 		return -ENAMETOOLONG;
 
-	result = info->fops.open(info, name, mode);
+	if (open_known(info, inode, mode)) {
+		result = 0;
+	} else {
+		result = info->fops.open(info, name, mode);
+		if (!result)
+			shfs_set_open(inode, 1 << mode);
+	}
 
 	switch (result) {
 	case 1:			/* install special read handler for this file */
@@ -187,8 +543,13 @@ shfs_file_open(struct inode *inode, struct file *f)
 		result = 0;
 		/* fallthrough */
 	case 0:
-		if (info->fcache_size)
+		if (info->fcache_size) {
+			struct shfs_inode_info *i = (struct shfs_inode_info *)inode->i_private;
+
+			mutex_lock(&i->cache_mutex);
 			fcache_file_open(f);
+			mutex_unlock(&i->cache_mutex);
+		}
 		break;
 	default:		/* error */
 		DEBUG("!%d\n", result);
@@ -200,27 +561,16 @@ shfs_file_open(struct inode *inode, struct file *f)
 	return result;
 }
 
+/* close sends dirty pages */
 static int
 do_file_flush(struct file *f)
 {
 	struct dentry *dentry = f->f_dentry;
-	struct shfs_sb_info *info = info_from_dentry(dentry);
-	int result = 0;
 
 	DEBUG("%s\n", dentry->d_name.name);
-	if (info->fcache_size) {
-		result = fcache_file_sync(f);
-		if (result < 0)
-			shfs_invalid_dir_cache(dentry->d_parent->d_inode);
-		if (!result) {
-			/* last reference */
-			mutex_lock(&info->shfs_mutex);
-			filemap_fdatawrite(dentry->d_inode->i_mapping);
-			filemap_fdatawait(dentry->d_inode->i_mapping);
-			mutex_unlock(&info->shfs_mutex);
-		}
-	}
-	return result < 0 ? result : 0;
+	if (!(f->f_mode & FMODE_WRITE))
+		return 0;
+	return filemap_write_and_wait(dentry->d_inode->i_mapping);
 }
 
 static int
@@ -238,17 +588,16 @@ shfs_file_release(struct inode *inode, struct file *f)
 
 	DEBUG("%s\n", dentry->d_name.name);
 	if (info->fcache_size) {
-		result = fcache_file_close(f);
-		if (result < 0)
-			shfs_invalid_dir_cache(dentry->d_parent->d_inode);
-		if (!result) {
-			/* last reference */
-			mutex_lock(&info->shfs_mutex);
-			filemap_fdatawrite(dentry->d_inode->i_mapping);
-			filemap_fdatawait(dentry->d_inode->i_mapping);
-			mutex_unlock(&info->shfs_mutex);
-		}
+		struct shfs_inode_info *i = (struct shfs_inode_info *)inode->i_private;
+
+		mutex_lock(&i->cache_mutex);
+		fcache_file_close(f);
+		mutex_unlock(&i->cache_mutex);
 	}
+	/* shared mappings dirty pages until the last reference goes */
+	if (f->f_mode & FMODE_WRITE)
+		filemap_write_and_wait(inode->i_mapping);
+	shfs_flush_attr(dentry, inode);
 	/* if file was forced to be writeable, change attrs back on close */
 	if (dentry->d_inode && dentry->d_inode->i_private) {
 		if  (((struct shfs_inode_info *)dentry->d_inode->i_private)->unset_write_on_close) {
@@ -256,7 +605,7 @@ shfs_file_release(struct inode *inode, struct file *f)
 
 			if (get_name(dentry, name) < 0)
 				goto out;
-			result = info->fops.chmod(info, name, dentry->d_inode->i_mode & ~S_IWUSR);
+			result = info->fops.chmod(info, name, dentry->d_inode->i_mode & ~S_IWUSR, NULL);
 			if (result < 0)
 				goto out;
 			inode->i_mode &= ~S_IWUSR;
@@ -269,7 +618,12 @@ out:
 static int
 shfs_file_sync(struct file *f, loff_t start, loff_t end, int datasync)
 {
-	return 0;
+	int result;
+
+	result = filemap_write_and_wait_range(f->f_mapping, start, end);
+	if (result < 0)
+		return result;
+	return shfs_flush_attr(f->f_dentry, f->f_dentry->d_inode);
 }
 
 static ssize_t 
@@ -283,7 +637,6 @@ shfs_slow_read(struct file *f, char *buf, size_t count, loff_t *ppos)
 	
 	DEBUG("%s\n", dentry->d_name.name);
 
-	mutex_lock(&info->shfs_mutex);
 	page = __get_free_page(GFP_KERNEL);
 	if (!page) {
 		result = -ENOMEM;
@@ -307,7 +660,6 @@ shfs_slow_read(struct file *f, char *buf, size_t count, loff_t *ppos)
 error:
 	free_page(page);
 out:
-	mutex_unlock(&info->shfs_mutex);
 	return result;
 }
 
@@ -368,8 +720,11 @@ struct inode_operations shfs_file_inode_operations = {
 
 struct address_space_operations shfs_file_aops = {
 	.readpage	= shfs_file_readpage,
+	.readpages	= shfs_file_readpages,
 	.writepage	= shfs_file_writepage,
-//	.prepare_write	= shfs_file_preparewrite,
-//	.commit_write	= shfs_file_commitwrite,
+	.writepages	= shfs_file_writepages,
+	.write_begin	= shfs_file_write_begin,
+	.write_end	= shfs_file_write_end,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
 };
 
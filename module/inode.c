@@ -15,6 +15,7 @@
 #include <linux/file.h>
 #include <linux/mutex.h>
 #include <linux/cred.h>
+#include <linux/pagemap.h>
 
 #include "shfs_fs.h"
 #include "shfs_fs_sb.h"
@@ -32,14 +33,14 @@ int debug_level;
 
 struct kmem_cache *inode_cache = NULL;
 
-void 
-shfs_set_inode_attr(struct inode *inode, struct shfs_fattr *fattr)
+static void
+copy_attr(struct inode *inode, struct shfs_fattr *fattr)
 {
 	struct shfs_sb_info *info = info_from_inode(inode);
 	struct shfs_inode_info *i = inode->i_private;
-	struct timespec last_time = inode->i_mtime;
-	loff_t last_size = inode->i_size;
 
+	if (inode->i_mode != fattr->f_mode)
+		i->open_ok = 0;
 	inode->i_mode 	= fattr->f_mode;
 	//inode->i_nlink	= fattr->f_nlink;
 	set_nlink(inode, fattr->f_nlink);
@@ -56,6 +57,23 @@ shfs_set_inode_attr(struct inode *inode, struct shfs_fattr *fattr)
 	inode->i_mtime	= fattr->f_mtime;
 //	inode->i_blksize= fattr->f_blksize;
 	inode->i_blocks	= fattr->f_blocks;
+	shfs_pending_attr(inode);
+}
+
+void
+shfs_set_inode_attr(struct inode *inode, struct shfs_fattr *fattr)
+{
+	struct shfs_inode_info *i = inode->i_private;
+	struct timespec last_time = inode->i_mtime;
+	loff_t last_size = inode->i_size;
+
+	/* writes not sent yet: size and data here are newer */
+	if (S_ISREG(inode->i_mode) && (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY)
+	    || mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK))) {
+		shfs_update_inode_attr(inode, fattr);
+		return;
+	}
+	copy_attr(inode, fattr);
 	inode->i_size	= fattr->f_size;
 
 	i->oldmtime = jiffies;
@@ -63,8 +81,41 @@ shfs_set_inode_attr(struct inode *inode, struct shfs_fattr *fattr)
 	if (!timespec_equal(&inode->i_mtime, &last_time) || inode->i_size != last_size) {
 		DEBUG("inode changed (%ld/%ld, %lu/%lu)\n", inode->i_mtime.tv_sec, last_time.tv_sec, (unsigned long)inode->i_size, (unsigned long)last_size);
 		invalidate_mapping_pages(inode->i_mapping, 0, -1);
+		mutex_lock(&i->cache_mutex);
 		fcache_file_clear(inode);
+		mutex_unlock(&i->cache_mutex);
+		if (S_ISDIR(inode->i_mode))
+			shfs_names_drop(inode);
+	}
+}
+
+/*
+ * Attributes our own change left the file with: the cached data is
+ * still good, i_size is kept as the caller set it
+ */
+void
+shfs_update_inode_attr(struct inode *inode, struct shfs_fattr *fattr)
+{
+	struct shfs_inode_info *i = inode->i_private;
+
+	copy_attr(inode, fattr);
+	i->oldmtime = jiffies;
+}
+
+/*
+ * Content of a small file sent with its lookup becomes its first page
+ * cache page; the file is known to be readable
+ */
+void
+shfs_set_inline(struct inode *inode, struct page *page)
+{
+	if (S_ISREG(inode->i_mode) && inode->i_size <= PAGE_CACHE_SIZE
+	    && !add_to_page_cache_lru(page, inode->i_mapping, 0, GFP_KERNEL)) {
+		SetPageUptodate(page);
+		unlock_page(page);
+		shfs_set_open(inode, 1 << O_RDONLY);
 	}
+	page_cache_release(page);
 }
 
 struct inode*
@@ -81,7 +132,17 @@ shfs_iget(struct super_block *sb, struct shfs_fattr *fattr)
 	if (!i)
 		return NULL;
 	i->cache = NULL;
+	mutex_init(&i->cache_mutex);
+	i->cache_users = 0;
+	mutex_init(&i->refresh_mutex);
+	spin_lock_init(&i->names_lock);
+	i->names = NULL;
+	i->names_gen = 0;
+	i->list_gen = 0;
 	i->unset_write_on_close = 0;
+	i->open_ok = 0;
+	i->open_time = 0;
+	i->pending.ia_valid = 0;
 	shfs_set_inode_attr(inode, fattr);
 
 	DEBUG("ino: %lu\n", inode->i_ino);
@@ -126,6 +187,24 @@ out:
 }
 */
 
+static void
+shfs_evict_inode(struct inode *inode)
+{
+	struct shfs_inode_info *i = inode->i_private;
+
+	DEBUG("ino: %lu\n", inode->i_ino);
+	truncate_inode_pages(&inode->i_data, 0);
+	clear_inode(inode);
+	if (i) {
+		/* flushed when the last dentry let go, unless that failed */
+		if (i->pending.ia_valid)
+			printk(KERN_NOTICE "shfs: ino %lu: attribute changes not sent\n", inode->i_ino);
+		shfs_names_put(i->names);
+		KMEM_FREE("inode", inode_cache, i);
+		inode->i_private = NULL;
+	}
+}
+
 /* borrowed from smbfs */
 static int
 shfs_refresh_inode(struct dentry *dentry)
@@ -143,7 +222,7 @@ shfs_refresh_inode(struct dentry *dentry)
 	if (get_name(dentry, name) < 0)
 		return -ENAMETOOLONG;
 
-	result = info->fops.stat(info, name, &fattr);
+	result = shfs_stat(info, name, &fattr, NULL);
 	if (result < 0)
 		goto out;
 
@@ -183,7 +262,8 @@ shfs_revalidate_inode(struct dentry *dentry)
         DEBUG("%s\n", dentry->d_name.name);
 	result = 0;
 
-	mutex_lock(&info->shfs_mutex);
+	/* others refreshing it meanwhile leave it fresh */
+	mutex_lock(&i->refresh_mutex);
 	if (is_bad_inode(inode))
 		goto out;
 	if (inode->i_sb->s_magic != SHFS_SUPER_MAGIC)
@@ -193,7 +273,7 @@ shfs_revalidate_inode(struct dentry *dentry)
 		
 	result = shfs_refresh_inode(dentry);
 out:
-	mutex_unlock(&info->shfs_mutex);
+	mutex_unlock(&i->refresh_mutex);
 	DEBUG("%d\n", result);
 	return result;
 }
@@ -207,21 +287,31 @@ shfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
 	return result;
 }
 
+/* sync, or the flusher after a while, sends lazyattr changes */
+static int
+shfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct dentry *dentry;
+	int result = 0;
+
+	dentry = d_find_alias(inode);
+	if (dentry) {
+		result = shfs_flush_attr(dentry, inode);
+		dput(dentry);
+	}
+	return result;
+}
+
 static void
 shfs_put_super(struct super_block *sb)
 {
 	struct shfs_sb_info *info = info_from_sb(sb);
-	int result;
+	int result, i;
 
 	result = info->fops.finish(info);
-	if (info->sock)
-		fput(info->sock);
-	if (!sock_lock(info)) {
-		VERBOSE("Cannot free caches!\n");
-		return;
-	}
-	kfree(info->sockbuf);
-	kfree(info->readlnbuf);
+	for (i = 0; i < info->conns; i++)
+		conn_free(&info->conn[i]);
+	bdi_destroy(&info->bdi);
 	kfree(info);
 	DEBUG("Super block discarded!\n");
 }
@@ -229,6 +319,8 @@ shfs_put_super(struct super_block *sb)
 struct super_operations shfs_sops = {
 	.drop_inode	= generic_delete_inode,
 	//.delete_inode	= shfs_delete_inode,
+	.evict_inode	= shfs_evict_inode,
+	.write_inode	= shfs_write_inode,
 	.put_super	= shfs_put_super,
 	.statfs		= shfs_statfs,
 };
@@ -255,7 +347,7 @@ shfs_read_super(struct super_block *sb, void *opts, int silent)
 	struct shfs_sb_info *info;
 	struct shfs_fattr root;
 	struct inode *root_inode;
-	int result;
+	int result, i;
 	
 	info = (struct shfs_sb_info*)kmalloc(sizeof(struct shfs_sb_info), GFP_KERNEL);
 	if (!info) {
@@ -281,36 +373,43 @@ shfs_read_super(struct super_block *sb, void *opts, int silent)
 	info->root_mode = (S_IRUSR | S_IWUSR | S_IXUSR | S_IFDIR);
 	info->fmask = 00177777;
 	info->mount_point[0] = 0;
-	//init_MUTEX(&info->sock_sem);
+	info->root[0] = 0;
 	mutex_init(&info->shfs_mutex);
-	info->sock = NULL;
-	info->sockbuf = (char *)kmalloc(SOCKBUF_SIZE, GFP_KERNEL);
-	if (!info->sockbuf) {
-		printk(KERN_NOTICE "Not enough kmem!\n");
-		goto out_no_mem;
-	}
-	info->readlnbuf_len = 0;
-	info->readlnbuf = (char *)kmalloc(READLNBUF_SIZE, GFP_KERNEL);
-	if (!info->readlnbuf) {
-		printk(KERN_NOTICE "Not enough kmem!\n");
-		kfree(info->sockbuf);
-		goto out_no_mem;
-	}
+	info->conns = 0;
+	atomic_set(&info->conn_next, 0);
 	spin_lock_init(&info->fcache_lock);
 	info->fcache_free = SHFS_FCACHE_MAX;
 	info->fcache_size = SHFS_FCACHE_PAGES * PAGE_SIZE;
-	info->garbage_read = 0;
-	info->garbage_write = 0;
-	info->garbage = 0;
+	spin_lock_init(&info->statv_lock);
+	INIT_LIST_HEAD(&info->statv_queue);
+	info->statv_busy = 0;
 	info->readonly = 0;
 	info->preserve_own = 0;
 	info->stable_symlinks = 0;
+	info->wdata = 0;
+	info->frame = 0;
+	info->sftp = 0;
+	info->plus = 0;
+	info->statv = 0;
+	info->attrs = 0;
+	info->seq = 0;
+	info->lazyattr = 0;
+	info->lookup = 0;
+	info->range = 0;
+	info->inline_max = 0;
 
 	debug_level = 0;
 	result = parse_options(info, (char *)opts);
 	if (result < 0)
 		goto out_no_opts;
-	if (!info->sock) {
+	/* s_statv replies are s_statplus records */
+	if (!info->statv || !info->plus)
+		info->fops.statv = NULL;
+	if (!info->plus)
+		info->attrs = 0;
+	if (!info->seq)
+		info->fops.seq = NULL;
+	if (!info->conns) {
 		VERBOSE("Socket not specified\n");
 		goto out_no_opts;
 	}
@@ -318,6 +417,23 @@ shfs_read_super(struct super_block *sb, void *opts, int silent)
 		printk(KERN_NOTICE "shfs: version mismatch (module: %d, mount: %d)\n", PROTO_VERSION, info->version);
 		goto out_no_opts;
 	}
+	for (i = 0; i < info->conns; i++) {
+		if (!info->conn[i].sock) {
+			VERBOSE("Invalid socket (%d)\n", i);
+			goto out_no_opts;
+		}
+		if (conn_init(&info->conn[i]) < 0) {
+			printk(KERN_NOTICE "Not enough kmem!\n");
+			goto out_no_opts;
+		}
+	}
+
+	if (bdi_setup_and_register(&info->bdi, "shfs", BDI_CAP_MAP_COPY) < 0)
+		goto out_no_opts;
+	/* the VM reads ahead up to cachesize */
+	if (info->fcache_size)
+		info->bdi.ra_pages = info->fcache_size >> PAGE_CACHE_SHIFT;
+	sb->s_bdi = &info->bdi;
 
 	init_root_dirent(info, &root);
 	root_inode = shfs_iget(sb, &root);
@@ -333,10 +449,10 @@ shfs_read_super(struct super_block *sb, void *opts, int silent)
 
 out_no_root:
 	iput(root_inode);
+	bdi_destroy(&info->bdi);
 out_no_opts:
-	kfree(info->sockbuf);
-	kfree(info->readlnbuf);
-out_no_mem:
+	for (i = 0; i < info->conns; i++)
+		conn_free(&info->conn[i]);
 	kfree(info);
 out:
 	DEBUG("failed\n");
@@ -362,6 +478,7 @@ init_shfs(void)
 {
 	printk(KERN_NOTICE "SHell File System, (c) 2002-2004 Miroslav Spousta\n");
 	fcache_init();
+	req_init();
 	inode_cache = kmem_cache_create("shfs_inode", sizeof(struct shfs_inode_info), 0, 0, NULL);
 	
 	debug_level = 0;
@@ -381,6 +498,7 @@ exit_shfs(void)
 #endif
 	unregister_filesystem(&sh_fs_type);
 	kmem_cache_destroy(inode_cache);
+	req_finish();
 	fcache_finish();
 }
 
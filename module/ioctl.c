@@ -27,18 +27,31 @@ shfs_ioctl(struct inode *inode, struct file *f,
 	   unsigned int cmd, unsigned long arg)
 {
 	struct shfs_sb_info *info = info_from_inode(inode);
+	struct shfs_conn *conn;
 	int result = -EINVAL;
 
 	switch (cmd) {
 	case SHFS_IOC_NEWCONN:
 		VERBOSE("Reconnect (%ld)\n", arg);
-		if (info->sock)
-			fput(info->sock);
-		info->sock = fget(arg);
-		info->garbage = 0;
-		info->garbage_read = 0;
-		info->garbage_write = 0;
-		VERBOSE(">%p\n", info->sock);
+		conn = conn_dead(info);
+		mutex_lock(&conn->send_mutex);
+		mutex_lock(&conn->recv_mutex);
+		if (conn->sock)
+			fput(conn->sock);
+		conn->sock = fget(arg);
+		conn_nofs(conn);
+		conn->readlnbuf_start = 0;
+		conn->readlnbuf_len = 0;
+		conn->garbage_read = 0;
+		conn->garbage_write = 0;
+		conn->rx_tag = 0;
+		conn->dead = 0;
+		conn->gen++;
+		mutex_unlock(&conn->recv_mutex);
+		mutex_unlock(&conn->send_mutex);
+		/* requests sent on the old socket fail */
+		wake_up_all(&conn->rx_wait);
+		VERBOSE(">%d: %p\n", (int)(conn - info->conn), conn->sock);
 		result = 0;
 		break;
 	default:
@@ -18,13 +18,16 @@
 #include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/pagemap.h>
 #include <linux/uio.h>
 #include <net/sock.h>
 #include <linux/sched.h>
 #include <linux/init_task.h>
+#include <linux/completion.h>
 
 #include "shfs_fs.h"
 #include "shfs_fs_sb.h"
+#include "shfs_fs_i.h"
 #include "shfs_debug.h"
 #include "proc.h"
 
@@ -59,6 +62,10 @@ parse_options(struct shfs_sb_info *info, char *opts)
 			if (strlen(p+4) + 1 > SHFS_PATH_MAX)
 				goto ugly_opts;
 			strcpy(info->mount_point, p+4);
+		} else if (strncmp(p, "root=", 5) == 0) {
+			if (strlen(p+5) + 1 > SHFS_PATH_MAX)
+				goto ugly_opts;
+			strcpy(info->root, p+5);
 		} else if (strncmp(p, "ro", 2) == 0) {
 			info->readonly = 1;
 		} else if (strncmp(p, "rw", 2) == 0) {
@@ -77,6 +84,34 @@ parse_options(struct shfs_sb_info *info, char *opts)
 			info->fmask &= ~(S_IXUSR|S_IXGRP|S_IXOTH);
 		} else if (strncmp(p, "preserve", 8) == 0) {
 			info->preserve_own = 1;
+		} else if (strncmp(p, "wdata", 5) == 0) {
+			info->wdata = 1;
+		} else if (strncmp(p, "frame", 5) == 0) {
+			info->frame = 1;
+		} else if (strncmp(p, "plus", 4) == 0) {
+			info->plus = 1;
+		} else if (strncmp(p, "statv", 5) == 0) {
+			info->statv = 1;
+		} else if (strncmp(p, "attrs", 5) == 0) {
+			info->attrs = 1;
+		} else if (strncmp(p, "seq", 3) == 0) {
+			info->seq = 1;
+		} else if (strncmp(p, "lazyattr", 8) == 0) {
+			info->lazyattr = 1;
+		} else if (strncmp(p, "lookup", 6) == 0) {
+			info->lookup = 1;
+		} else if (strncmp(p, "range", 5) == 0) {
+			info->range = 1;
+		} else if (strncmp(p, "inline", 6) == 0) {
+			if (strlen(p+6) > 6)
+				goto ugly_opts;
+			i = PAGE_SIZE;
+			if (p[6] == '=')
+				i = simple_strtoul(p+7, NULL, 10);
+			info->inline_max = i < PAGE_SIZE ? i : PAGE_SIZE;
+		} else if (strncmp(p, "sftp", 4) == 0) {
+			info->sftp = 1;
+			info->fops = sftp_fops;
 		} else if (strncmp(p, "cachesize=", 10) == 0) {
 			if (strlen(p+10) > 5)
 				goto ugly_opts;
@@ -123,9 +158,11 @@ parse_options(struct shfs_sb_info *info, char *opts)
 		} else if (strncmp(p, "fd=", 3) == 0) {
 			if (strlen(p+3) > 5)
 				goto ugly_opts;
+			if (info->conns >= SHFS_MAX_CONNS)
+				goto ugly_opts;
 			q = p+3;
 			i = simple_strtoul(q, &q, 10);
-			info->sock = fget(i);
+			info->conn[info->conns++].sock = fget(i);
 		} else if (strncmp(p, "version=", 8) == 0) {
 			if (strlen(p+8) > 5)
 				goto ugly_opts;
@@ -141,33 +178,107 @@ ugly_opts:
 	return -1;
 }
 
-static int clear_garbage(struct shfs_sb_info *);
+/* sock (if any) is already set by parse_options() */
+/* requests are sent from writeback too: no reclaim into the fs */
+void
+conn_nofs(struct shfs_conn *conn)
+{
+	struct inode *inode;
+
+	if (!conn->sock)
+		return;
+	inode = conn->sock->f_dentry->d_inode;
+	if (S_ISSOCK(inode->i_mode))
+		SOCKET_I(inode)->sk->sk_allocation = GFP_NOFS;
+}
+
+int
+conn_init(struct shfs_conn *conn)
+{
+	mutex_init(&conn->send_mutex);
+	mutex_init(&conn->recv_mutex);
+	init_waitqueue_head(&conn->rx_wait);
+	atomic_set(&conn->tag_next, 0);
+	atomic_set(&conn->pending, 0);
+	conn->rx_tag = 0;
+	conn->rx_status = 0;
+	conn->rx_len = 0;
+	conn->gen = 0;
+	conn->dead = 0;
+	conn->readlnbuf_start = 0;
+	conn->readlnbuf_len = 0;
+	conn->readlnbuf = (char *)kmalloc(READLNBUF_SIZE, GFP_KERNEL);
+	if (!conn->readlnbuf)
+		return -ENOMEM;
+	conn->garbage_read = 0;
+	conn->garbage_write = 0;
+	conn_nofs(conn);
+	return 0;
+}
+
+void
+conn_free(struct shfs_conn *conn)
+{
+	if (conn->sock)
+		fput(conn->sock);
+	conn->sock = NULL;
+	kfree(conn->readlnbuf);
+	conn->readlnbuf = NULL;
+}
+
+/*
+ * Find connection to be replaced by a new one (SHFS_IOC_NEWCONN): the
+ * first one which has lost its socket or whose peer has hung up.
+ */
+struct shfs_conn *
+conn_dead(struct shfs_sb_info *info)
+{
+	struct shfs_conn *conn;
+	struct inode *inode;
+	int i;
+
+	for (i = 0; i < info->conns; i++) {
+		conn = &info->conn[i];
+		if (!conn->sock || conn->dead)
+			return conn;
+		inode = conn->sock->f_dentry->d_inode;
+		if (S_ISSOCK(inode->i_mode) &&
+		    (SOCKET_I(inode)->sk->sk_shutdown & RCV_SHUTDOWN))
+			return conn;
+	}
+	return &info->conn[0];
+}
+
+/* socket is unusable until SHFS_IOC_NEWCONN, fail all waiters */
+static void
+conn_broken(struct shfs_conn *conn)
+{
+	conn->dead = 1;
+	wake_up_all(&conn->rx_wait);
+}
 
-#define BUFFER info->readlnbuf
-#define LEN    info->readlnbuf_len
+/* unread data are BUFFER[START..START+LEN) */
+#define BUFFER conn->readlnbuf
+#define START  conn->readlnbuf_start
+#define LEN    conn->readlnbuf_len
 
-/* sock_lock held */
+/* send_mutex held */
 int
-sock_write(struct shfs_sb_info *info, const void *buffer, int count)
+sock_write(struct shfs_conn *conn, const void *buffer, int count)
 {
-	struct file *f = info->sock;
+	struct file *f = conn->sock;
 	mm_segment_t fs;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
 	ssize_t result = 0;
-	loff_t begin;
+	loff_t pos = 0;
 #else 
 	int c, result = 0;
 #endif 
 	unsigned long flags, sigpipe;
 	sigset_t old_set;
 
-	if (!f)
+	if (!f || conn->dead)
 		return -EIO;
-	if (info->garbage) {
-		result = clear_garbage(info);
-		if (result < 0)
-			return result;
-	}
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19))
 	c = count;
@@ -184,13 +295,12 @@ sock_write(struct shfs_sb_info *info, const void *buffer, int count)
 	SIGUNLOCK(flags);
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
-	begin = f->f_pos;
-	result = do_sync_write(f, buffer, count, &f->f_pos);
+	/* f_pos is shared with the reader, sockets do not care */
+	result = do_sync_write(f, buffer, count, &pos);
 
 	if (result < 0) {
 		DEBUG("error: %zu\n", result);
-		fput(f);
-		info->sock = NULL;
+		conn_broken(conn);
 	}
 #else
 	do {
@@ -199,14 +309,13 @@ sock_write(struct shfs_sb_info *info, const void *buffer, int count)
 		//vec[0].iov_base = (void *)buffer;
 		//vec[0].iov_len = c;
 		//result = f->f_op->aio_write(f, (const struct iovec *) &vec, 1, &f->f_pos);
-		result = do_sync_write(f, BUFFER+LEN, c, &f->f_pos); 
+		result = do_sync_write(f, buffer, c, &f->f_pos); 
 
 		if (result < 0) {
 			DEBUG("error: %d\n", result);
 			if (result == -EAGAIN)
 				continue;
-			fput(f);
-			info->sock = NULL;
+			conn_broken(conn);
 			break;
 		}
 		buffer += result;
@@ -228,44 +337,101 @@ sock_write(struct shfs_sb_info *info, const void *buffer, int count)
 	DEBUG(">%zu\n", result);
 	if (result < 0)
 	#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
-		set_garbage(info, 1, count - (f->f_pos - begin));
+		set_garbage(conn, 1, count - pos);
 	#else
-		set_garbage(info, 1, c);
+		set_garbage(conn, 1, c);
 	#endif
 	else
 		result = count;
 	return result;
 }
 
-/* sock_lock held */
+/*
+ * Send all of iov (count bytes total) with one kernel_sendmsg(), so
+ * that command line and payload leave in a single segment train.
+ * send_mutex held.
+ */
+int
+sock_writev(struct shfs_conn *conn, struct kvec *iov, int nr, int count)
+{
+	struct file *f = conn->sock;
+	struct inode *inode;
+	struct msghdr msg;
+	int result = 0;
+	unsigned long flags, sigpipe;
+	sigset_t old_set;
+
+	if (!f || conn->dead)
+		return -EIO;
+
+	inode = f->f_dentry->d_inode;
+	if (!S_ISSOCK(inode->i_mode)) {
+		/* not a socket (cannot happen with shfsmount) */
+		for (; nr > 0; iov++, nr--) {
+			result = sock_write(conn, iov->iov_base, iov->iov_len);
+			if (result < 0)
+				return result;
+		}
+		return count;
+	}
+
+	SIGLOCK(flags);
+	sigpipe = sigismember(&current->pending.signal, SIGPIPE);
+	old_set = current->blocked;
+	siginitsetinv(&current->blocked, sigmask(SIGKILL)|sigmask(SIGSTOP));
+	SIGRECALC;
+	SIGUNLOCK(flags);
+
+	memset(&msg, 0, sizeof(msg));
+	result = kernel_sendmsg(SOCKET_I(inode), &msg, iov, nr, count);
+
+	SIGLOCK(flags);
+	if (result == -EPIPE && !sigpipe) {
+		sigdelset(&current->pending.signal, SIGPIPE);
+		result = -EIO;
+	}
+	current->blocked = old_set;
+	SIGRECALC;
+	SIGUNLOCK(flags);
+
+	DEBUG(">%d\n", result);
+	if (result < 0) {
+		conn_broken(conn);
+		return result;
+	}
+	if (result != count) {
+		/* killed in the middle, remote side still counts the bytes */
+		set_garbage(conn, 1, count - result);
+		return -EIO;
+	}
+	return count;
+}
+
+/* recv_mutex held */
 int
-sock_read(struct shfs_sb_info *info, void *buffer, int count)
+sock_read(struct shfs_conn *conn, void *buffer, int count)
 {
-	struct file *f = info->sock;
+	struct file *f = conn->sock;
 	mm_segment_t fs;
 	int c, result = 0;
 	unsigned long flags, sigpipe;
 	sigset_t old_set;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
-	loff_t begin;
+	loff_t pos = 0;
 #endif
 
-	if (!f)
+	if (!f || conn->dead)
 		return -EIO;
-	if (info->garbage) {
-		result = clear_garbage(info);
-		if (result < 0)
-			return result;
-	}
 	c = count;
 	if (LEN > 0) {
 		if (count > LEN)
 			c = LEN;
-		memcpy(buffer, BUFFER, c);
+		memcpy(buffer, BUFFER+START, c);
 		buffer += c;
+		START += c;
 		LEN -= c;
-		if (LEN > 0)
-			memmove(BUFFER, BUFFER+c, LEN);
+		if (!LEN)
+			START = 0;
 		c = count - c;
 	}
 
@@ -284,21 +450,26 @@ sock_read(struct shfs_sb_info *info, void *buffer, int count)
 	set_fs(get_ds());
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
-	begin = f->f_pos;
-	result = do_sync_read(f, buffer, c, &f->f_pos);
-
-	if (!result) {
-		/* peer has closed socket */
-		result = -EIO;
-	}
-	if (result < 0) {
-		DEBUG("error: %d\n", result);
-		fput(f);
-		info->sock = NULL;
-	}
+	/* stream socket may return less than asked for */
+	do {
+		result = do_sync_read(f, buffer, c, &pos);
+		if (!result) {
+			/* peer has closed socket */
+			result = -EIO;
+		}
+		if (result < 0) {
+			DEBUG("error: %d\n", result);
+			if (result == -EAGAIN)
+				continue;
+			conn_broken(conn);
+			break;
+		}
+		buffer += result;
+		c -= result;
+	} while (c > 0);
 #else
 	do {
-		result = do_sync_read(f, BUFFER+LEN, c, &f->f_pos);
+		result = do_sync_read(f, buffer, c, &f->f_pos);
 		if (!result) {
 			/*  peer has closed socket */
 			result = -EIO;
@@ -307,8 +478,7 @@ sock_read(struct shfs_sb_info *info, void *buffer, int count)
 			DEBUG("error: %d\n", result);
 			if (result == -EAGAIN)
 				continue;
-			fput(f);
-			info->sock = NULL;
+			conn_broken(conn);
 			break;
 		}
 		buffer += result;
@@ -329,51 +499,131 @@ sock_read(struct shfs_sb_info *info, void *buffer, int count)
 	
 	DEBUG("<%d\n", result);
 	if (result < 0)
-	#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
-		set_garbage(info, 0, count - (f->f_pos - begin));
-	#else
-		set_garbage(info, 0, c);
-	#endif
+		set_garbage(conn, 0, c);
 	else
 		result = count;
 	return result;
 }
  
-/* sock_lock held */
+/*
+ * Receive count bytes straight into iov (which is consumed), only the
+ * part sock_readln() has already buffered is copied.  recv_mutex held.
+ */
+int
+sock_readv(struct shfs_conn *conn, struct kvec *iov, int nr, int count)
+{
+	struct file *f = conn->sock;
+	struct inode *inode;
+	struct msghdr msg;
+	int c, left, result = 0;
+	unsigned long flags, sigpipe;
+	sigset_t old_set;
+
+	if (!f || conn->dead)
+		return -EIO;
+	left = count;
+	while (LEN > 0 && left > 0 && nr > 0) {
+		c = LEN < left ? LEN : left;
+		if (c > iov->iov_len)
+			c = iov->iov_len;
+		memcpy(iov->iov_base, BUFFER+START, c);
+		iov->iov_base += c;
+		iov->iov_len -= c;
+		if (!iov->iov_len)
+			iov++, nr--;
+		START += c;
+		LEN -= c;
+		left -= c;
+	}
+	if (!LEN)
+		START = 0;
+	if (!left)
+		return count;
+
+	inode = f->f_dentry->d_inode;
+	if (!S_ISSOCK(inode->i_mode)) {
+		/* not a socket (cannot happen with shfsmount) */
+		for (; nr > 0 && left > 0; iov++, nr--) {
+			c = iov->iov_len < left ? iov->iov_len : left;
+			result = sock_read(conn, iov->iov_base, c);
+			if (result < 0)
+				return result;
+			left -= c;
+		}
+		return count;
+	}
+
+	SIGLOCK(flags);
+	sigpipe = sigismember(&current->pending.signal, SIGPIPE);
+	old_set = current->blocked;
+	siginitsetinv(&current->blocked, sigmask(SIGKILL)|sigmask(SIGSTOP));
+	SIGRECALC;
+	SIGUNLOCK(flags);
+
+	/* partial receive leaves iov in a kernel dependent state, give up */
+	memset(&msg, 0, sizeof(msg));
+	result = kernel_recvmsg(SOCKET_I(inode), &msg, iov, nr, left, MSG_WAITALL);
+	if (result >= 0 && result != left)
+		result = -EIO;
+
+	SIGLOCK(flags);
+	if (result == -EPIPE && !sigpipe) {
+		sigdelset(&current->pending.signal, SIGPIPE);
+		result = -EIO;
+	}
+	current->blocked = old_set;
+	SIGRECALC;
+	SIGUNLOCK(flags);
+
+	DEBUG("<%d\n", result);
+	if (result < 0) {
+		conn_broken(conn);
+		return result;
+	}
+	return count;
+}
+
+/*
+ * Next line is returned in place (without '\n', zero terminated); it is
+ * valid until the next sock_* call.  Only the unfinished line is moved
+ * to the front of the buffer before reading more.  recv_mutex held.
+ */
 int 
-sock_readln(struct shfs_sb_info *info, char *buffer, int count)
+sock_getln(struct shfs_conn *conn, char **line)
 {
-	struct file *f = info->sock;
+	struct file *f = conn->sock;
 	mm_segment_t fs;
+	loff_t pos = 0;
 	int c, l = 0, result;
 	char *nl;
 	unsigned long flags, sigpipe;
 	sigset_t old_set;
 
-	if (!f)
+	if (!f || conn->dead)
 		return -EIO;
-	if (info->garbage) {
-		result = clear_garbage(info);
-		if (result < 0)
-			return result;
-	}
 	while (1) {
-		nl = memchr(BUFFER, '\n', LEN);
+		nl = memchr(BUFFER+START, '\n', LEN);
 		if (nl) {
 			*nl = '\0';
-			strncpy(buffer, BUFFER, count-1);
-			buffer[count-1] = '\0';
-			c = LEN-(nl-BUFFER+1);
-			if (c > 0)
-				memmove(BUFFER, nl+1, c);
-			LEN = c;
-
-			DEBUG("<%s\n", buffer);
-			return strlen(buffer);
+			*line = BUFFER+START;
+			c = nl - *line + 1;
+			START += c;
+			LEN -= c;
+			if (!LEN)
+				START = 0;
+
+			DEBUG("<%s\n", *line);
+			return c - 1;
+		}
+		if (START) {
+			if (LEN)
+				memmove(BUFFER, BUFFER+START, LEN);
+			START = 0;
 		}
 		DEBUG("miss(%d)\n", LEN);
 		c = READLNBUF_SIZE - LEN;
 		if (c == 0) {
+			/* too long, cut it */
 			BUFFER[READLNBUF_SIZE-1] = '\n';
 			continue;
 		}
@@ -388,7 +638,7 @@ sock_readln(struct shfs_sb_info *info, char *buffer, int count)
 		fs = get_fs();
 		set_fs(get_ds());
 
-		result = do_sync_read(f, BUFFER+LEN, c, &f->f_pos);
+		result = do_sync_read(f, BUFFER+LEN, c, &pos);
 		SIGLOCK(flags);
 		if (result == -EPIPE && !sigpipe) {
 			sigdelset(&current->pending.signal, SIGPIPE);
@@ -409,9 +659,7 @@ sock_readln(struct shfs_sb_info *info, char *buffer, int count)
 			DEBUG("error: %d\n", result);
 			if (result == -EAGAIN)
 				continue;
-			fput(f);
-			info->sock = NULL;
-			set_garbage(info, 0, c);
+			conn_broken(conn);
 			return result;
 		}
 		LEN += result;
@@ -422,6 +670,20 @@ sock_readln(struct shfs_sb_info *info, char *buffer, int count)
 	}
 }
 
+/* recv_mutex held */
+int 
+sock_readln(struct shfs_conn *conn, char *buffer, int count)
+{
+	char *line;
+	int result;
+
+	result = sock_getln(conn, &line);
+	if (result < 0)
+		return result;
+	strlcpy(buffer, line, count);
+	return strlen(buffer);
+}
+
 int
 reply(char *s)
 {
@@ -430,184 +692,878 @@ reply(char *s)
 	return simple_strtoul(s+4, NULL, 10);
 }
 
+/*
+ * Finish interrupted payload write with spaces, the remote side is
+ * still waiting for it.  send_mutex held.
+ */
 static int
-clear_garbage(struct shfs_sb_info *info)
+clear_garbage_write(struct shfs_conn *conn)
 {
-	static unsigned long seq = 12345;
 	char buffer[256];
-	int i, c, state, garbage;
-	int result;
+	int c, garbage, result = 0;
 
-	garbage = info->garbage_write;
-	if (garbage)
-		memset(buffer, ' ', sizeof(buffer));
+	garbage = conn->garbage_write;
+	memset(buffer, ' ', sizeof(buffer));
 	DEBUG(">%d\n", garbage);
 	while (garbage > 0) {
 		c = garbage < sizeof(buffer) ? garbage : sizeof(buffer);
-		info->garbage = 0;
-		result = sock_write(info, buffer, c);
-		if (result < 0) {
-			info->garbage_write = garbage;
+		result = sock_write(conn, buffer, c);
+		if (result < 0)
 			goto error;
-		}
 		garbage -= result;
 	}
-	info->garbage_write = 0;
-	garbage = info->garbage_read;
+	result = sock_write(conn, "\n", 1);
+error:
+	conn->garbage_write = result < 0 ? garbage : 0;
+	return result;
+}
+
+/* skip rest of unread payload; recv_mutex held */
+static int
+clear_garbage_read(struct shfs_conn *conn)
+{
+	char buffer[256];
+	int c, garbage, result = 0;
+
+	garbage = conn->garbage_read;
 	DEBUG("<%d\n", garbage);
 	while (garbage > 0) {
 		c = garbage < sizeof(buffer) ? garbage : sizeof(buffer);
-		info->garbage = 0;
-		result = sock_read(info, buffer, c);
-		if (result < 0) {
-			info->garbage_read = garbage;
-			goto error;
-		}
-		garbage -= result;
-	}
-	info->garbage_read = 0;
-		
-	info->garbage = 0;
-	sprintf(buffer, "\n\ns_ping %lu", seq);
-	result = sock_write(info, (void *)buffer, strlen(buffer));
-	if (result < 0)
-		goto error;
-	DEBUG("reading..\n");
-	state = 0;
-	for (i = 0; i < 100000; i++) {
-		info->garbage = 0;
-		result = sock_readln(info, buffer, sizeof(buffer));
+		result = sock_read(conn, buffer, c);
 		if (result < 0)
-			goto error;
-		if (((state == 0) || (state == 1)) && reply(buffer) == REP_PRELIM) {
-			state = 1;
-		} else if (state == 1 && simple_strtoul(buffer, NULL, 10) == (seq-1)) {
-			state = 2;
-		} else if (state == 2 && reply(buffer) == REP_NOP) {
-			DEBUG("cleared\n");
-			return 0;
-		} else {
-			state = 0;
-		}
+			break;
+		garbage -= result;
 	}
-error:
-	info->garbage = 1;
-	DEBUG("failed\n");
+	conn->garbage_read = result < 0 ? garbage : 0;
 	return result;
 }
 
+/*
+ * Our send was cut short, the remote side will not reply before it
+ * gets the rest: pad it or give up the connection.  send_mutex held.
+ */
+static void
+finish_send(struct shfs_conn *conn)
+{
+	if (conn->garbage_write && clear_garbage_write(conn) < 0)
+		conn_broken(conn);
+}
+
 void
-set_garbage(struct shfs_sb_info *info, int write, int count)
+set_garbage(struct shfs_conn *conn, int write, int count)
 {
-	info->garbage = 1;
 	if (write)
-		info->garbage_write = count;
+		conn->garbage_write = count;
 	else
-		info->garbage_read = count;
+		conn->garbage_read = count;
 }
 
-int
-get_name(struct dentry *d, char *name)
+struct kmem_cache *req_cache = NULL;
+
+void
+req_init(void)
 {
-	int len = 0;
-	struct dentry *p;
+	req_cache = kmem_cache_create("shfs_req", sizeof(struct shfs_req), 0, 0, NULL);
+	DEBUG("req_cache: %p\n", req_cache);
+}
 
-	for (p = d; !IS_ROOT(p); p = p->d_parent)
-		len += p->d_name.len + 1;
-		
-	if (len + 1 > SHFS_PATH_MAX) 
-		return 0;
-	if (len == 0) {
-		name[0] = '/';
-		name[1] = '\0';
-		return 1;
-	}
-	
-	name[len] = '\0';
-	for (p = d; !IS_ROOT(p); p = p->d_parent) {
-		len -= p->d_name.len;
-		strncpy(&(name[len]), p->d_name.name, p->d_name.len);
-		len--;
-		name[len] = '/';
-	}
+void
+req_finish(void)
+{
+	kmem_cache_destroy(req_cache);
+}
 
-	return 1;
+/*
+ * Allocate request on given connection, or on the least loaded live one
+ * if conn is NULL.
+ */
+struct shfs_req *
+req_alloc(struct shfs_sb_info *info, struct shfs_conn *conn)
+{
+	struct shfs_req *req;
+	struct shfs_conn *c;
+	unsigned int i, start;
+
+	if (!conn) {
+		start = (unsigned int)atomic_inc_return(&info->conn_next);
+		conn = &info->conn[start % info->conns];
+		for (i = 1; i < info->conns; i++) {
+			c = &info->conn[(start + i) % info->conns];
+			if (!c->sock || c->dead)
+				continue;
+			if (!conn->sock || conn->dead
+			    || atomic_read(&c->pending) < atomic_read(&conn->pending))
+				conn = c;
+		}
+	}
+	req = (struct shfs_req *)KMEM_ALLOC("req", req_cache, GFP_NOFS);
+	if (!req)
+		return NULL;
+	req->conn = conn;
+	do {
+		req->tag = (unsigned int)atomic_inc_return(&conn->tag_next);
+	} while (!req->tag);
+	req->state = REQ_NEW;
+	req->hold = 0;
+	if (info->sftp)
+		req->frame = FRAME_SFTP;
+	else
+		req->frame = info->frame ? FRAME_TEXT : FRAME_NONE;
+	req->status = -1;
+	req->left = 0;
+	req->done = 0;
+	return req;
 }
 
-int
-shfs_notify_change(struct dentry *dentry, struct iattr *attr)
+static int
+req_xmit(struct shfs_req *req, struct kvec *iov, int nr, int count, int hold)
 {
-	struct inode *inode = dentry->d_inode;
-	struct shfs_sb_info *info = info_from_inode(inode);
-	char file[SHFS_PATH_MAX];
+	struct shfs_conn *conn = req->conn;
 	int result;
 
-	DEBUG("\n");
-	if (get_name(dentry, file) < 0)
-		return -ENAMETOOLONG;
-	result = inode_change_ok(inode, attr);
-	if (result < 0)
-		return result;
-	if (info->readonly)
-		return -EROFS;
-
-	if (attr->ia_valid & ATTR_MODE) {
-		result = info->fops.chmod(info, file, attr->ia_mode);
-		if (result < 0)
-			goto error;
-		inode->i_mode = attr->ia_mode;
-	}
-	if (attr->ia_valid & ATTR_UID) {
-		result = info->fops.chown(info, file, attr->ia_uid);
-		if (result < 0)
-			goto error;
-		inode->i_uid = info->preserve_own ? info->uid : attr->ia_uid;
-	}
-	if (attr->ia_valid & ATTR_GID) {
-		result = info->fops.chgrp(info, file, attr->ia_gid);
+	if (mutex_lock_interruptible(&conn->send_mutex) == -EINTR)
+		return -EINTR;
+	if (conn->garbage_write) {
+		result = clear_garbage_write(conn);
 		if (result < 0)
-			goto error;
-		inode->i_gid = info->preserve_own ? info->gid : attr->ia_gid;
+			goto out;
 	}
-	if (attr->ia_valid & ATTR_SIZE) {
-		filemap_fdatawrite(inode->i_mapping);
-		filemap_fdatawait(inode->i_mapping);
-		result = info->fops.trunc(info, file, attr->ia_size);
-		if (result < 0)
-			goto error;
-		//result = vmtruncate(inode, attr->ia_size);
-		result = inode_newsize_ok(inode, attr->ia_size); 
-		if (result != 0)
-			goto error;
-		else
-			truncate_setsize(inode, attr->ia_size);
-		inode->i_size = attr->ia_size;
-		mark_inode_dirty(inode);
+	req->gen = conn->gen;
+	req->state = REQ_SENT;
+	atomic_inc(&conn->pending);
+
+	result = sock_writev(conn, iov, nr, count);
+	if (result < 0)
+		finish_send(conn);
+	if (result >= 0 && hold) {
+		req->hold = 1;
+		return result;
 	}
-	/* optimisation: call settime once when setting both atime and mtime */
-	if (attr->ia_valid & ATTR_ATIME && attr->ia_valid & ATTR_MTIME
-	    && attr->ia_atime.tv_sec == attr->ia_mtime.tv_sec
-	    && attr->ia_atime.tv_nsec == attr->ia_mtime.tv_nsec) {
-		result = info->fops.settime(info, file, 1, 1, &attr->ia_atime);
-		if (result < 0)
+out:
+	mutex_unlock(&conn->send_mutex);
+	return result;
+}
+
+/*
+ * Send request line from req->buf.  With hold set, send_mutex is kept
+ * until req_free(), so that the caller can stream a payload after the
+ * reply header and nothing gets in between.
+ */
+int
+req_send(struct shfs_req *req, int hold)
+{
+	struct kvec iov = { req->buf, strlen(req->buf) };
+
+	DEBUG(">%s", req->buf);
+	return req_xmit(req, &iov, 1, iov.iov_len, hold);
+}
+
+/*
+ * Send request line immediately followed by count bytes of data, both
+ * in one sendmsg.  Only for commands the server reads the payload of
+ * without a preliminary reply (see info->wdata).
+ */
+int
+req_send_data(struct shfs_req *req, const void *data, int count)
+{
+	struct kvec iov[2] = {
+		{ req->buf, strlen(req->buf) },
+		{ (void *)data, count },
+	};
+
+	DEBUG(">%s", req->buf);
+	return req_xmit(req, iov, 2, iov[0].iov_len + count, 0);
+}
+
+/* binary request (sftp packet), iov holds all of it */
+int
+req_sendv(struct shfs_req *req, struct kvec *iov, int nr, int count)
+{
+	return req_xmit(req, iov, nr, count, 0);
+}
+
+/*
+ * Framed replies (info->frame): every reply line of the server becomes
+ * a fixed size header "#NNN tttttttt llllllll\n" (status, tag and
+ * payload length in hex) followed by llllllll bytes of payload.
+ * Status 000 is plain payload (command output), other statuses are
+ * handed to the caller as "### NNN" lines.  Headers of all statuses
+ * >= 200 end the reply.  The payload is never scanned for headers, so
+ * a reply can be skipped exactly (req_free()).
+ */
+#define FRAME_HDR_LEN	22
+
+static int
+frame_parse(char *line, int *status, unsigned int *tag, unsigned int *len)
+{
+	if (strlen(line) != FRAME_HDR_LEN || line[0] != '#'
+	    || line[4] != ' ' || line[13] != ' ')
+		return -EIO;
+	*status = simple_strtoul(line+1, NULL, 10);
+	*tag = simple_strtoul(line+5, NULL, 16);
+	*len = simple_strtoul(line+14, NULL, 16);
+	return 0;
+}
+
+static void
+frame_start(struct shfs_req *req, int status, unsigned int len)
+{
+	req->left = len;
+	if (req->frame == FRAME_SFTP) {
+		/* whole reply is one packet, status is its type */
+		req->status = status;
+		req->done = 1;
+		return;
+	}
+	if (status)
+		req->status = status;
+	if (status >= REP_COMPLETE)
+		req->done = 1;
+}
+
+/* next header of our reply, current frame consumed; recv_mutex held */
+static int
+frame_next(struct shfs_req *req)
+{
+	struct shfs_conn *conn = req->conn;
+	unsigned int tag, len;
+	int status, result;
+	char *line;
+
+	if (req->done)
+		return -EIO;
+	result = sock_getln(conn, &line);
+	if (result < 0)
+		return result;
+	if (frame_parse(line, &status, &tag, &len) < 0 || tag != req->tag) {
+		VERBOSE("bad frame: %s\n", line);
+		conn_broken(conn);
+		return -EIO;
+	}
+	frame_start(req, status, len);
+	return 0;
+}
+
+/* sftp packet header: uint32 length, byte type, uint32 id */
+static int
+sftp_header(struct shfs_conn *conn, int *type, unsigned int *id, unsigned int *len)
+{
+	unsigned char hdr[9];
+	int result;
+
+	result = sock_read(conn, hdr, sizeof(hdr));
+	if (result < 0)
+		return result;
+	*len = (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+	*type = hdr[4];
+	*id = (hdr[5] << 24) | (hdr[6] << 16) | (hdr[7] << 8) | hdr[8];
+	if (*len < 5) {
+		VERBOSE("bad packet: %u\n", *len);
+		conn_broken(conn);
+		return -EIO;
+	}
+	*len -= 5;
+	return 0;
+}
+
+/*
+ * Wait until reply header of req is read from the socket, either by us
+ * or by another request which found it first (it leaves the tag in
+ * rx_tag and wakes us up).  Lines not looking like a header are what
+ * remained of a reply not read to the end, skip them (framed replies
+ * are always read to the end, anything else is fatal).  Returns with
+ * recv_mutex held.
+ */
+static int
+req_wait(struct shfs_req *req)
+{
+	struct shfs_conn *conn = req->conn;
+	unsigned int tag, len;
+	int status;
+	char *line;
+	int result;
+
+	if (mutex_lock_killable(&conn->recv_mutex))
+		return -EINTR;
+	while (1) {
+		if (conn->dead || conn->gen != req->gen) {
+			result = -EIO;
 			goto error;
-		inode->i_atime = attr->ia_atime;
-		inode->i_mtime = attr->ia_mtime;
-	} else {
-		if (attr->ia_valid & ATTR_ATIME) {
-			result = info->fops.settime(info, file, 1, 0, &attr->ia_atime);
+		}
+		if (conn->rx_tag == req->tag) {
+			conn->rx_tag = 0;
+			if (req->frame)
+				frame_start(req, conn->rx_status, conn->rx_len);
+			break;
+		}
+		if (conn->rx_tag) {
+			mutex_unlock(&conn->recv_mutex);
+			if (wait_event_killable(conn->rx_wait, conn->rx_tag == req->tag
+						|| !conn->rx_tag || conn->dead
+						|| conn->gen != req->gen))
+				return -EINTR;
+			if (mutex_lock_killable(&conn->recv_mutex))
+				return -EINTR;
+			continue;
+		}
+		if (conn->garbage_read) {
+			result = clear_garbage_read(conn);
 			if (result < 0)
 				goto error;
-			inode->i_atime = attr->ia_atime;
 		}
-		if (attr->ia_valid & ATTR_MTIME) {
-			result = info->fops.settime(info, file, 0, 1, &attr->ia_mtime);
+		if (req->frame == FRAME_SFTP) {
+			result = sftp_header(conn, &status, &tag, &len);
 			if (result < 0)
 				goto error;
-			inode->i_mtime = attr->ia_mtime;
+			if (tag == req->tag) {
+				frame_start(req, status, len);
+				break;
+			}
+			conn->rx_status = status;
+			conn->rx_len = len;
+			conn->rx_tag = tag;
+			wake_up_all(&conn->rx_wait);
+			continue;
 		}
+		result = sock_getln(conn, &line);
+		if (result < 0)
+			goto error;
+		if (req->frame) {
+			if (frame_parse(line, &status, &tag, &len) < 0) {
+				VERBOSE("bad frame: %s\n", line);
+				conn_broken(conn);
+				result = -EIO;
+				goto error;
+			}
+			if (tag == req->tag) {
+				frame_start(req, status, len);
+				break;
+			}
+			conn->rx_status = status;
+			conn->rx_len = len;
+		} else {
+			if (reply(line) != REP_TAG) {
+				DEBUG("junk: %s\n", line);
+				continue;
+			}
+			tag = simple_strtoul(line+8, NULL, 10);
+			if (tag == req->tag)
+				break;
+		}
+		conn->rx_tag = tag;
+		wake_up_all(&conn->rx_wait);
 	}
+	req->state = REQ_RECV;
+	return 0;
 error:
+	mutex_unlock(&conn->recv_mutex);
+	return result;
+}
+
+/* see sock_getln() */
+int
+req_getln(struct shfs_req *req, char **line)
+{
+	int result;
+
+	if (req->state != REQ_RECV) {
+		result = req_wait(req);
+		if (result < 0)
+			return result;
+	}
+	if (!req->frame)
+		return sock_getln(req->conn, line);
+	if (req->frame == FRAME_SFTP)
+		return -EIO;
+
+	while (req->status < 0 && !req->left) {
+		result = frame_next(req);
+		if (result < 0)
+			return result;
+	}
+	if (req->status >= 0) {
+		snprintf(req->line, sizeof(req->line), "### %03d", req->status);
+		req->status = -1;
+		*line = req->line;
+		return strlen(req->line);
+	}
+	result = sock_getln(req->conn, line);
+	if (result < 0)
+		return result;
+	if (result + 1 > req->left) {
+		/* line across frame boundary */
+		conn_broken(req->conn);
+		return -EIO;
+	}
+	req->left -= result + 1;
+	return result;
+}
+
+int
+req_readln(struct shfs_req *req, char *buffer, int count)
+{
+	char *line;
+	int result;
+
+	result = req_getln(req, &line);
+	if (result < 0)
+		return result;
+	strlcpy(buffer, line, count);
+	return strlen(buffer);
+}
+
+/*
+ * Payload bytes of the current frame, the next header is read if the
+ * last one is used up.  -EIO if the reply continues with a status
+ * instead (it is returned by next req_getln()).
+ */
+int
+req_avail(struct shfs_req *req)
+{
+	int result;
+
+	if (req->state != REQ_RECV) {
+		result = req_wait(req);
+		if (result < 0)
+			return result;
+	}
+	if (req->frame == FRAME_SFTP)
+		return req->left;
+	if (req->status < 0 && !req->left) {
+		result = frame_next(req);
+		if (result < 0)
+			return result;
+	}
+	if (req->status >= 0)
+		return -EIO;
+	return req->left;
+}
+
+/* type of sftp reply packet, its payload is read by req_read[v]() */
+int
+req_packet(struct shfs_req *req)
+{
+	int result;
+
+	if (req->state != REQ_RECV) {
+		result = req_wait(req);
+		if (result < 0)
+			return result;
+	}
+	return req->status;
+}
+
+int
+req_read(struct shfs_req *req, void *buffer, int count)
+{
+	struct kvec iov = { buffer, count };
+
+	return req_readv(req, &iov, 1, count);
+}
+
+int
+req_readv(struct shfs_req *req, struct kvec *iov, int nr, int count)
+{
+	int result;
+
+	if (req->state != REQ_RECV) {
+		result = req_wait(req);
+		if (result < 0)
+			return result;
+	}
+	if (req->frame) {
+		result = req_avail(req);
+		if (result < 0)
+			return result;
+		if (count > result)
+			return -EIO;
+		req->left -= count;
+	}
+	return sock_readv(req->conn, iov, nr, count);
+}
+
+/* rest of framed reply, up to the final header and its payload */
+static void
+req_drain(struct shfs_req *req)
+{
+	struct shfs_conn *conn = req->conn;
+
+	while (!conn->dead) {
+		if (req->left) {
+			conn->garbage_read = req->left;
+			req->left = 0;
+			if (clear_garbage_read(conn) < 0) {
+				conn_broken(conn);
+				break;
+			}
+		}
+		if (req->done || frame_next(req) < 0)
+			break;
+	}
+}
+
+void
+req_free(struct shfs_req *req)
+{
+	struct shfs_conn *conn = req->conn;
+
+	if (req->hold) {
+		finish_send(conn);
+		mutex_unlock(&conn->send_mutex);
+	}
+	/*
+	 * Reply nobody asked for, its header must not stay in the way.
+	 * Killed while waiting for it, nobody else would take it.
+	 */
+	if (req->state == REQ_SENT && req_wait(req) == -EINTR)
+		conn_broken(conn);
+	if (req->state == REQ_RECV) {
+		if (req->frame)
+			req_drain(req);
+		mutex_unlock(&conn->recv_mutex);
+	}
+	if (req->state != REQ_NEW)
+		atomic_dec(&conn->pending);
+	wake_up_all(&conn->rx_wait);
+	KMEM_FREE("req", req_cache, req);
+}
+
+int
+get_name(struct dentry *d, char *name)
+{
+	int len = 0;
+	struct dentry *p;
+
+	for (p = d; !IS_ROOT(p); p = p->d_parent)
+		len += p->d_name.len + 1;
+		
+	if (len + 1 > SHFS_PATH_MAX) 
+		return 0;
+	if (len == 0) {
+		name[0] = '/';
+		name[1] = '\0';
+		return 1;
+	}
+	
+	name[len] = '\0';
+	for (p = d; !IS_ROOT(p); p = p->d_parent) {
+		len -= p->d_name.len;
+		strncpy(&(name[len]), p->d_name.name, p->d_name.len);
+		len--;
+		name[len] = '/';
+	}
+
+	return 1;
+}
+
+/*
+ * Changes of step in order, in one round trip if the server takes s_seq;
+ * returns 0 or the result of the step that failed, which ends them
+ */
+int
+shfs_seq(struct shfs_sb_info *info, struct shfs_step *step, int n)
+{
+	char file[SHFS_PATH_MAX];
+	int i, result = 0;
+
+	if (info->fops.seq)
+		return info->fops.seq(info, step, n);
+	for (i = 0; i < n; i++)
+		step[i].result = -ECANCELED;
+	for (i = 0; i < n && !result; i++) {
+		/* shell.c quotes names in place */
+		strcpy(file, step[i].file);
+		switch (step[i].op) {
+		case SHFS_CHMOD:
+			result = info->fops.chmod(info, file, step[i].mode, step[i].fattr);
+			break;
+		case SHFS_CHOWN:
+			result = info->fops.chown(info, file, step[i].uid, step[i].fattr);
+			break;
+		case SHFS_CHGRP:
+			result = info->fops.chgrp(info, file, step[i].gid, step[i].fattr);
+			break;
+		case SHFS_TRUNC:
+			result = info->fops.trunc(info, file, step[i].size, step[i].fattr);
+			break;
+		case SHFS_SETTIME:
+			result = info->fops.settime(info, file, step[i].atime, step[i].mtime, step[i].time, step[i].fattr);
+			break;
+		default:
+			result = -EINVAL;
+			break;
+		}
+		if (result > 0)
+			result = 0;
+		step[i].result = result;
+	}
+	return result;
+}
+
+#define ATTR_LAZY	(ATTR_MODE|ATTR_UID|ATTR_GID|ATTR_ATIME|ATTR_MTIME)
+#define ATTR_STEPS	6		/* settime may take two */
+
+/* steps of the changes in attr, returns how many */
+static int
+attr_steps(struct iattr *attr, char *file, struct shfs_fattr *fattr, struct shfs_step *step)
+{
+	int i, n = 0;
+
+	/* the last change returns the attributes of all of them */
+	fattr->f_mode = 0;
+	memset(step, 0, ATTR_STEPS * sizeof(*step));
+	for (i = 0; i < ATTR_STEPS; i++) {
+		step[i].file = file;
+		step[i].fattr = fattr;
+	}
+	if (attr->ia_valid & ATTR_MODE) {
+		step[n].op = SHFS_CHMOD;
+		step[n++].mode = attr->ia_mode;
+	}
+	if (attr->ia_valid & ATTR_UID) {
+		step[n].op = SHFS_CHOWN;
+		step[n++].uid = attr->ia_uid;
+	}
+	if (attr->ia_valid & ATTR_GID) {
+		step[n].op = SHFS_CHGRP;
+		step[n++].gid = attr->ia_gid;
+	}
+	if (attr->ia_valid & ATTR_SIZE) {
+		step[n].op = SHFS_TRUNC;
+		step[n++].size = attr->ia_size;
+	}
+	/* optimisation: call settime once when setting both atime and mtime */
+	if (attr->ia_valid & ATTR_ATIME && attr->ia_valid & ATTR_MTIME
+	    && attr->ia_atime.tv_sec == attr->ia_mtime.tv_sec
+	    && attr->ia_atime.tv_nsec == attr->ia_mtime.tv_nsec) {
+		step[n].op = SHFS_SETTIME;
+		step[n].atime = step[n].mtime = 1;
+		step[n++].time = &attr->ia_atime;
+	} else {
+		if (attr->ia_valid & ATTR_ATIME) {
+			step[n].op = SHFS_SETTIME;
+			step[n].atime = 1;
+			step[n++].time = &attr->ia_atime;
+		}
+		if (attr->ia_valid & ATTR_MTIME) {
+			step[n].op = SHFS_SETTIME;
+			step[n].mtime = 1;
+			step[n++].time = &attr->ia_mtime;
+		}
+	}
+	return n;
+}
+
+/* changes of attr in valid (but the size) to the inode */
+static void
+set_inode(struct inode *inode, struct iattr *attr, unsigned int valid)
+{
+	struct shfs_sb_info *info = info_from_inode(inode);
+
+	if (valid & (ATTR_MODE | ATTR_UID | ATTR_GID))
+		((struct shfs_inode_info *)inode->i_private)->open_ok = 0;
+	if (valid & ATTR_MODE)
+		inode->i_mode = attr->ia_mode;
+	if (valid & ATTR_UID)
+		inode->i_uid = info->preserve_own ? attr->ia_uid : info->uid;
+	if (valid & ATTR_GID)
+		inode->i_gid = info->preserve_own ? attr->ia_gid : info->gid;
+	if (valid & ATTR_ATIME)
+		inode->i_atime = attr->ia_atime;
+	if (valid & ATTR_MTIME)
+		inode->i_mtime = attr->ia_mtime;
+}
+
+/*
+ * lazyattr: keep the changes of attr on the inode; old ones (sending
+ * them failed) do not replace those made since
+ */
+static void
+put_pending(struct inode *inode, struct iattr *attr, int old)
+{
+	struct iattr *p = &((struct shfs_inode_info *)inode->i_private)->pending;
+	unsigned int valid = attr->ia_valid & ATTR_LAZY;
+
+	spin_lock(&inode->i_lock);
+	if (old)
+		valid &= ~p->ia_valid;
+	if (valid & ATTR_MODE)
+		p->ia_mode = attr->ia_mode;
+	if (valid & ATTR_UID)
+		p->ia_uid = attr->ia_uid;
+	if (valid & ATTR_GID)
+		p->ia_gid = attr->ia_gid;
+	if (valid & ATTR_ATIME)
+		p->ia_atime = attr->ia_atime;
+	if (valid & ATTR_MTIME)
+		p->ia_mtime = attr->ia_mtime;
+	p->ia_valid |= valid;
+	set_inode(inode, p, valid);
+	spin_unlock(&inode->i_lock);
+	mark_inode_dirty(inode);
+}
+
+/*
+ * The changes kept on the inode go to attr, unless attr has its own.
+ * Returns those taken.
+ */
+static unsigned int
+take_pending(struct inode *inode, struct iattr *attr)
+{
+	struct iattr *p = &((struct shfs_inode_info *)inode->i_private)->pending;
+	unsigned int valid;
+
+	spin_lock(&inode->i_lock);
+	valid = p->ia_valid & ~attr->ia_valid;
+	if (valid & ATTR_MODE)
+		attr->ia_mode = p->ia_mode;
+	if (valid & ATTR_UID)
+		attr->ia_uid = p->ia_uid;
+	if (valid & ATTR_GID)
+		attr->ia_gid = p->ia_gid;
+	if (valid & ATTR_ATIME)
+		attr->ia_atime = p->ia_atime;
+	if (valid & ATTR_MTIME)
+		attr->ia_mtime = p->ia_mtime;
+	attr->ia_valid |= valid;
+	p->ia_valid = 0;
+	spin_unlock(&inode->i_lock);
+	return valid;
+}
+
+/* the changes not sent yet win over attributes read from the server */
+void
+shfs_pending_attr(struct inode *inode)
+{
+	struct shfs_inode_info *i = inode->i_private;
+
+	spin_lock(&inode->i_lock);
+	if (i->pending.ia_valid)
+		set_inode(inode, &i->pending, i->pending.ia_valid);
+	spin_unlock(&inode->i_lock);
+}
+
+/*
+ * Send the changes lazyattr kept on inode, its name is that of dentry
+ * (which may have let go of the inode already)
+ */
+int
+shfs_flush_attr(struct dentry *dentry, struct inode *inode)
+{
+	struct shfs_sb_info *info = info_from_inode(inode);
+	struct shfs_inode_info *i = inode->i_private;
+	struct shfs_step step[ATTR_STEPS];
+	struct shfs_fattr fattr;
+	struct iattr attr;
+	char file[SHFS_PATH_MAX];
+	int result, n;
+
+	if (!i || !i->pending.ia_valid)
+		return 0;
+	if (!get_name(dentry, file))
+		return -ENAMETOOLONG;
+	attr.ia_valid = 0;
+	take_pending(inode, &attr);
+	n = attr_steps(&attr, file, &fattr, step);
+	if (!n)
+		return 0;
+	result = shfs_seq(info, step, n);
+	if (result < 0) {
+		VERBOSE("!%d\n", result);
+		put_pending(inode, &attr, 1);
+	}
+	if (fattr.f_mode)
+		shfs_update_inode_attr(inode, &fattr);
+	return result;
+}
+
+int
+shfs_notify_change(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+	struct shfs_sb_info *info = info_from_inode(inode);
+	struct shfs_step step[ATTR_STEPS], *p;
+	struct shfs_fattr fattr;
+	char file[SHFS_PATH_MAX];
+	unsigned int done = 0, taken = 0;
+	int result, n;
+
+	DEBUG("\n");
+	if (!get_name(dentry, file))
+		return -ENAMETOOLONG;
+	result = inode_change_ok(inode, attr);
+	if (result < 0)
+		return result;
+	if (info->readonly)
+		return -EROFS;
+
+	if (info->lazyattr) {
+		/* sent on close, fsync or writeback of the inode */
+		if (!(attr->ia_valid & ATTR_SIZE)) {
+			put_pending(inode, attr, 0);
+			return 0;
+		}
+		taken = take_pending(inode, attr);
+	}
+	if (attr->ia_valid & ATTR_SIZE) {
+		result = inode_newsize_ok(inode, attr->ia_size);
+		if (result != 0)
+			goto out;
+		filemap_fdatawrite(inode->i_mapping);
+		filemap_fdatawait(inode->i_mapping);
+	}
+	n = attr_steps(attr, file, &fattr, step);
+	if (!n)
+		return 0;
+
+	result = shfs_seq(info, step, n);
+	for (p = step; p < step + n && !p->result; p++) {
+		switch (p->op) {
+		case SHFS_CHMOD:
+			done |= ATTR_MODE;
+			break;
+		case SHFS_CHOWN:
+			done |= ATTR_UID;
+			break;
+		case SHFS_CHGRP:
+			done |= ATTR_GID;
+			break;
+		case SHFS_TRUNC:
+			truncate_setsize(inode, p->size);
+			inode->i_size = p->size;
+			mark_inode_dirty(inode);
+			break;
+		case SHFS_SETTIME:
+			done |= (p->atime ? ATTR_ATIME : 0) | (p->mtime ? ATTR_MTIME : 0);
+			break;
+		}
+	}
+	set_inode(inode, attr, done);
+	if (fattr.f_mode)
+		shfs_update_inode_attr(inode, &fattr);
+out:
+	/* pending changes not sent go back, as in shfs_flush_attr() */
+	if (taken & ~done) {
+		struct iattr back = *attr;
+
+		back.ia_valid = taken & ~done;
+		put_pending(inode, &back, 1);
+	}
+	return result;
+}
+
+/* write to the file of inode, keeping the attributes the server returns */
+int
+shfs_write(struct inode *inode, char *file, unsigned offset, unsigned count, char *buffer)
+{
+	struct shfs_sb_info *info = info_from_inode(inode);
+	struct shfs_fattr fattr;
+	int result;
+
+	fattr.f_mode = 0;
+	result = info->fops.write(info, file, offset, count, buffer, inode->i_ino, &fattr);
+	if (result >= 0 && fattr.f_mode)
+		shfs_update_inode_attr(inode, &fattr);
 	return result;
 }
 
@@ -620,3 +1576,116 @@ shfs_statfs(struct dentry *dentry, struct kstatfs *attr)
 	return info->fops.statfs(info, attr);
 }
 
+
+#define STATV_MAX	16		/* files in one s_statv */
+
+/* shfs_stat() caller queued on info->statv_queue */
+struct shfs_statw {
+	struct list_head list;
+	char *file;
+	struct shfs_fattr *fattr;
+	struct page **data;
+	int result;
+	int lead;			/* off the queue, sends the next batch */
+	struct completion done;
+};
+
+static void
+stat_batch(struct shfs_sb_info *info, struct list_head *batch, int count)
+{
+	char *files[STATV_MAX];
+	struct shfs_fattr *fattr[STATV_MAX];
+	struct page *data[STATV_MAX];
+	int result[STATV_MAX];
+	struct shfs_statw *w, *n;
+	int i = 0, r, want = 0;
+
+	list_for_each_entry(w, batch, list) {
+		files[i] = w->file;
+		fattr[i] = w->fattr;
+		data[i] = NULL;
+		if (w->data)
+			want = 1;
+		i++;
+	}
+	if (count == 1 && !want) {
+		result[0] = info->fops.stat(info, files[0], fattr[0]);
+	} else {
+		DEBUG("%d\n", count);
+		r = info->fops.statv(info, count, files, fattr, want ? data : NULL, result);
+		if (r < 0) {
+			for (i = 0; i < count; i++)
+				result[i] = r;
+		}
+	}
+	i = 0;
+	list_for_each_entry_safe(w, n, batch, list) {
+		if (w->data && !result[i])
+			*w->data = data[i];
+		else if (data[i])
+			page_cache_release(data[i]);
+		w->result = result[i++];
+		list_del(&w->list);
+		complete(&w->done);
+	}
+}
+
+/*
+ * Stat for lookup/revalidate.  With a batch on the wire on each
+ * connection, callers queue up and go together in the next s_statv,
+ * the first of them sends it when a batch is done.  *data (if data) is
+ * set to the page cache page of a small file if the server sent its
+ * content, NULL otherwise.
+ */
+int
+shfs_stat(struct shfs_sb_info *info, char *file, struct shfs_fattr *fattr, struct page **data)
+{
+	struct shfs_statw w, *p, *n;
+	LIST_HEAD(batch);
+	int count = 1;
+
+	if (data)
+		*data = NULL;
+	if (!info->fops.statv)
+		return info->fops.stat(info, file, fattr);
+
+	w.file = file;
+	w.fattr = fattr;
+	w.data = info->lookup && info->inline_max ? data : NULL;
+	w.lead = 0;
+	init_completion(&w.done);
+	spin_lock(&info->statv_lock);
+	if (info->statv_busy >= info->conns) {
+		list_add_tail(&w.list, &info->statv_queue);
+		spin_unlock(&info->statv_lock);
+		wait_for_completion(&w.done);
+		if (!w.lead)
+			return w.result;
+		/* the batch done handed its slot over */
+		spin_lock(&info->statv_lock);
+	} else {
+		info->statv_busy++;
+	}
+	list_add_tail(&w.list, &batch);
+	list_for_each_entry_safe(p, n, &info->statv_queue, list) {
+		if (count == STATV_MAX)
+			break;
+		list_move_tail(&p->list, &batch);
+		count++;
+	}
+	spin_unlock(&info->statv_lock);
+
+	stat_batch(info, &batch, count);
+
+	spin_lock(&info->statv_lock);
+	if (list_empty(&info->statv_queue)) {
+		info->statv_busy--;
+	} else {
+		p = list_first_entry(&info->statv_queue, struct shfs_statw, list);
+		list_del(&p->list);
+		p->lead = 1;
+		complete(&p->done);
+	}
+	spin_unlock(&info->statv_lock);
+	return w.result;
+}
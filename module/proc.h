@@ -3,27 +3,27 @@
 
 #include "shfs_fs_sb.h"
 
-static inline int
-sock_lock(struct shfs_sb_info *info)
-{
-	int result;
-	DEBUG("?\n");
+#define REQ_NEW		0
+#define REQ_SENT	1		/* waiting for reply header */
+#define REQ_RECV	2		/* reading reply, recv_mutex held */
 
-	//result = down_interruptible(&(info->sock_sem));
-	result = mutex_lock_interruptible(&(info->shfs_mutex));
-	//result = mutex_lock_interruptible(&info->shfs_mutex);
+#define FRAME_NONE	0		/* "### 110 <tag>", then reply lines */
+#define FRAME_TEXT	1		/* "#NNN tag len" headers (info->frame) */
+#define FRAME_SFTP	2		/* sftp packets (info->sftp) */
 
-	DEBUG("!\n");
-	return (result != -EINTR);
-}
+/* one command in flight, see req_alloc() */
+struct shfs_req {
+	struct shfs_conn *conn;
+	unsigned int tag;
+	unsigned int gen;		/* conn->gen at the time of sending */
+	int state;
+	int hold;			/* send_mutex kept for payload */
+	int frame;			/* FRAME_* */
+	int status;			/* frame status not returned yet, or -1 */
+	unsigned int left;		/* payload left in current frame */
+	int done;			/* final frame header read */
+	char line[8];			/* "### NNN" made of status */
+	char buf[SOCKBUF_SIZE];
+};
 
-static inline void
-sock_unlock(struct shfs_sb_info *info)
-{
-	//up(&(info->sock_sem));
-	mutex_unlock(&(info->shfs_mutex));
-	//mutex_unlock(&info->shfs_mutex));
-	DEBUG("\n");
-}
-
-#endif	/* _PROC_H */
\ No newline at end of file
+#endif	/* _PROC_H */
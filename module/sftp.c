@@ -0,0 +1,1090 @@
+/*
+ * sftp.c
+ *
+ * sftp-server client implementation (SFTP protocol version 3).
+ *
+ * The session is set up by shfsmount (SSH_FXP_INIT/VERSION), we get a
+ * socket speaking plain sftp packets.  Request ids are request tags,
+ * so replies are matched by req_wait() as for the shell (FRAME_SFTP).
+ */
+
+#ifdef MODVERSIONS
+#include <linux/modversions.h>
+#endif
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <asm/uaccess.h>
+#include <asm/fcntl.h>
+#include <asm/byteorder.h>
+#include <linux/file.h>
+#include <linux/mutex.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <net/sock.h>
+
+#include "shfs_fs.h"
+#include "shfs_fs_sb.h"
+#include "shfs_debug.h"
+#include "proc.h"
+
+#define SSH_FXP_OPEN		3
+#define SSH_FXP_CLOSE		4
+#define SSH_FXP_READ		5
+#define SSH_FXP_WRITE		6
+#define SSH_FXP_LSTAT		7
+#define SSH_FXP_SETSTAT		9
+#define SSH_FXP_OPENDIR		11
+#define SSH_FXP_READDIR		12
+#define SSH_FXP_REMOVE		13
+#define SSH_FXP_MKDIR		14
+#define SSH_FXP_RMDIR		15
+#define SSH_FXP_STAT		17
+#define SSH_FXP_RENAME		18
+#define SSH_FXP_READLINK	19
+#define SSH_FXP_SYMLINK		20
+#define SSH_FXP_STATUS		101
+#define SSH_FXP_HANDLE		102
+#define SSH_FXP_DATA		103
+#define SSH_FXP_NAME		104
+#define SSH_FXP_ATTRS		105
+#define SSH_FXP_EXTENDED	200
+#define SSH_FXP_EXTENDED_REPLY	201
+
+#define SSH_FX_OK			0
+#define SSH_FX_EOF			1
+#define SSH_FX_NO_SUCH_FILE		2
+#define SSH_FX_PERMISSION_DENIED	3
+#define SSH_FX_FAILURE			4
+#define SSH_FX_OP_UNSUPPORTED		8
+
+#define SSH_FILEXFER_ATTR_SIZE		0x00000001
+#define SSH_FILEXFER_ATTR_UIDGID	0x00000002
+#define SSH_FILEXFER_ATTR_PERMISSIONS	0x00000004
+#define SSH_FILEXFER_ATTR_ACMODTIME	0x00000008
+#define SSH_FILEXFER_ATTR_EXTENDED	0x80000000
+
+#define SSH_FXF_READ		0x00000001
+#define SSH_FXF_WRITE		0x00000002
+#define SSH_FXF_CREAT		0x00000008
+#define SSH_FXF_TRUNC		0x00000010
+
+#define SFTP_HANDLE_MAX		256
+#define SFTP_CHUNK		32768	/* bytes per READ/WRITE */
+#define SFTP_WINDOW		16	/* READs/WRITEs in flight */
+#define SFTP_IOV		(SFTP_CHUNK / PAGE_CACHE_SIZE + 2)
+
+struct sftp_handle {
+	struct shfs_conn *conn;		/* handles are per session */
+	unsigned int len;
+	char data[SFTP_HANDLE_MAX];
+};
+
+/* reply payload, read to req->buf in chunks */
+struct sftp_in {
+	struct shfs_req *req;
+	char *p;
+	unsigned int len;		/* bytes buffered at p */
+};
+
+static char *
+put_u32(char *p, u32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static char *
+put_u64(char *p, u64 v)
+{
+	p = put_u32(p, v >> 32);
+	return put_u32(p, v);
+}
+
+static char *
+put_str(char *p, const char *s, unsigned int len)
+{
+	p = put_u32(p, len);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+/* file relative to root= (or to home, sftp-server's cwd) */
+static char *
+put_path(struct shfs_sb_info *info, char *p, char *file)
+{
+	char *s = p + 4;
+
+	if (info->root[0]) {
+		strcpy(s, info->root);
+		s += strlen(s);
+		if (strcmp(file, "/")) {
+			strcpy(s, file);
+			s += strlen(file);
+		}
+	} else {
+		strcpy(s, file[1] ? file + 1 : ".");
+		s += strlen(s);
+	}
+	put_u32(p, s - p - 4);
+	return s;
+}
+
+static char *
+put_handle(char *p, struct sftp_handle *h)
+{
+	return put_str(p, h->data, h->len);
+}
+
+/* only fields in flags are written */
+static char *
+put_attrs(char *p, u32 flags, struct shfs_fattr *fattr)
+{
+	p = put_u32(p, flags);
+	if (flags & SSH_FILEXFER_ATTR_SIZE)
+		p = put_u64(p, fattr->f_size);
+	if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+		p = put_u32(p, fattr->f_uid);
+		p = put_u32(p, fattr->f_gid);
+	}
+	if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+		p = put_u32(p, fattr->f_mode);
+	if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+		p = put_u32(p, fattr->f_atime.tv_sec);
+		p = put_u32(p, fattr->f_mtime.tv_sec);
+	}
+	return p;
+}
+
+/* packet is built in req->buf, returns where to continue */
+static char *
+sftp_begin(struct shfs_req *req, int type)
+{
+	char *p = req->buf + 4;
+
+	*p++ = type;
+	return put_u32(p, req->tag);
+}
+
+/* send packet ending at p, followed by count bytes of data */
+static int
+sftp_send(struct shfs_req *req, char *p, const void *data, int count)
+{
+	struct kvec iov[2] = {
+		{ req->buf, p - req->buf },
+		{ (void *)data, count },
+	};
+
+	put_u32(req->buf, p - req->buf - 4 + count);
+	return req_sendv(req, iov, count ? 2 : 1, p - req->buf + count);
+}
+
+static int
+get_fill(struct sftp_in *in, unsigned int need)
+{
+	struct shfs_req *req = in->req;
+	unsigned int c;
+	int result;
+
+	if (in->len >= need)
+		return 0;
+	if (in->len && in->p != req->buf)
+		memmove(req->buf, in->p, in->len);
+	in->p = req->buf;
+	c = SOCKBUF_SIZE - in->len;
+	if (c > req->left)
+		c = req->left;
+	if (in->len + c < need)
+		return -EIO;
+	result = req_read(req, req->buf + in->len, c);
+	if (result < 0)
+		return result;
+	in->len += c;
+	return 0;
+}
+
+static int
+get_u32(struct sftp_in *in, u32 *v)
+{
+	unsigned char *p;
+	int result;
+
+	result = get_fill(in, 4);
+	if (result < 0)
+		return result;
+	p = (unsigned char *)in->p;
+	*v = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	in->p += 4;
+	in->len -= 4;
+	return 0;
+}
+
+static int
+get_u64(struct sftp_in *in, u64 *v)
+{
+	u32 hi, lo;
+	int result;
+
+	result = get_u32(in, &hi);
+	if (result < 0)
+		return result;
+	result = get_u32(in, &lo);
+	if (result < 0)
+		return result;
+	*v = ((u64)hi << 32) | lo;
+	return 0;
+}
+
+/* string to buf (cut to max-1 bytes and zero terminated), NULL skips it */
+static int
+get_str(struct sftp_in *in, char *buf, unsigned int max, unsigned int *len)
+{
+	unsigned int n, c, l = 0;
+	int result;
+
+	result = get_u32(in, &n);
+	if (result < 0)
+		return result;
+	while (n) {
+		c = n < SOCKBUF_SIZE ? n : SOCKBUF_SIZE;
+		result = get_fill(in, c);
+		if (result < 0)
+			return result;
+		if (buf && l + 1 < max) {
+			unsigned int m = c < max - 1 - l ? c : max - 1 - l;
+
+			memcpy(buf + l, in->p, m);
+			l += m;
+		}
+		in->p += c;
+		in->len -= c;
+		n -= c;
+	}
+	if (buf)
+		buf[l] = '\0';
+	if (len)
+		*len = l;
+	return 0;
+}
+
+static int
+get_attrs(struct sftp_in *in, struct shfs_sb_info *info, struct shfs_fattr *fattr)
+{
+	u32 flags, v, w, n;
+	u64 size;
+	umode_t mode;
+	int result;
+
+	memset(fattr, 0, sizeof(*fattr));
+	result = get_u32(in, &flags);
+	if (result < 0)
+		return result;
+	if (flags & SSH_FILEXFER_ATTR_SIZE) {
+		result = get_u64(in, &size);
+		if (result < 0)
+			return result;
+		fattr->f_size = size;
+	}
+	if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+		result = get_u32(in, &v);
+		if (result < 0)
+			return result;
+		result = get_u32(in, &w);
+		if (result < 0)
+			return result;
+		fattr->f_uid = v;
+		fattr->f_gid = w;
+	}
+	if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+		result = get_u32(in, &v);
+		if (result < 0)
+			return result;
+		fattr->f_mode = v;
+	}
+	if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+		result = get_u32(in, &v);
+		if (result < 0)
+			return result;
+		result = get_u32(in, &w);
+		if (result < 0)
+			return result;
+		fattr->f_atime.tv_sec = v;
+		fattr->f_mtime.tv_sec = w;
+		fattr->f_ctime.tv_sec = w;
+	}
+	if (flags & SSH_FILEXFER_ATTR_EXTENDED) {
+		result = get_u32(in, &n);
+		if (result < 0)
+			return result;
+		while (n--) {
+			result = get_str(in, NULL, 0, NULL);
+			if (result < 0)
+				return result;
+			result = get_str(in, NULL, 0, NULL);
+			if (result < 0)
+				return result;
+		}
+	}
+
+	/* same rules as for ls output (shell.c) */
+	mode = fattr->f_mode;
+	if (S_ISBLK(mode) && !((info->fmask & S_IFMT) & S_IFBLK))
+		mode = (mode & ~S_IFMT) | S_IFREG;
+	if (S_ISCHR(mode) && !((info->fmask & S_IFMT) & S_IFCHR))
+		mode = (mode & ~S_IFMT) | S_IFREG;
+	fattr->f_mode = S_ISREG(mode) ? mode & info->fmask : mode;
+	fattr->f_nlink = S_ISDIR(mode) ? 2 : 1;
+	fattr->f_blksize = 4096;
+	fattr->f_blocks = (fattr->f_size + 511) >> 9;
+	return 0;
+}
+
+/*
+ * Wait for reply of given type, SSH_FXP_STATUS is turned into 0 (if
+ * expected), 1 (EOF) or -errno.
+ */
+static int
+sftp_wait(struct shfs_req *req, struct sftp_in *in, int type)
+{
+	u32 code;
+	int result;
+
+	in->req = req;
+	in->p = req->buf;
+	in->len = 0;
+	result = req_packet(req);
+	if (result < 0)
+		return result;
+	if (result == type && type != SSH_FXP_STATUS)
+		return 0;
+	if (result != SSH_FXP_STATUS) {
+		VERBOSE("unexpected reply: %d\n", result);
+		return -EIO;
+	}
+	result = get_u32(in, &code);
+	if (result < 0)
+		return result;
+	DEBUG("status: %u\n", code);
+	switch (code) {
+	case SSH_FX_OK:
+		return type == SSH_FXP_STATUS ? 0 : -EIO;
+	case SSH_FX_EOF:
+		return 1;
+	case SSH_FX_NO_SUCH_FILE:
+		return -ENOENT;
+	case SSH_FX_PERMISSION_DENIED:
+	case SSH_FX_FAILURE:
+		return -EPERM;
+	case SSH_FX_OP_UNSUPPORTED:
+		return -ENOSYS;
+	default:
+		return -EIO;
+	}
+}
+
+/* send packet ending at p and wait for its status */
+static int
+sftp_status(struct shfs_req *req, char *p)
+{
+	struct sftp_in in;
+	int result;
+
+	result = sftp_send(req, p, NULL, 0);
+	if (result >= 0)
+		result = sftp_wait(req, &in, SSH_FXP_STATUS);
+	req_free(req);
+	return result > 0 ? -EIO : result;
+}
+
+/* SSH_FXP_OPEN or SSH_FXP_OPENDIR */
+static int
+sftp_open_handle(struct shfs_sb_info *info, int type, char *file, u32 pflags,
+		 int mode, struct sftp_handle *h)
+{
+	struct shfs_req *req;
+	struct shfs_fattr fattr;
+	struct sftp_in in;
+	char *p;
+	int result;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, type);
+	p = put_path(info, p, file);
+	if (type == SSH_FXP_OPEN) {
+		p = put_u32(p, pflags);
+		fattr.f_mode = mode;
+		p = put_attrs(p, mode ? SSH_FILEXFER_ATTR_PERMISSIONS : 0, &fattr);
+	}
+	result = sftp_send(req, p, NULL, 0);
+	if (result < 0)
+		goto out;
+	result = sftp_wait(req, &in, SSH_FXP_HANDLE);
+	if (result)
+		goto out;
+	result = get_u32(&in, &h->len);
+	if (result < 0)
+		goto out;
+	if (h->len > SFTP_HANDLE_MAX) {
+		result = -EIO;
+		goto out;
+	}
+	result = get_fill(&in, h->len);
+	if (result < 0)
+		goto out;
+	memcpy(h->data, in.p, h->len);
+	h->conn = req->conn;
+out:
+	req_free(req);
+	return result > 0 ? -EIO : result;
+}
+
+/*
+ * Request on handle h, the header is built, see sftp_begin().  NULL
+ * if request cannot be allocated.
+ */
+static struct shfs_req *
+sftp_handle_req(struct shfs_sb_info *info, struct sftp_handle *h, int type, char **p)
+{
+	struct shfs_req *req;
+
+	if (!(req = req_alloc(info, h->conn)))
+		return NULL;
+	*p = sftp_begin(req, type);
+	*p = put_handle(*p, h);
+	return req;
+}
+
+/* send SSH_FXP_CLOSE, reply is waited for in req_free() */
+static struct shfs_req *
+sftp_close_send(struct shfs_sb_info *info, struct sftp_handle *h)
+{
+	struct shfs_req *req;
+	char *p;
+
+	req = sftp_handle_req(info, h, SSH_FXP_CLOSE, &p);
+	if (req && sftp_send(req, p, NULL, 0) < 0) {
+		req_free(req);
+		req = NULL;
+	}
+	return req;
+}
+
+static void
+sftp_close(struct shfs_sb_info *info, struct sftp_handle *h)
+{
+	struct shfs_req *req = sftp_close_send(info, h);
+
+	if (req)
+		req_free(req);
+}
+
+static struct shfs_req *
+sftp_readdir_send(struct shfs_sb_info *info, struct sftp_handle *h)
+{
+	struct shfs_req *req;
+	char *p;
+
+	req = sftp_handle_req(info, h, SSH_FXP_READDIR, &p);
+	if (req && sftp_send(req, p, NULL, 0) < 0) {
+		req_free(req);
+		req = NULL;
+	}
+	return req;
+}
+
+/* next READDIR batch is asked for while the current one is parsed */
+static int
+sftp_readdir(struct shfs_sb_info *info, char *dir,
+	     struct file *filp, void *dirent, filldir_t filldir, struct shfs_cache_control *ctl)
+{
+	struct shfs_req *req, *next;
+	struct sftp_handle h;
+	struct shfs_fattr fattr;
+	struct sftp_in in;
+	struct qstr name;
+	char buffer[SHFS_PATH_MAX];
+	unsigned int len;
+	u32 count = 0;
+	int result;
+
+	result = sftp_open_handle(info, SSH_FXP_OPENDIR, dir, 0, 0, &h);
+	if (result < 0)
+		return result;
+
+	req = sftp_readdir_send(info, &h);
+	result = req ? 0 : -EIO;
+	while (req) {
+		next = NULL;
+		result = sftp_wait(req, &in, SSH_FXP_NAME);
+		if (!result) {
+			next = sftp_readdir_send(info, &h);
+			result = get_u32(&in, &count);
+		}
+		while (!result && count--) {
+			result = get_str(&in, buffer, sizeof(buffer), &len);
+			if (result < 0)
+				break;
+			result = get_str(&in, NULL, 0, NULL);
+			if (result < 0)
+				break;
+			result = get_attrs(&in, info, &fattr);
+			if (result < 0)
+				break;
+			if (!strcmp(buffer, ".") || !strcmp(buffer, ".."))
+				continue;
+			name.name = buffer;
+			name.len = len;
+			DEBUG("Name: %s, mode: %o, size: %llu\n", buffer, fattr.f_mode, fattr.f_size);
+			if (!shfs_fill_cache(filp, dirent, filldir, ctl, &name, &fattr))
+				result = 1;
+		}
+		req_free(req);
+		req = next;
+		if (result) {
+			if (req)
+				req_free(req);
+			break;
+		}
+	}
+	sftp_close(info, &h);
+	return result > 0 ? 0 : result;
+}
+
+static int
+sftp_stat(struct shfs_sb_info *info, char *file, struct shfs_fattr *fattr)
+{
+	struct shfs_req *req;
+	struct sftp_in in;
+	char *p;
+	int result;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, info->stable_symlinks ? SSH_FXP_STAT : SSH_FXP_LSTAT);
+	p = put_path(info, p, file);
+	result = sftp_send(req, p, NULL, 0);
+	if (result < 0)
+		goto out;
+	result = sftp_wait(req, &in, SSH_FXP_ATTRS);
+	if (result)
+		goto out;
+	result = get_attrs(&in, info, fattr);
+out:
+	req_free(req);
+	return result > 0 ? -EIO : result;
+}
+
+static int
+sftp_open(struct shfs_sb_info *info, char *file, int mode)
+{
+	struct sftp_handle h;
+	u32 pflags;
+	int result;
+
+	if (mode == O_RDONLY)
+		pflags = SSH_FXF_READ;
+	else if (mode == O_WRONLY)
+		pflags = SSH_FXF_WRITE;
+	else
+		pflags = SSH_FXF_READ|SSH_FXF_WRITE;
+
+	DEBUG("Open: %s (%u)\n", file, pflags);
+	result = sftp_open_handle(info, SSH_FXP_OPEN, file, pflags, 0, &h);
+	if (result < 0)
+		return result;
+	sftp_close(info, &h);
+	return 0;
+}
+
+/* len bytes of iov from (*idx, *off) on to slice, cursor is moved */
+static int
+iov_next(struct kvec *iov, int nr, int *idx, unsigned int *off, unsigned int len,
+	 struct kvec *slice, int max)
+{
+	int n = 0;
+	unsigned int c;
+
+	while (len) {
+		if (*idx >= nr || n >= max)
+			return -EIO;
+		c = iov[*idx].iov_len - *off;
+		if (c > len)
+			c = len;
+		slice[n].iov_base = iov[*idx].iov_base + *off;
+		slice[n].iov_len = c;
+		n++;
+		len -= c;
+		*off += c;
+		if (*off == iov[*idx].iov_len) {
+			(*idx)++;
+			*off = 0;
+		}
+	}
+	return n;
+}
+
+/*
+ * Up to SFTP_WINDOW READs are sent at once, replies are read straight
+ * into iov.  Returns bytes read (less than count at end of file).
+ */
+static int
+do_read(struct shfs_sb_info *info, char *file, unsigned offset,
+	unsigned count, struct kvec *iov, int nr)
+{
+	struct shfs_req *req[SFTP_WINDOW], *close = NULL;
+	unsigned int len[SFTP_WINDOW];
+	struct kvec slice[SFTP_IOV];
+	struct sftp_handle h;
+	struct sftp_in in;
+	unsigned int sent, total = 0, off = 0;
+	int i, n, idx = 0, eof = 0, result;
+	u32 dlen;
+	char *p;
+
+	DEBUG("<%s[%u, %u]\n", file, offset, count);
+	result = sftp_open_handle(info, SSH_FXP_OPEN, file, SSH_FXF_READ, 0, &h);
+	if (result < 0)
+		return result;
+
+	while (total < count && !eof && result >= 0) {
+		for (n = 0, sent = total; n < SFTP_WINDOW && sent < count; n++) {
+			len[n] = count - sent < SFTP_CHUNK ? count - sent : SFTP_CHUNK;
+			req[n] = sftp_handle_req(info, &h, SSH_FXP_READ, &p);
+			if (!req[n])
+				break;
+			p = put_u64(p, (u64)offset + sent);
+			p = put_u32(p, len[n]);
+			if (sftp_send(req[n], p, NULL, 0) < 0) {
+				req_free(req[n]);
+				break;
+			}
+			sent += len[n];
+		}
+		if (!n) {
+			result = -EIO;
+			break;
+		}
+		/* last window, the handle can go right after it */
+		if (sent == count)
+			close = sftp_close_send(info, &h);
+
+		for (i = 0; i < n; i++) {
+			if (result >= 0 && !eof) {
+				result = sftp_wait(req[i], &in, SSH_FXP_DATA);
+				if (result > 0)
+					eof = 1;
+			}
+			if (!result && !eof) {
+				result = req_read(req[i], &dlen, 4);
+				if (result >= 0) {
+					dlen = be32_to_cpu(dlen);
+					result = dlen > len[i] ? -EIO :
+						iov_next(iov, nr, &idx, &off, dlen, slice, SFTP_IOV);
+				}
+				if (result >= 0)
+					result = req_readv(req[i], slice, result, dlen);
+				if (result >= 0) {
+					total += dlen;
+					if (dlen < len[i])
+						eof = 1;
+					result = 0;
+				}
+			}
+			req_free(req[i]);
+		}
+	}
+	if (close)
+		req_free(close);
+	else
+		sftp_close(info, &h);
+	DEBUG("<%d\n", result < 0 ? result : total);
+	return result < 0 ? result : total;
+}
+
+static int
+sftp_read(struct shfs_sb_info *info, char *file, unsigned offset,
+	  unsigned count, char *buffer, unsigned long ino)
+{
+	struct kvec iov = { buffer, count };
+	int result;
+
+	result = do_read(info, file, offset, count, &iov, 1);
+	/* like s_read, the slow read (ino) tells the real size */
+	if (result >= 0 && !ino && result < count) {
+		memset(buffer + result, 0, count - result);
+		result = count;
+	}
+	return result;
+}
+
+static int
+sftp_readv(struct shfs_sb_info *info, char *file, unsigned offset,
+	   unsigned count, struct kvec *iov, int nr)
+{
+	return do_read(info, file, offset, count, iov, nr);
+}
+
+/* up to SFTP_WINDOW WRITEs in flight, each with its data in one sendmsg */
+static int
+sftp_write(struct shfs_sb_info *info, char *file, unsigned offset,
+	   unsigned count, char *buffer, unsigned long ino, struct shfs_fattr *post)
+{
+	struct shfs_req *req[SFTP_WINDOW], *close = NULL;
+	struct sftp_handle h;
+	struct sftp_in in;
+	unsigned int sent = 0, len;
+	int i, n, result;
+	char *p;
+
+	DEBUG(">%s[%u, %u]\n", file, offset, count);
+	result = sftp_open_handle(info, SSH_FXP_OPEN, file, SSH_FXF_WRITE, 0, &h);
+	if (result < 0)
+		return result;
+
+	do {
+		for (n = 0; n < SFTP_WINDOW && (sent < count || !n); n++) {
+			len = count - sent < SFTP_CHUNK ? count - sent : SFTP_CHUNK;
+			req[n] = sftp_handle_req(info, &h, SSH_FXP_WRITE, &p);
+			if (!req[n])
+				break;
+			p = put_u64(p, (u64)offset + sent);
+			p = put_u32(p, len);
+			if (sftp_send(req[n], p, buffer + sent, len) < 0) {
+				req_free(req[n]);
+				break;
+			}
+			sent += len;
+		}
+		if (!n) {
+			result = -EIO;
+			break;
+		}
+		if (sent == count)
+			close = sftp_close_send(info, &h);
+
+		for (i = 0; i < n; i++) {
+			if (result >= 0) {
+				result = sftp_wait(req[i], &in, SSH_FXP_STATUS);
+				/* SSH_FX_FAILURE is all we get for a full disk */
+				if (result == -EPERM)
+					result = -ENOSPC;
+				else if (result > 0)
+					result = -EIO;
+			}
+			req_free(req[i]);
+		}
+	} while (sent < count && result >= 0);
+	if (close)
+		req_free(close);
+	else
+		sftp_close(info, &h);
+	DEBUG(">%d\n", result < 0 ? result : count);
+	return result < 0 ? result : count;
+}
+
+/* command on one or two paths, replied by status */
+static int
+sftp_path_cmd(struct shfs_sb_info *info, int type, char *file, char *file2)
+{
+	struct shfs_req *req;
+	char *p;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, type);
+	p = put_path(info, p, file);
+	if (file2)
+		p = put_path(info, p, file2);
+	if (type == SSH_FXP_MKDIR)
+		p = put_u32(p, 0);		/* no attrs */
+	return sftp_status(req, p);
+}
+
+/* openssh extension on two paths */
+static int
+sftp_extended(struct shfs_sb_info *info, char *ext, char *file, char *file2)
+{
+	struct shfs_req *req;
+	char *p;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, SSH_FXP_EXTENDED);
+	p = put_str(p, ext, strlen(ext));
+	p = put_path(info, p, file);
+	p = put_path(info, p, file2);
+	return sftp_status(req, p);
+}
+
+static int
+sftp_setstat(struct shfs_sb_info *info, char *file, u32 flags, struct shfs_fattr *fattr)
+{
+	struct shfs_req *req;
+	char *p;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, SSH_FXP_SETSTAT);
+	p = put_path(info, p, file);
+	p = put_attrs(p, flags, fattr);
+	return sftp_status(req, p);
+}
+
+static int
+sftp_mkdir(struct shfs_sb_info *info, char *dir, struct shfs_fattr *post)
+{
+	DEBUG("Mkdir %s\n", dir);
+	return sftp_path_cmd(info, SSH_FXP_MKDIR, dir, NULL);
+}
+
+static int
+sftp_rmdir(struct shfs_sb_info *info, char *dir)
+{
+	DEBUG("Rmdir %s\n", dir);
+	return sftp_path_cmd(info, SSH_FXP_RMDIR, dir, NULL);
+}
+
+/* SSH_FXP_RENAME does not replace the target, mv -f does */
+static int
+sftp_rename(struct shfs_sb_info *info, char *old, char *new)
+{
+	int result;
+
+	DEBUG("Rename %s -> %s\n", old, new);
+	result = sftp_extended(info, "posix-rename@openssh.com", old, new);
+	if (result == -ENOSYS)
+		result = sftp_path_cmd(info, SSH_FXP_RENAME, old, new);
+	return result;
+}
+
+static int
+sftp_unlink(struct shfs_sb_info *info, char *file)
+{
+	DEBUG("Remove %s\n", file);
+	return sftp_path_cmd(info, SSH_FXP_REMOVE, file, NULL);
+}
+
+static int
+sftp_create(struct shfs_sb_info *info, char *file, int mode, struct shfs_fattr *post)
+{
+	struct sftp_handle h;
+	int result;
+
+	DEBUG("Create %s %o\n", file, mode);
+	result = sftp_open_handle(info, SSH_FXP_OPEN, file,
+				  SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC, mode & S_IALLUGO, &h);
+	if (result < 0)
+		return result;
+	sftp_close(info, &h);
+	return 0;
+}
+
+static int
+sftp_link(struct shfs_sb_info *info, char *old, char *new, struct shfs_fattr *post)
+{
+	DEBUG("Link %s -> %s\n", old, new);
+	return sftp_extended(info, "hardlink@openssh.com", old, new);
+}
+
+/* sftp-server takes target first (as symlink(2) does, unlike the draft) */
+static int
+sftp_symlink(struct shfs_sb_info *info, char *old, char *new, struct shfs_fattr *post)
+{
+	struct shfs_req *req;
+	char *p;
+
+	DEBUG("Symlink %s -> %s\n", old, new);
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, SSH_FXP_SYMLINK);
+	p = put_str(p, old, strlen(old));
+	p = put_path(info, p, new);
+	return sftp_status(req, p);
+}
+
+static int
+sftp_readlink(struct shfs_sb_info *info, char *name, char *real_name)
+{
+	struct shfs_req *req;
+	struct sftp_in in;
+	u32 count;
+	char *p;
+	int result;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, SSH_FXP_READLINK);
+	p = put_path(info, p, name);
+	result = sftp_send(req, p, NULL, 0);
+	if (result < 0)
+		goto out;
+	result = sftp_wait(req, &in, SSH_FXP_NAME);
+	if (result)
+		goto out;
+	result = get_u32(&in, &count);
+	if (result < 0)
+		goto out;
+	if (count != 1) {
+		result = -EIO;
+		goto out;
+	}
+	result = get_str(&in, real_name, SHFS_PATH_MAX, NULL);
+out:
+	req_free(req);
+	return result > 0 ? -EIO : result;
+}
+
+static int
+sftp_chmod(struct shfs_sb_info *info, char *file, umode_t mode, struct shfs_fattr *post)
+{
+	struct shfs_fattr fattr;
+
+	DEBUG("Chmod %o %s\n", mode, file);
+	fattr.f_mode = mode & S_IALLUGO;
+	return sftp_setstat(info, file, SSH_FILEXFER_ATTR_PERMISSIONS, &fattr);
+}
+
+/* SSH_FILEXFER_ATTR_UIDGID sets both, the other one is read first */
+static int
+sftp_chown(struct shfs_sb_info *info, char *file, uid_t user, struct shfs_fattr *post)
+{
+	struct shfs_fattr fattr;
+	int result;
+
+	DEBUG("Chown %u %s\n", user, file);
+	result = sftp_stat(info, file, &fattr);
+	if (result < 0)
+		return result;
+	fattr.f_uid = user;
+	return sftp_setstat(info, file, SSH_FILEXFER_ATTR_UIDGID, &fattr);
+}
+
+static int
+sftp_chgrp(struct shfs_sb_info *info, char *file, gid_t group, struct shfs_fattr *post)
+{
+	struct shfs_fattr fattr;
+	int result;
+
+	DEBUG("Chgrp %u %s\n", group, file);
+	result = sftp_stat(info, file, &fattr);
+	if (result < 0)
+		return result;
+	fattr.f_gid = group;
+	return sftp_setstat(info, file, SSH_FILEXFER_ATTR_UIDGID, &fattr);
+}
+
+static int
+sftp_trunc(struct shfs_sb_info *info, char *file, loff_t size, struct shfs_fattr *post)
+{
+	struct shfs_fattr fattr;
+
+	DEBUG("Truncate %s %llu\n", file, (unsigned long long)size);
+	fattr.f_size = size;
+	return sftp_setstat(info, file, SSH_FILEXFER_ATTR_SIZE, &fattr);
+}
+
+/* SSH_FILEXFER_ATTR_ACMODTIME sets both as well */
+static int
+sftp_settime(struct shfs_sb_info *info, char *file, int atime, int mtime, struct timespec *time, struct shfs_fattr *post)
+{
+	struct shfs_fattr fattr;
+	int result;
+
+	DEBUG("Settime %s (%s%s)\n", file, atime ? "a" : "", mtime ? "m" : "");
+	if (!atime || !mtime) {
+		result = sftp_stat(info, file, &fattr);
+		if (result < 0)
+			return result;
+	}
+	if (atime)
+		fattr.f_atime = *time;
+	if (mtime)
+		fattr.f_mtime = *time;
+	return sftp_setstat(info, file, SSH_FILEXFER_ATTR_ACMODTIME, &fattr);
+}
+
+/* statvfs@openssh.com, defaults are kept if not supported */
+static int
+sftp_statfs(struct shfs_sb_info *info, struct kstatfs *attr)
+{
+	struct shfs_req *req;
+	struct sftp_in in;
+	u64 v[11];
+	char *p;
+	int i, result;
+
+	attr->f_type = SHFS_SUPER_MAGIC;
+	attr->f_bsize = 4096;
+	attr->f_blocks = 0;
+	attr->f_bfree = 0;
+	attr->f_bavail = 0;
+	attr->f_files = 1;
+	attr->f_bavail = 1;
+	attr->f_namelen = SHFS_PATH_MAX;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	p = sftp_begin(req, SSH_FXP_EXTENDED);
+	p = put_str(p, "statvfs@openssh.com", 19);
+	p = put_path(info, p, "/");
+	result = sftp_send(req, p, NULL, 0);
+	if (result < 0)
+		goto out;
+	result = sftp_wait(req, &in, SSH_FXP_EXTENDED_REPLY);
+	if (result) {
+		if (result == -ENOSYS)
+			result = 0;
+		goto out;
+	}
+	/* bsize frsize blocks bfree bavail files ffree favail fsid flag namemax */
+	for (i = 0; i < 11; i++) {
+		result = get_u64(&in, &v[i]);
+		if (result < 0)
+			goto out;
+	}
+	attr->f_blocks = (v[2] * v[1]) >> 12;
+	attr->f_bfree = (v[3] * v[1]) >> 12;
+	attr->f_bavail = (v[4] * v[1]) >> 12;
+	attr->f_files = v[5];
+	attr->f_ffree = v[6];
+out:
+	req_free(req);
+	return result > 0 ? -EIO : result;
+}
+
+static int
+sftp_finish(struct shfs_sb_info *info)
+{
+	DEBUG("Finish\n");
+	return 0;
+}
+
+struct shfs_fileops sftp_fops = {
+	readdir:	sftp_readdir,
+	stat:		sftp_stat,
+	open:		sftp_open,
+	read:		sftp_read,
+	readv:		sftp_readv,
+	write:		sftp_write,
+	mkdir:		sftp_mkdir,
+	rmdir:		sftp_rmdir,
+	rename:		sftp_rename,
+	unlink:		sftp_unlink,
+	create:		sftp_create,
+	link:		sftp_link,
+	symlink:	sftp_symlink,
+	readlink:	sftp_readlink,
+	chmod:		sftp_chmod,
+	chown:		sftp_chown,
+	chgrp:		sftp_chgrp,
+	trunc:		sftp_trunc,
+	settime:	sftp_settime,
+	statfs:		sftp_statfs,
+	finish:		sftp_finish,
+};
@@ -18,6 +18,8 @@
 #include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/uio.h>
 #include <net/sock.h>
 
@@ -38,6 +40,20 @@
 #define DIR_YEAR   7
 #define DIR_NAME   8
 
+/* s_lsplus fields before the times, see parse_plus() */
+#define PLUS_INO    0
+#define PLUS_MODE   1
+#define PLUS_NLINK  2
+#define PLUS_UID    3
+#define PLUS_GID    4
+#define PLUS_SIZE   5
+#define PLUS_BLOCKS 6
+#define PLUS_MAJOR  7
+#define PLUS_MINOR  8
+#define PLUS_ATIME  9
+
+static int parse_plus(struct shfs_sb_info *info, char *s, struct shfs_fattr *fattr, struct qstr *name);
+
 /* aaa'aaa -> aaa'\''aaa */
 static int
 replace_quote(char *name)
@@ -123,39 +139,72 @@ get_ugid(struct shfs_sb_info *info, char *str, int max)
 	return s;
 }
 
+/*
+ * "s_tag <tag> <cmd> [uid 'groups' ]", or "s_frame <hex tag> ..." for
+ * framed replies; returns NULL if not enough space
+ */
+static char *
+put_cmd(struct shfs_sb_info *info, struct shfs_req *req, char *cmd)
+{
+	char *s = req->buf;
+
+	if (req->frame)
+		s += snprintf(s, SOCKBUF_SIZE, "s_frame %08x %s", req->tag, cmd);
+	else
+		s += snprintf(s, SOCKBUF_SIZE, "s_tag %u %s", req->tag, cmd);
+	return get_ugid(info, s, SOCKBUF_SIZE - (s - req->buf));
+}
+
+/*
+ * Status line of a change into req->buf, the s_statplus row of info->attrs
+ * before it goes to fattr (if any)
+ */
+static int
+read_status(struct shfs_sb_info *info, struct shfs_req *req, struct shfs_fattr *fattr)
+{
+	struct qstr name;
+	int result;
+
+	for (;;) {
+		result = req_readln(req, req->buf, SOCKBUF_SIZE);
+		if (result < 0 || reply(req->buf) || !info->attrs)
+			return result;
+		if (fattr && parse_plus(info, req->buf, fattr, &name) < 0)
+			fattr->f_mode = 0;
+	}
+}
+
 static int 
-do_command(struct shfs_sb_info *info, char *cmd, char *args, ...)
+vdo_command(struct shfs_sb_info *info, struct shfs_conn *conn, struct shfs_fattr *fattr,
+	    char *cmd, char *args, va_list ap)
 {
-	va_list ap;
+	struct shfs_req *req;
 	int result;
 	char *s;
 
-	if (!sock_lock(info))
-		return -EINTR;
-	
-	s = info->sockbuf;
-	strcpy(s, cmd); s += strlen(cmd);
-	s = get_ugid(info, s, SOCKBUF_SIZE - strlen(cmd));
+	if (!(req = req_alloc(info, conn)))
+		return -ENOMEM;
+	s = put_cmd(info, req, cmd);
 	if (!s) {
 		result = -ENAMETOOLONG;
-		goto error;
+		goto out;
 	}
-	va_start(ap, args);
-	result = vsnprintf(s, SOCKBUF_SIZE - (s - info->sockbuf), args, ap);
-	va_end(ap);
-	if (result < 0 || strlen(info->sockbuf) + 2 > SOCKBUF_SIZE) {
+	result = vsnprintf(s, SOCKBUF_SIZE - (s - req->buf), args, ap);
+	if (result < 0 || strlen(req->buf) + 2 > SOCKBUF_SIZE) {
 		result = -ENAMETOOLONG;
-		goto error;
+		goto out;
 	}
 	s += result;
 	strcpy(s, "\n");
 
-	DEBUG("#%s", info->sockbuf);
-	result = sock_write(info, (void *)info->sockbuf, strlen(info->sockbuf));
+	DEBUG("#%s", req->buf);
+	result = req_send(req, 0);
 	if (result < 0)
-		goto error;
-	sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
-	switch (reply(info->sockbuf)) {
+		goto out;
+	result = read_status(info, req, fattr);
+	if (result < 0)
+		goto out;
+	switch (reply(req->buf)) {
 	case REP_COMPLETE:
 		result = 0;
 		break;
@@ -172,9 +221,46 @@ do_command(struct shfs_sb_info *info, char *cmd, char *args, ...)
 		result = -EIO;
 		break;
 	}
+out:
+	req_free(req);
+	return result;
+}
 
-error:
-	sock_unlock(info);
+static int 
+do_command(struct shfs_sb_info *info, char *cmd, char *args, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, args);
+	result = vdo_command(info, NULL, NULL, cmd, args, ap);
+	va_end(ap);
+	return result;
+}
+
+/* change of a file, its attributes afterwards go to fattr */
+static int 
+do_attr_command(struct shfs_sb_info *info, struct shfs_fattr *fattr, char *cmd, char *args, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, args);
+	result = vdo_command(info, NULL, fattr, cmd, args, ap);
+	va_end(ap);
+	return result;
+}
+
+/* send command on given connection */
+static int 
+do_conn_command(struct shfs_sb_info *info, struct shfs_conn *conn, char *cmd, char *args, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, args);
+	result = vdo_command(info, conn, NULL, cmd, args, ap);
+	va_end(ap);
 	return result;
 }
 
@@ -263,34 +349,250 @@ parse_dir(char *s, char **col)
 	return c;
 }
 
+/* ls -lan row, name points into s; returns -1 if s is no file row */
+static int
+parse_ls(struct shfs_sb_info *info, char *s, struct shfs_fattr *fattr, struct qstr *name,
+	 unsigned int this_year, unsigned int this_month)
+{
+	char *col[DIR_COLS];
+	unsigned int year, mon, day, hour, min;
+	int device, month;
+	umode_t mode;
+	char *b;
+
+	if (parse_dir(s, col) != DIR_COLS)
+		return -1;		/* skip `total xx' line */
+
+	memset(fattr, 0, sizeof(*fattr));
+	name->name = col[DIR_NAME];
+	/* name->len is assigned later */
+
+	s = col[DIR_PERM];
+	mode = 0; device = 0;
+	switch (s[0]) {
+	case 'b':
+		device = 1;
+		if ((info->fmask & S_IFMT) & S_IFBLK)
+			mode = S_IFBLK;
+		else
+			mode = S_IFREG;
+		break;
+	case 'c':
+		device = 1;
+		if ((info->fmask & S_IFMT) & S_IFCHR)
+			mode = S_IFCHR;
+		else
+			mode = S_IFREG;
+	break;
+	case 's':
+	case 'S':			/* IRIX64 socket */
+		mode = S_IFSOCK;
+		break;
+	case 'd':
+		mode = S_IFDIR;
+		break;
+	case 'l':
+		mode = S_IFLNK;
+		break;
+	case '-':
+		mode = S_IFREG;
+		break;
+	case 'p':
+		mode = S_IFIFO;
+		break;
+	}
+	if (s[1] == 'r') mode |= S_IRUSR;
+	if (s[2] == 'w') mode |= S_IWUSR;
+	if (s[3] == 'x') mode |= S_IXUSR;
+	if (s[3] == 's') mode |= S_IXUSR | S_ISUID;
+	if (s[3] == 'S') mode |= S_ISUID;
+	if (s[4] == 'r') mode |= S_IRGRP;
+	if (s[5] == 'w') mode |= S_IWGRP;
+	if (s[6] == 'x') mode |= S_IXGRP;
+	if (s[6] == 's') mode |= S_IXGRP | S_ISGID;
+	if (s[6] == 'S') mode |= S_ISGID;
+	if (s[7] == 'r') mode |= S_IROTH;
+	if (s[8] == 'w') mode |= S_IWOTH;
+	if (s[9] == 'x') mode |= S_IXOTH;
+	if (s[9] == 't') mode |= S_ISVTX | S_IXOTH;
+	if (s[9] == 'T') mode |= S_ISVTX;
+	fattr->f_mode = S_ISREG(mode) ? mode & info->fmask : mode;
+
+	fattr->f_uid = simple_strtoul(col[DIR_UID], NULL, 10);
+	fattr->f_gid = simple_strtoul(col[DIR_GID], NULL, 10);
+	
+	if (!device) {
+		fattr->f_size = simple_strtoull(col[DIR_SIZE], NULL, 10);
+	} else {
+		unsigned short major, minor;
+		fattr->f_size = 0;
+		major = (unsigned short) simple_strtoul(col[DIR_SIZE], &s, 10);
+		while (*s && (!isdigit(*s)))
+			s++;
+		minor = (unsigned short) simple_strtoul(s, NULL, 10);
+		fattr->f_rdev = MKDEV(major, minor);
+	}
+	fattr->f_nlink = simple_strtoul(col[DIR_NLINK], NULL, 10);
+	fattr->f_blksize = 4096;
+	fattr->f_blocks = (fattr->f_size + 511) >> 9;
+
+	month = get_month(col[DIR_MONTH]);
+	/* some systems have month/day swapped (MacOS X) */
+	if (month < 0) {
+		day = simple_strtoul(col[DIR_MONTH], NULL, 10);
+		mon = get_month(col[DIR_DAY]);
+	} else {
+		mon = (unsigned) month;
+		day = simple_strtoul(col[DIR_DAY], NULL, 10);
+	}
+	
+	s = col[DIR_YEAR];
+	if (!strchr(s, ':')) {
+		year = simple_strtoul(s, NULL, 10);
+		hour = 12;
+		min = 0;
+	} else {
+		year = this_year;
+		if (mon > this_month) 
+			year--;
+		b = strchr(s, ':');
+		*b = 0;
+		hour = simple_strtoul(s, NULL, 10);
+		min = simple_strtoul(++b, NULL, 10);
+	}
+	fattr->f_atime.tv_sec = fattr->f_mtime.tv_sec = fattr->f_ctime.tv_sec = mktime(year, mon + 1, day, hour, min, 0);
+	fattr->f_atime.tv_nsec = fattr->f_mtime.tv_nsec = fattr->f_ctime.tv_nsec = 0;
+
+	if (S_ISLNK(mode) && ((s = strstr(name->name, " -> "))))
+		*s = '\0';
+	name->len = strlen(name->name);
+	DEBUG("Name: %s, mode: %o, size: %llu, nlink: %d, month: %d, day: %d, year: %d, hour: %d, min: %d (time: %lu)\n", name->name, fattr->f_mode, fattr->f_size, fattr->f_nlink, mon, day, year, hour, min, fattr->f_atime.tv_sec);
+	return 0;
+}
+
+/* "sec[.fraction]", fraction cut to nanoseconds */
+static char *
+parse_time(char *s, struct timespec *t)
+{
+	unsigned long ns = 0;
+	int i = 0;
+
+	t->tv_sec = simple_strtoul(s, &s, 10);
+	if (*s == '.') {
+		for (s++; isdigit(*s); s++) {
+			if (i++ < 9)
+				ns = ns * 10 + (*s - '0');
+		}
+		for (; i < 9; i++)
+			ns *= 10;
+	}
+	t->tv_nsec = ns;
+	return s;
+}
+
+/*
+ * s_lsplus row: "ino tperm nlink uid gid size blocks major minor atime
+ * mtime ctime name[/target]", tperm is a find(1) %y letter followed by
+ * octal permissions, times are "sec[.fraction]"
+ */
+static int
+parse_plus(struct shfs_sb_info *info, char *s, struct shfs_fattr *fattr, struct qstr *name)
+{
+	unsigned long long v[PLUS_ATIME];
+	umode_t mode;
+	char type = 0, *p;
+	int i;
+
+	memset(fattr, 0, sizeof(*fattr));
+	for (i = 0; i < PLUS_ATIME; i++) {
+		if (i == PLUS_MODE)
+			type = *s++;
+		v[i] = simple_strtoull(s, &p, i == PLUS_MODE ? 8 : 10);
+		if (p == s || *p != ' ')
+			return -1;
+		s = p + 1;
+	}
+	s = parse_time(s, &fattr->f_atime);
+	if (*s++ != ' ')
+		return -1;
+	s = parse_time(s, &fattr->f_mtime);
+	if (*s++ != ' ')
+		return -1;
+	s = parse_time(s, &fattr->f_ctime);
+	if (*s++ != ' ')
+		return -1;
+
+	/* names have no '/', the symlink target follows it */
+	name->name = s;
+	if ((p = strchr(s, '/')))
+		*p = '\0';
+	name->len = strlen(s);
+
+	switch (type) {
+	case 'd':
+		mode = S_IFDIR;
+		break;
+	case 'l':
+		mode = S_IFLNK;
+		break;
+	case 'c':
+		mode = (info->fmask & S_IFMT) & S_IFCHR ? S_IFCHR : S_IFREG;
+		fattr->f_rdev = MKDEV(v[PLUS_MAJOR], v[PLUS_MINOR]);
+		break;
+	case 'b':
+		mode = (info->fmask & S_IFMT) & S_IFBLK ? S_IFBLK : S_IFREG;
+		fattr->f_rdev = MKDEV(v[PLUS_MAJOR], v[PLUS_MINOR]);
+		break;
+	case 'p':
+		mode = S_IFIFO;
+		break;
+	case 's':
+		mode = S_IFSOCK;
+		break;
+	default:
+		mode = S_IFREG;
+		break;
+	}
+	mode |= v[PLUS_MODE] & S_IALLUGO;
+	fattr->f_mode = S_ISREG(mode) ? mode & info->fmask : mode;
+	/* v[PLUS_INO] is the remote inode, ours are iunique() */
+	fattr->f_nlink = v[PLUS_NLINK];
+	fattr->f_uid = v[PLUS_UID];
+	fattr->f_gid = v[PLUS_GID];
+	fattr->f_size = S_ISCHR(mode) || S_ISBLK(mode) ? 0 : v[PLUS_SIZE];
+	fattr->f_blksize = 4096;
+	fattr->f_blocks = v[PLUS_BLOCKS];
+	DEBUG("Name: %s, mode: %o, size: %llu, nlink: %d, mtime: %lu.%09lu\n", name->name, fattr->f_mode, fattr->f_size, fattr->f_nlink, fattr->f_mtime.tv_sec, fattr->f_mtime.tv_nsec);
+	return 0;
+}
+
 static int
 do_ls(struct shfs_sb_info *info, char *file, struct shfs_fattr *entry,
       struct file *filp, void *dirent, filldir_t filldir, struct shfs_cache_control *ctl)
 {
-	char *col[DIR_COLS];
+	struct shfs_req *req;
 	struct shfs_fattr fattr;
 	struct qstr name;
-	unsigned int year, mon, day, hour, min;
 	unsigned int this_year = get_this_year();
 	unsigned int this_month = get_this_month();
-	int device, month;
-	umode_t mode;
-	char *b, *s, *command = entry ? "s_stat" : "s_lsdir";
+	char *s, *line, *command;
 	int result;
 	
+	if (info->plus)
+		command = entry ? "s_statplus" : "s_lsplus";
+	else
+		command = entry ? "s_stat" : "s_lsdir";
 	if (!check_path(file))
 		return -ENAMETOOLONG;
-	if (!sock_lock(info))
-		return -EINTR;
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
 
-	s = info->sockbuf;
-	strcpy(s, command); s += strlen(command);
-	s = get_ugid(info, s, SOCKBUF_SIZE - strlen(command));
+	s = put_cmd(info, req, command);
 	if (!s) {
 		result = -ENAMETOOLONG;
 		goto out;
 	}
-	if (s - info->sockbuf + strlen(file) + 4 > SOCKBUF_SIZE) {
+	if (s - req->buf + strlen(file) + 4 > SOCKBUF_SIZE) {
 		result = -ENAMETOOLONG;
 		goto out;
 	}
@@ -299,13 +601,14 @@ do_ls(struct shfs_sb_info *info, char *file, struct shfs_fattr *entry,
 	strcpy(s, "'"); s++;
 	strcpy(s, "\n");
 
-	DEBUG(">%s\n", info->sockbuf);
-	result = sock_write(info, (void *)info->sockbuf, strlen(info->sockbuf));
+	DEBUG(">%s\n", req->buf);
+	result = req_send(req, 0);
 	if (result < 0)
 		goto out;
 
-	while ((result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE)) > 0) {
-		switch (reply(info->sockbuf)) {
+	/* rows are parsed in place, in the connection buffer */
+	while ((result = req_getln(req, &line)) > 0) {
+		switch (reply(line)) {
 		case REP_COMPLETE:
 			result = 0;
 			goto out;
@@ -320,128 +623,25 @@ do_ls(struct shfs_sb_info *info, char *file, struct shfs_fattr *entry,
 			goto out;
 		}
 
-		result = parse_dir(info->sockbuf, col);
-		if (result != DIR_COLS)
-			continue;		/* skip `total xx' line */
-		
-		memset(&fattr, 0, sizeof(fattr));
-		s = col[DIR_NAME];
-		if (!strcmp(s, ".") || !strcmp(s, ".."))
+		if (info->plus)
+			result = parse_plus(info, line, &fattr, &name);
+		else
+			result = parse_ls(info, line, &fattr, &name, this_year, this_month);
+		if (result < 0)
 			continue;
-		name.name = s;
-		/* name.len is assigned later */
-
-		s = col[DIR_PERM];
-		mode = 0; device = 0;
-		switch (s[0]) {
-		case 'b':
-			device = 1;
-			if ((info->fmask & S_IFMT) & S_IFBLK)
-				mode = S_IFBLK;
-			else
-				mode = S_IFREG;
-			break;
-		case 'c':
-			device = 1;
-			if ((info->fmask & S_IFMT) & S_IFCHR)
-				mode = S_IFCHR;
-			else
-				mode = S_IFREG;
-		break;
-		case 's':
-		case 'S':			/* IRIX64 socket */
-			mode = S_IFSOCK;
-			break;
-		case 'd':
-			mode = S_IFDIR;
-			break;
-		case 'l':
-			mode = S_IFLNK;
-			break;
-		case '-':
-			mode = S_IFREG;
-			break;
-		case 'p':
-			mode = S_IFIFO;
-			break;
-		}
-		if (s[1] == 'r') mode |= S_IRUSR;
-		if (s[2] == 'w') mode |= S_IWUSR;
-		if (s[3] == 'x') mode |= S_IXUSR;
-		if (s[3] == 's') mode |= S_IXUSR | S_ISUID;
-		if (s[3] == 'S') mode |= S_ISUID;
-		if (s[4] == 'r') mode |= S_IRGRP;
-		if (s[5] == 'w') mode |= S_IWGRP;
-		if (s[6] == 'x') mode |= S_IXGRP;
-		if (s[6] == 's') mode |= S_IXGRP | S_ISGID;
-		if (s[6] == 'S') mode |= S_ISGID;
-		if (s[7] == 'r') mode |= S_IROTH;
-		if (s[8] == 'w') mode |= S_IWOTH;
-		if (s[9] == 'x') mode |= S_IXOTH;
-		if (s[9] == 't') mode |= S_ISVTX | S_IXOTH;
-		if (s[9] == 'T') mode |= S_ISVTX;
-		fattr.f_mode = S_ISREG(mode) ? mode & info->fmask : mode;
-
-		fattr.f_uid = simple_strtoul(col[DIR_UID], NULL, 10);
-		fattr.f_gid = simple_strtoul(col[DIR_GID], NULL, 10);
-		
-		if (!device) {
-			fattr.f_size = simple_strtoull(col[DIR_SIZE], NULL, 10);
-		} else {
-			unsigned short major, minor;
-			fattr.f_size = 0;
-			major = (unsigned short) simple_strtoul(col[DIR_SIZE], &s, 10);
-			while (*s && (!isdigit(*s)))
-				s++;
-			minor = (unsigned short) simple_strtoul(s, NULL, 10);
-			fattr.f_rdev = MKDEV(major, minor);
-		}
-		fattr.f_nlink = simple_strtoul(col[DIR_NLINK], NULL, 10);
-		fattr.f_blksize = 4096;
-		fattr.f_blocks = (fattr.f_size + 511) >> 9;
-
-		month = get_month(col[DIR_MONTH]);
-		/* some systems have month/day swapped (MacOS X) */
-		if (month < 0) {
-			day = simple_strtoul(col[DIR_MONTH], NULL, 10);
-			mon = get_month(col[DIR_DAY]);
-		} else {
-			mon = (unsigned) month;
-			day = simple_strtoul(col[DIR_DAY], NULL, 10);
-		}
-		
-		s = col[DIR_YEAR];
-		if (!strchr(s, ':')) {
-			year = simple_strtoul(s, NULL, 10);
-			hour = 12;
-			min = 0;
-		} else {
-			year = this_year;
-			if (mon > this_month) 
-				year--;
-			b = strchr(s, ':');
-			*b = 0;
-			hour = simple_strtoul(s, NULL, 10);
-			min = simple_strtoul(++b, NULL, 10);
-		}
-		fattr.f_atime.tv_sec = fattr.f_mtime.tv_sec = fattr.f_ctime.tv_sec = mktime(year, mon + 1, day, hour, min, 0);
-		fattr.f_atime.tv_nsec = fattr.f_mtime.tv_nsec = fattr.f_ctime.tv_nsec = 0;
-
-		if (S_ISLNK(mode) && ((s = strstr(name.name, " -> "))))
-			*s = '\0';
-		name.len = strlen(name.name);
-		DEBUG("Name: %s, mode: %o, size: %llu, nlink: %d, month: %d, day: %d, year: %d, hour: %d, min: %d (time: %lu)\n", name.name, fattr.f_mode, fattr.f_size, fattr.f_nlink, mon, day, year, hour, min, fattr.f_atime.tv_sec);
 
 		if (entry) {
 			*entry = fattr;
-		} else {
-			result = shfs_fill_cache(filp, dirent, filldir, ctl, &name, &fattr);
-			if (!result)
-				break;
+			continue;
 		}
+		if (!strcmp(name.name, ".") || !strcmp(name.name, ".."))
+			continue;
+		result = shfs_fill_cache(filp, dirent, filldir, ctl, &name, &fattr);
+		if (!result)
+			break;
 	}
 out:
-	sock_unlock(info);
+	req_free(req);
 	return result;
 }
 
@@ -458,6 +658,136 @@ shell_stat(struct shfs_sb_info *info, char *file, struct shfs_fattr *fattr)
 	return do_ls(info, file, fattr, NULL, NULL, NULL, NULL);
 }
 
+/* len bytes of s_lookup content into a new page */
+static int
+read_inline(struct shfs_req *req, unsigned len, struct page **page)
+{
+	char *p;
+	int result;
+
+	*page = alloc_page(GFP_HIGHUSER);
+	if (!*page)
+		return -ENOMEM;
+	p = kmap(*page);
+	result = req_read(req, p, len);
+	memset(p + len, 0, PAGE_SIZE - len);
+	kunmap(*page);
+	if (result < 0)
+		page_cache_release(*page);
+	return result;
+}
+
+/*
+ * s_statv (s_lookup if data is wanted) as many files as fit in one
+ * request, returns how many
+ */
+static int
+do_statv(struct shfs_sb_info *info, int n, char **files, struct shfs_fattr **fattr,
+	 struct page **data, int *result)
+{
+	struct shfs_req *req;
+	struct qstr name;
+	struct page *page;
+	char *s, *line;
+	int count, i = 0, res;
+	unsigned len;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	if (data) {
+		s = put_cmd(info, req, "s_lookup");
+		if (s)
+			s += sprintf(s, "%u ", info->inline_max);
+	} else {
+		s = put_cmd(info, req, "s_statv");
+	}
+	if (!s) {
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+	for (count = 0; count < n; count++) {
+		if (s - req->buf + strlen(files[count]) + 5 > SOCKBUF_SIZE)
+			break;
+		s += sprintf(s, "'%s' ", files[count]);
+	}
+	if (!count) {
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+	strcpy(s, "\n");
+
+	DEBUG(">%s\n", req->buf);
+	res = req_send(req, 0);
+	if (res < 0)
+		goto out;
+
+	/* a s_statplus row or "-" per file, in order */
+	while ((res = req_getln(req, &line)) > 0) {
+		switch (reply(line)) {
+		case REP_COMPLETE:
+			res = i == count ? count : -EIO;
+			goto out;
+		case REP_EPERM:
+			res = -EPERM;
+			goto out;
+		case REP_ENOENT:
+			res = -ENOENT;
+			goto out;
+		case REP_ERROR:
+			res = -EIO;
+			goto out;
+		}
+		if (line[0] == ':') {
+			/* content of the file of the last row */
+			len = simple_strtoul(line + 1, NULL, 10);
+			if (!i || len > PAGE_SIZE) {
+				res = -EIO;
+				goto out;
+			}
+			res = read_inline(req, len, &page);
+			if (res < 0)
+				goto out;
+			if (data && !result[i-1] && fattr[i-1]->f_size == len)
+				data[i-1] = page;
+			else
+				page_cache_release(page);
+			continue;
+		}
+		if (i == count)
+			continue;
+		if (!strcmp(line, "-"))
+			result[i] = -ENOENT;
+		else if (parse_plus(info, line, fattr[i], &name) < 0)
+			result[i] = -EIO;
+		else
+			result[i] = 0;
+		i++;
+	}
+	if (!res)
+		res = -EIO;
+out:
+	req_free(req);
+	return res;
+}
+
+static int
+shell_statv(struct shfs_sb_info *info, int n, char **files, struct shfs_fattr **fattr,
+	    struct page **data, int *result)
+{
+	int i, res;
+
+	for (i = 0; i < n; i++) {
+		if (!check_path(files[i]))
+			return -ENAMETOOLONG;
+	}
+	for (i = 0; i < n; i += res) {
+		res = do_statv(info, n - i, files + i, fattr + i, data ? data + i : NULL, result + i);
+		if (res < 0)
+			return res;
+	}
+	return 0;
+}
+
 /* returns 1 if file is "non-empty" but has zero size */
 static int
 shell_open(struct shfs_sb_info *info, char *file, int mode)
@@ -480,9 +810,10 @@ shell_open(struct shfs_sb_info *info, char *file, int mode)
 
 /* data should be aligned (offset % count == 0), ino == 0 => normal read, != 0 => slow read */
 static int
-shell_read(struct shfs_sb_info *info, char *file, unsigned offset,
-	   unsigned count, char *buffer, unsigned long ino)
+do_read(struct shfs_sb_info *info, char *file, unsigned offset,
+	unsigned count, struct kvec *iov, int nr, unsigned long ino)
 {
+	struct shfs_req *req;
 	unsigned bs = 1, offset2 = offset, count2 = count;
 	int result;
 	char *s;
@@ -498,25 +829,19 @@ shell_read(struct shfs_sb_info *info, char *file, unsigned offset,
 		count2 = 1;
 	}
 
-	if (!sock_lock(info))
-		return -EINTR;
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
 	
-	s = info->sockbuf;
-	if (ino) {
-		strcpy(s, "s_sread"); s += strlen("s_sread");
-	} else {
-		strcpy(s, "s_read"); s += strlen("s_read");
-	}
-	s = get_ugid(info, s, SOCKBUF_SIZE - strlen(info->sockbuf));
+	s = put_cmd(info, req, ino ? "s_sread" : "s_read");
 	if (!s) {
 		result = -ENAMETOOLONG;
 		goto error;
 	}
 	if (ino) {
-		result = snprintf(s, SOCKBUF_SIZE - (s - info->sockbuf), 
+		result = snprintf(s, SOCKBUF_SIZE - (s - req->buf), 
 			"'%s' %u %u %u %u %u %lu\n", file, offset, count, bs, offset2, count2, ino);
 	} else {
-		result = snprintf(s, SOCKBUF_SIZE - (s - info->sockbuf), 
+		result = snprintf(s, SOCKBUF_SIZE - (s - req->buf), 
 			"'%s' %u %u %u %u %u\n", file, offset, count, bs, offset2, count2);
 	}
 	if (result < 0) {
@@ -524,17 +849,15 @@ shell_read(struct shfs_sb_info *info, char *file, unsigned offset,
 		goto error;
 	}
 
-	DEBUG("<%s", info->sockbuf);
-	result = sock_write(info, (void *)info->sockbuf, strlen(info->sockbuf));
+	DEBUG("<%s", req->buf);
+	result = req_send(req, 0);
 	if (result < 0)
 		goto error;
 
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
-	if (result < 0) {
-		set_garbage(info, 0, count);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
+	if (result < 0)
 		goto error;
-	}
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_PRELIM:
 		break;
 	case REP_EPERM:
@@ -544,24 +867,34 @@ shell_read(struct shfs_sb_info *info, char *file, unsigned offset,
 		result = -ENOENT;
 		goto error;
 	default:
-		set_garbage(info, 0, count);
 		result = -EIO;
 		goto error;
 	}
 	if (ino) {
-		result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+		/* size of the frame, or a line of its own */
+		if (req->frame) {
+			result = req_avail(req);
+		} else {
+			result = req_readln(req, req->buf, SOCKBUF_SIZE);
+			if (result >= 0)
+				result = simple_strtoul(req->buf, NULL, 10);
+		}
 		if (result < 0)
 			goto error;
-		count = simple_strtoul(info->sockbuf, NULL, 10);
+		if (result > count) {
+			result = -EIO;
+			goto error;
+		}
+		count = result;
 	}
 
-	result = sock_read(info, buffer, count);
+	result = req_readv(req, iov, nr, count);
 	if (result < 0)
 		goto error;
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
 	if (result < 0)
 		goto error;
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_COMPLETE:
 		break;
 	case REP_EPERM:
@@ -577,15 +910,33 @@ shell_read(struct shfs_sb_info *info, char *file, unsigned offset,
 
 	result = count;
 error:
-	sock_unlock(info);
+	req_free(req);
 	DEBUG("<%d\n", result);
 	return result;
 }
 
+static int
+shell_read(struct shfs_sb_info *info, char *file, unsigned offset,
+	   unsigned count, char *buffer, unsigned long ino)
+{
+	struct kvec iov = { buffer, count };
+
+	return do_read(info, file, offset, count, &iov, 1, ino);
+}
+
+/* read straight into (page cache) buffers */
+static int
+shell_readv(struct shfs_sb_info *info, char *file, unsigned offset,
+	    unsigned count, struct kvec *iov, int nr)
+{
+	return do_read(info, file, offset, count, iov, nr, 0);
+}
+
 static int
 shell_write(struct shfs_sb_info *info, char *file, unsigned offset,
-	    unsigned count, char *buffer, unsigned long ino)
+	    unsigned count, char *buffer, unsigned long ino, struct shfs_fattr *fattr)
 {
+	struct shfs_req *req;
 	unsigned offset2 = offset, bs = 1;
 	int result;
 	char *s;
@@ -602,34 +953,39 @@ shell_write(struct shfs_sb_info *info, char *file, unsigned offset,
 		bs = info->fcache_size;
 	}
 		
-	if (!sock_lock(info))
-		return -EINTR;
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
 
-	s = info->sockbuf;
-	strcpy(s, "s_write"); s += strlen("s_write");
-	s = get_ugid(info, s, SOCKBUF_SIZE - strlen(info->sockbuf));
+	s = put_cmd(info, req, info->wdata ? "s_dwrite" : "s_write");
 	if (!s) {
 		result = -ENAMETOOLONG;
 		goto error;
 	}
 
-	result = snprintf(s, SOCKBUF_SIZE - (s - info->sockbuf), 
+	result = snprintf(s, SOCKBUF_SIZE - (s - req->buf), 
 		"'%s' %u %u %u %u %lu\n", file, offset, count, bs, offset2, ino);
 	if (result < 0) {
 		result = -ENAMETOOLONG;
 		goto error;
 	}
 
-	DEBUG(">%s", info->sockbuf);
-	result = sock_write(info, (void *)info->sockbuf, strlen(info->sockbuf));
+	if (info->wdata) {
+		/* data follow the command line, no round trip in between */
+		result = req_send_data(req, buffer, count);
+		if (result < 0)
+			goto error;
+		goto complete;
+	}
+
+	/* nothing else may be sent until the data is */
+	DEBUG(">%s", req->buf);
+	result = req_send(req, 1);
 	if (result < 0)
 		goto error;
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
-	if (result < 0) {
-		set_garbage(info, 1, count);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
+	if (result < 0)
 		goto error;
-	}
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_PRELIM:
 		break;
 	case REP_EPERM:
@@ -643,13 +999,14 @@ shell_write(struct shfs_sb_info *info, char *file, unsigned offset,
 		goto error;
 	}
 
-	result = sock_write(info, buffer, count);
+	result = sock_write(req->conn, buffer, count);
 	if (result < 0)
 		goto error;
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+complete:
+	result = read_status(info, req, fattr);
 	if (result < 0)
 		goto error;
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_COMPLETE:
 		break;
 	case REP_EPERM:
@@ -660,7 +1017,9 @@ shell_write(struct shfs_sb_info *info, char *file, unsigned offset,
 		goto error;
 	case REP_ENOSPC:
 		result = -ENOSPC;
-		set_garbage(info, 1, count);
+		/* remote side drains the data once more (not s_dwrite) */
+		if (!info->wdata)
+			set_garbage(req->conn, 1, count);
 		goto error;
 	default:
 		result = -EIO;
@@ -669,19 +1028,19 @@ shell_write(struct shfs_sb_info *info, char *file, unsigned offset,
 
 	result = count;
 error:
-	sock_unlock(info);
+	req_free(req);
 	DEBUG(">%d\n", result);
 	return result;
 }
 
 static int
-shell_mkdir(struct shfs_sb_info *info, char *dir)
+shell_mkdir(struct shfs_sb_info *info, char *dir, struct shfs_fattr *fattr)
 {
 	if (!check_path(dir))
 		return -ENAMETOOLONG;
 
 	DEBUG("Mkdir %s\n", dir);
-	return do_command(info, "s_mkdir", "'%s'", dir);
+	return do_attr_command(info, fattr, "s_mkdir", "'%s'", dir);
 }
 
 static int
@@ -715,55 +1074,54 @@ shell_unlink(struct shfs_sb_info *info, char *file)
 }
 
 static int
-shell_create(struct shfs_sb_info *info, char *file, int mode)
+shell_create(struct shfs_sb_info *info, char *file, int mode, struct shfs_fattr *fattr)
 {
 	if (!check_path(file))
 		return -ENAMETOOLONG;
 
 	DEBUG("Create %s (%o)\n", file, mode);
-	return do_command(info, "s_creat", "'%s' %o", file, mode & S_IALLUGO);
+	return do_attr_command(info, fattr, "s_creat", "'%s' %o", file, mode & S_IALLUGO);
 }
 
 static int
-shell_link(struct shfs_sb_info *info, char *old, char *new)
+shell_link(struct shfs_sb_info *info, char *old, char *new, struct shfs_fattr *fattr)
 {
 	if (!check_path(old) || !check_path(new))
 		return -ENAMETOOLONG;
 
 	DEBUG("Link %s -> %s\n", old, new);
-	return do_command(info, "s_ln", "'%s' '%s'", old, new);
+	return do_attr_command(info, fattr, "s_ln", "'%s' '%s'", old, new);
 }
 
 static int
-shell_symlink(struct shfs_sb_info *info, char *old, char *new)
+shell_symlink(struct shfs_sb_info *info, char *old, char *new, struct shfs_fattr *fattr)
 {
 	if (!check_path(old) || !check_path(new))
 		return -ENAMETOOLONG;
 
 	DEBUG("Symlink %s -> %s\n", old, new);
-	return do_command(info, "s_sln", "'%s' '%s'", old, new);
+	return do_attr_command(info, fattr, "s_sln", "'%s' '%s'", old, new);
 }
 
 static int
 shell_readlink(struct shfs_sb_info *info, char *name, char *real_name)
 {
+	struct shfs_req *req;
 	char *s;
 	int result = 0;
 
 	if (!check_path(name) || !check_path(real_name))
 		return -ENAMETOOLONG;
 
-	if (!sock_lock(info))
-		return -EINTR;
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
 
-	s = info->sockbuf;
-	strcpy(s, "s_readlink"); s += strlen("s_readlink");
-	s = get_ugid(info, s, SOCKBUF_SIZE - strlen(info->sockbuf));
+	s = put_cmd(info, req, "s_readlink");
 	if (!s) {
 		result = -ENAMETOOLONG;
 		goto error;
 	}
-	if (s - info->sockbuf + strlen(name) + 4 > SOCKBUF_SIZE) {
+	if (s - req->buf + strlen(name) + 4 > SOCKBUF_SIZE) {
 		result = -ENAMETOOLONG;
 		goto error;
 	}
@@ -772,15 +1130,15 @@ shell_readlink(struct shfs_sb_info *info, char *name, char *real_name)
 	strcpy(s, "'"); s++;
 	strcpy(s, "\n");
 
-	DEBUG("Readlink %s\n", info->sockbuf);
-	result = sock_write(info, (void *)info->sockbuf, strlen(info->sockbuf));
+	DEBUG("Readlink %s\n", req->buf);
+	result = req_send(req, 0);
 	if (result < 0)
 		goto error;
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
 	if (result < 0)
 		goto error;
 
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_COMPLETE:
 		result = -EIO;
 		goto error;
@@ -789,13 +1147,13 @@ shell_readlink(struct shfs_sb_info *info, char *name, char *real_name)
 		goto error;
 	}
 
-	strncpy(real_name, info->sockbuf, SHFS_PATH_MAX-1);
+	strncpy(real_name, req->buf, SHFS_PATH_MAX-1);
 	real_name[SHFS_PATH_MAX-1] = '\0';
 
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
 	if (result < 0)
 		goto error;
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_COMPLETE:
 		result = 0;
 		break;
@@ -803,47 +1161,46 @@ shell_readlink(struct shfs_sb_info *info, char *name, char *real_name)
 		result = -EPERM;
 		goto error;
 	default:
-		info->garbage = 1;
 		result = -EIO;
 		goto error;
 	}
 error:
-	sock_unlock(info);
+	req_free(req);
 	return result;
 }
 
 static int
-shell_chmod(struct shfs_sb_info *info, char *file, umode_t mode)
+shell_chmod(struct shfs_sb_info *info, char *file, umode_t mode, struct shfs_fattr *fattr)
 {
 	if (!check_path(file))
 		return -ENAMETOOLONG;
 
 	DEBUG("Chmod %o %s\n", mode, file);
-	return do_command(info, "s_chmod", "'%s' %o", file, mode);
+	return do_attr_command(info, fattr, "s_chmod", "'%s' %o", file, mode);
 }
 
 static int
-shell_chown(struct shfs_sb_info *info, char *file, uid_t user)
+shell_chown(struct shfs_sb_info *info, char *file, uid_t user, struct shfs_fattr *fattr)
 {
 	if (!check_path(file))
 		return -ENAMETOOLONG;
 
 	DEBUG("Chown %u %s\n", user, file);
-	return do_command(info, "s_chown", "'%s' %u", file, user);
+	return do_attr_command(info, fattr, "s_chown", "'%s' %u", file, user);
 }
 
 static int
-shell_chgrp(struct shfs_sb_info *info, char *file, gid_t group)
+shell_chgrp(struct shfs_sb_info *info, char *file, gid_t group, struct shfs_fattr *fattr)
 {
 	if (!check_path(file))
 		return -ENAMETOOLONG;
 
 	DEBUG("Chgrp %u %s\n", group, file);
-	return do_command(info, "s_chgrp", "'%s' %u", file, group);
+	return do_attr_command(info, fattr, "s_chgrp", "'%s' %u", file, group);
 }
 
 static int
-shell_trunc(struct shfs_sb_info *info, char *file, loff_t size)
+shell_trunc(struct shfs_sb_info *info, char *file, loff_t size, struct shfs_fattr *fattr)
 {
 	unsigned seek = 1;
 
@@ -856,7 +1213,7 @@ shell_trunc(struct shfs_sb_info *info, char *file, loff_t size)
 		seek = 0;
 		size = 1;
 	}
-	return do_command(info, "s_trunc", "'%s' %u %u", file, (unsigned) size, seek);
+	return do_attr_command(info, fattr, "s_trunc", "'%s' %u %u", file, (unsigned) size, seek);
 }
 
 /* this code is borrowed from dietlibc */
@@ -927,7 +1284,7 @@ strctime(const struct timespec *timep, char *s)
 }
 
 static int
-shell_settime(struct shfs_sb_info *info, char *file, int atime, int mtime, struct timespec *time)
+shell_settime(struct shfs_sb_info *info, char *file, int atime, int mtime, struct timespec *time, struct shfs_fattr *fattr)
 {
 	char str[20];
 	
@@ -936,12 +1293,150 @@ shell_settime(struct shfs_sb_info *info, char *file, int atime, int mtime, struc
 
 	strctime(time, str);
 	DEBUG("Settime %s (%s%s) %s\n", str, atime ? "a" : "", mtime ? "m" : "", file);
-	return do_command(info, "s_settime", "'%s' %s%s %s", file, atime ? "a" : "", mtime ? "m" : "", str);
+	return do_attr_command(info, fattr, "s_settime", "'%s' %s%s %s", file, atime ? "a" : "", mtime ? "m" : "", str);
+}
+
+#define SEQ_MAX		8		/* steps in one s_seq */
+
+/* step as a command of s_seq, returns its length or -1 */
+static int
+put_step(char *s, int max, struct shfs_step *step)
+{
+	char file[SHFS_PATH_MAX], str[20];
+	unsigned size = step->size, seek = 1;
+
+	strcpy(file, step->file);
+	if (!check_path(file))
+		return -1;
+	switch (step->op) {
+	case SHFS_CHMOD:
+		return snprintf(s, max, "s_chmod '%s' %o", file, step->mode);
+	case SHFS_CHOWN:
+		return snprintf(s, max, "s_chown '%s' %u", file, step->uid);
+	case SHFS_CHGRP:
+		return snprintf(s, max, "s_chgrp '%s' %u", file, step->gid);
+	case SHFS_TRUNC:
+		/* as shell_trunc() */
+		if (size == 0) {
+			seek = 0;
+			size = 1;
+		}
+		return snprintf(s, max, "s_trunc '%s' %u %u", file, size, seek);
+	case SHFS_SETTIME:
+		strctime(step->time, str);
+		return snprintf(s, max, "s_settime '%s' %s%s %s", file, step->atime ? "a" : "", step->mtime ? "m" : "", str);
+	}
+	return -1;
+}
+
+/*
+ * s_seq of as many steps as fit in one request, returns how many the
+ * server got to (the last one failed if they are not all)
+ */
+static int
+do_seq(struct shfs_sb_info *info, struct shfs_step *step, int n)
+{
+	struct shfs_req *req;
+	struct qstr name;
+	char *s, *p, *end, *line;
+	int count, i = 0, res;
+
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
+	s = put_cmd(info, req, "s_seq");
+	if (!s) {
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+	end = req->buf + SOCKBUF_SIZE - 2;
+	for (count = 0; count < n && count < SEQ_MAX; count++) {
+		p = s + (count ? 3 : 0);
+		res = p < end ? put_step(p, end - p, &step[count]) : -1;
+		if (res < 0 || p + res >= end)
+			break;
+		if (count)
+			memcpy(s, " ; ", 3);
+		s = p + res;
+	}
+	if (!count) {
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+	strcpy(s, "\n");
+
+	DEBUG(">%s\n", req->buf);
+	res = req_send(req, 0);
+	if (res < 0)
+		goto out;
+
+	/* output of a step, then "=NNN" */
+	while ((res = req_getln(req, &line)) > 0) {
+		switch (reply(line)) {
+		case 0:
+			break;
+		case REP_COMPLETE:
+			res = i ? i : -EIO;
+			goto out;
+		default:
+			res = -EIO;
+			goto out;
+		}
+		if (i == count)
+			continue;
+		if (line[0] != '=') {
+			if (step[i].fattr && info->attrs && parse_plus(info, line, step[i].fattr, &name) < 0)
+				step[i].fattr->f_mode = 0;
+			continue;
+		}
+		switch (simple_strtoul(line + 1, NULL, 10)) {
+		case REP_COMPLETE:
+		case REP_NOP:
+		case REP_NOTEMPTY:
+			step[i].result = 0;
+			break;
+		case REP_EPERM:
+			step[i].result = -EPERM;
+			break;
+		case REP_ENOENT:
+			step[i].result = -ENOENT;
+			break;
+		case REP_ENOSPC:
+			step[i].result = -ENOSPC;
+			break;
+		default:
+			step[i].result = -EIO;
+			break;
+		}
+		i++;
+	}
+	if (!res)
+		res = -EIO;
+out:
+	req_free(req);
+	return res;
+}
+
+static int
+shell_seq(struct shfs_sb_info *info, struct shfs_step *step, int n)
+{
+	int i, res;
+
+	for (i = 0; i < n; i++)
+		step[i].result = -ECANCELED;
+	for (i = 0; i < n; i += res) {
+		res = do_seq(info, step + i, n - i);
+		if (res < 0)
+			return res;
+		if (step[i + res - 1].result < 0)
+			return step[i + res - 1].result;
+	}
+	return 0;
 }
 
 static int
 shell_statfs(struct shfs_sb_info *info, struct kstatfs *attr)
 {
+	struct shfs_req *req;
 	char *s, *p;
 	int result = 0;
 
@@ -954,27 +1449,25 @@ shell_statfs(struct shfs_sb_info *info, struct kstatfs *attr)
 	attr->f_bavail = 1;
 	attr->f_namelen = SHFS_PATH_MAX;
 
-	if (!sock_lock(info))
-		return -EINTR;
+	if (!(req = req_alloc(info, NULL)))
+		return -ENOMEM;
 
-	s = info->sockbuf;
-	strcpy(s, "s_statfs"); s += strlen("s_statfs");
-	s = get_ugid(info, s, SOCKBUF_SIZE - strlen(info->sockbuf));
+	s = put_cmd(info, req, "s_statfs");
 	if (!s) {
 		result = -ENAMETOOLONG;
 		goto error;
 	}
 	strcpy(s, "\n");
 
-	DEBUG("Statfs %s\n", info->sockbuf);
-	result = sock_write(info, (void *)info->sockbuf, strlen(info->sockbuf));
+	DEBUG("Statfs %s\n", req->buf);
+	result = req_send(req, 0);
 	if (result < 0)
 		goto error;
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
 	if (result < 0)
 		goto error;
 
-	s = info->sockbuf;
+	s = req->buf;
 	if ((p = strsep(&s, " ")))
 		attr->f_blocks = simple_strtoull(p, NULL, 10) >> 2;
 	if ((p = strsep(&s, " ")))
@@ -982,10 +1475,10 @@ shell_statfs(struct shfs_sb_info *info, struct kstatfs *attr)
 	if ((p = strsep(&s, " ")))
 		attr->f_bavail = simple_strtoull(p, NULL, 10) >> 2;
 
-	result = sock_readln(info, info->sockbuf, SOCKBUF_SIZE);
+	result = req_readln(req, req->buf, SOCKBUF_SIZE);
 	if (result < 0)
 		goto error;
-	switch (reply(info->sockbuf)) {
+	switch (reply(req->buf)) {
 	case REP_COMPLETE:
 		result = 0;
 		break;
@@ -993,27 +1486,36 @@ shell_statfs(struct shfs_sb_info *info, struct kstatfs *attr)
 		result = -EPERM;
 		goto error;
 	default:
-		info->garbage = 1;
 		result = -EIO;
 		goto error;
 	}
 error:
-	sock_unlock(info);
+	req_free(req);
 	return result;
 }
 
 static int
 shell_finish(struct shfs_sb_info *info)
 {
+	int i, result = 0;
+
 	DEBUG("Finish\n");
-	return do_command(info, "s_finish", "");
+	for (i = 0; i < info->conns; i++) {
+		if (!info->conn[i].sock)
+			continue;
+		if (do_conn_command(info, &info->conn[i], "s_finish", "") < 0)
+			result = -EIO;
+	}
+	return result;
 }
 
 struct shfs_fileops shell_fops = {
 	readdir:	shell_readdir,
 	stat:		shell_stat,
+	statv:		shell_statv,
 	open:		shell_open,
 	read:		shell_read,
+	readv:		shell_readv,
 	write:		shell_write,
 	mkdir:		shell_mkdir,
 	rmdir:		shell_rmdir,
@@ -1028,6 +1530,7 @@ struct shfs_fileops shell_fops = {
 	chgrp:		shell_chgrp,
 	trunc:		shell_trunc,
 	settime:	shell_settime,
+	seq:		shell_seq,
 	statfs:		shell_statfs,
 	finish:		shell_finish,
 };
@@ -1,10 +1,11 @@
 #ifndef _SHFS_H
 #define _SHFS_H
 
-#define PROTO_VERSION 2
+#define PROTO_VERSION 3
 
 /* response code */
 #define REP_PRELIM	100
+#define REP_TAG		110		/* "### 110 <tag>" starts reply */
 #define REP_COMPLETE	200
 #define REP_NOP 	201
 #define REP_NOTEMPTY	202		/* file with zero size but not empty */
@@ -5,6 +5,8 @@
 
 #define SHFS_IOC_NEWCONN	_IOW('s', 2, int)
 
+#define SHFS_MAX_CONNS		16	/* max number of parallel connections */
+
 #ifdef __KERNEL__
 
 #include <linux/ioctl.h>
@@ -14,36 +16,51 @@
 #define SOCKBUF_SIZE		(SHFS_PATH_MAX * 10)
 #define READLNBUF_SIZE		(SHFS_PATH_MAX * 10)
 
-#define SHFS_FCACHE_MAX		10	/* max number of files cached */
+#define SHFS_FCACHE_MAX		256	/* max number of files cached */
 #define SHFS_FCACHE_PAGES	32	/* should be 2^x */
 
 struct shfs_sb_info;
-
-struct shfs_cache_head {
-//	time_t		mtime;	/* unused */
-	unsigned long	time;	/* cache age */
-	unsigned long	end;	/* last valid fpos in cache */
-	int		eof;
+struct shfs_step;
+
+/* name index of the last complete listing of a directory */
+struct shfs_name {
+	struct shfs_name *next;		/* hash chain */
+	struct shfs_fattr fattr;
+	unsigned int hash;
+	unsigned int idx;		/* f_pos - 2 */
+	unsigned int len;
+	char name[0];
 };
 
-#define SHFS_DIRCACHE_SIZE	((int)(PAGE_CACHE_SIZE/sizeof(struct dentry *)))
-union shfs_dir_cache {
-	struct shfs_cache_head   head;
-	struct dentry           *dentry[SHFS_DIRCACHE_SIZE];
+/* names are packed into pages */
+struct shfs_names_page {
+	struct shfs_names_page *next;
+	unsigned long used;
+	char data[0];			/* long aligned */
 };
 
-#define SHFS_FIRSTCACHE_SIZE	((int)((SHFS_DIRCACHE_SIZE * \
-	sizeof(struct dentry *) - sizeof(struct shfs_cache_head)) / \
-	sizeof(struct dentry *)))
-
-#define SHFS_DIRCACHE_START      (SHFS_DIRCACHE_SIZE - SHFS_FIRSTCACHE_SIZE)
+#define SHFS_NAMES_BITS		6	/* initial hash size */
+#define SHFS_NAMES_MAXBITS	12
+#define SHFS_NAMES_CHUNK	((int)(PAGE_SIZE / sizeof(struct shfs_name *)))
+
+struct shfs_names {
+	atomic_t refs;
+	unsigned long time;		/* listing started, jiffies */
+	unsigned int gen;		/* names_gen of the directory then */
+	int count;			/* positions, some may be holes */
+	int bits;
+	struct shfs_name **hash;	/* by name */
+	struct shfs_name ***pos;	/* by f_pos - 2, in chunks */
+	int chunks;
+	struct shfs_names_page *pages;
+};
 
+/* listing being read, see shfs_fill_cache() */
 struct shfs_cache_control {
-	struct  shfs_cache_head		head;
-	struct  page			*page;
-	union   shfs_dir_cache		*cache;
-	unsigned long			fpos, ofs;
-	int				filled, valid, idx;
+	struct  shfs_names		*names;	/* being built, or NULL */
+	struct  shfs_names		*old;	/* previous one, for inode numbers */
+	unsigned long			fpos;
+	int				filled;
 };
 
 /* use instead of CURRENT_TIME since precision is minutes, not seconds */
@@ -53,7 +70,6 @@ struct shfs_cache_control {
 extern struct file_operations shfs_dir_operations;
 extern struct inode_operations shfs_dir_inode_operations;
 extern void shfs_new_dentry(struct dentry *dentry);
-extern void shfs_age_dentry(struct shfs_sb_info *info, struct dentry *dentry);
 extern void shfs_renew_times(struct dentry * dentry);
 
 /* shfs/file.c */
@@ -61,6 +77,7 @@ extern struct file_operations shfs_file_operations;
 extern struct file_operations shfs_slow_operations;
 extern struct inode_operations shfs_file_inode_operations;
 extern struct address_space_operations shfs_file_aops;
+void shfs_set_open(struct inode *inode, int mask);
 
 /* shfs/symlink.c */
 extern struct inode_operations shfs_symlink_inode_operations;
@@ -68,23 +85,30 @@ extern struct inode_operations shfs_symlink_inode_operations;
 /* shfs/dcache.c */
 void shfs_invalid_dir_cache(struct inode * dir);
 void shfs_invalidate_dircache_entries(struct dentry *parent);
-struct dentry *shfs_dget_fpos(struct dentry*, struct dentry*, unsigned long);
 int shfs_fill_cache(struct file*, void*, filldir_t, struct shfs_cache_control*, struct qstr*, struct shfs_fattr*);
+struct shfs_names *shfs_names_alloc(struct inode *dir);
+struct shfs_names *shfs_names_get(struct inode *dir);
+void shfs_names_put(struct shfs_names *names);
+void shfs_names_set(struct inode *dir, struct shfs_names *names);
+void shfs_names_drop(struct inode *dir);
+int shfs_names_lookup(struct inode *dir, struct qstr *name, struct shfs_fattr *fattr, unsigned long *time);
+void shfs_names_readdir(struct file *filp, void *dirent, filldir_t filldir, struct shfs_names *names);
+void shfs_names_update(struct inode *dir, struct qstr *name, struct shfs_fattr *fattr);
+void shfs_names_move(struct inode *old_dir, struct qstr *old, struct inode *new_dir, struct qstr *new);
 
 /* shfs/fcache.c */
 #include <linux/slab.h>
 extern struct kmem_cache *file_cache;
+extern struct workqueue_struct *fcache_wq;
 extern struct kmem_cache *dir_head_cache;
 extern struct kmem_cache *dir_entry_cache;
 extern struct kmem_cache *dir_name_cache;
 void fcache_init(void);
 void fcache_finish(void);
 int fcache_file_open(struct file*);
-int fcache_file_sync(struct file*);
 int fcache_file_close(struct file*);
 int fcache_file_clear(struct inode*);
-int fcache_file_read(struct file*, unsigned, unsigned, char*);
-int fcache_file_write(struct file*, unsigned, unsigned, char*);
+int fcache_file_window(struct file*, unsigned long);
 
 /* shfs/ioctl.c */
 int shfs_ioctl(struct inode *inode, struct file *f, unsigned int cmd, unsigned long arg);
@@ -92,25 +116,57 @@ int shfs_ioctl(struct inode *inode, struct file *f, unsigned int cmd, unsigned l
 #include <linux/statfs.h>
 
 /* shfs/proc.c */
+struct shfs_conn;
 int parse_options(struct shfs_sb_info *info, char *opts);
-int sock_write(struct shfs_sb_info *info, const void *buf, int count);
-int sock_read(struct shfs_sb_info *info, void *buffer, int count);
-int sock_readln(struct shfs_sb_info *info, char *buffer, int count);
+void conn_nofs(struct shfs_conn *conn);
+int conn_init(struct shfs_conn *conn);
+void conn_free(struct shfs_conn *conn);
+struct shfs_conn *conn_dead(struct shfs_sb_info *info);
+int sock_write(struct shfs_conn *conn, const void *buf, int count);
+int sock_writev(struct shfs_conn *conn, struct kvec *iov, int nr, int count);
+int sock_read(struct shfs_conn *conn, void *buffer, int count);
+int sock_readv(struct shfs_conn *conn, struct kvec *iov, int nr, int count);
+int sock_getln(struct shfs_conn *conn, char **line);
+int sock_readln(struct shfs_conn *conn, char *buffer, int count);
 int reply(char *s);
-void set_garbage(struct shfs_sb_info *info, int write, int count);
+void set_garbage(struct shfs_conn *conn, int write, int count);
+struct shfs_req;
+void req_init(void);
+void req_finish(void);
+struct shfs_req *req_alloc(struct shfs_sb_info *info, struct shfs_conn *conn);
+int req_send(struct shfs_req *req, int hold);
+int req_send_data(struct shfs_req *req, const void *data, int count);
+int req_sendv(struct shfs_req *req, struct kvec *iov, int nr, int count);
+int req_getln(struct shfs_req *req, char **line);
+int req_readln(struct shfs_req *req, char *buffer, int count);
+int req_avail(struct shfs_req *req);
+int req_packet(struct shfs_req *req);
+int req_read(struct shfs_req *req, void *buffer, int count);
+int req_readv(struct shfs_req *req, struct kvec *iov, int nr, int count);
+void req_free(struct shfs_req *req);
 int get_name(struct dentry *d, char *name);
+int shfs_seq(struct shfs_sb_info *info, struct shfs_step *step, int n);
 int shfs_notify_change(struct dentry *dentry, struct iattr *attr);
+void shfs_pending_attr(struct inode *inode);
+int shfs_flush_attr(struct dentry *dentry, struct inode *inode);
+int shfs_write(struct inode *inode, char *file, unsigned offset, unsigned count, char *buffer);
 int shfs_statfs(struct dentry *dentry, struct kstatfs *attr);
+int shfs_stat(struct shfs_sb_info *info, char *file, struct shfs_fattr *fattr, struct page **data);
 	
 /* shfs/inode.c */
 void shfs_set_inode_attr(struct inode *inode, struct shfs_fattr *fattr);
+void shfs_update_inode_attr(struct inode *inode, struct shfs_fattr *fattr);
 struct inode *shfs_iget(struct super_block*, struct shfs_fattr*);
+void shfs_set_inline(struct inode *inode, struct page *page);
 int shfs_revalidate_inode(struct dentry*);
 int shfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat);
 
 /* shfs/shell.c */
 extern struct shfs_fileops shell_fops;
 
+/* shfs/sftp.c */
+extern struct shfs_fileops sftp_fops;
+
 #endif  /* __KERNEL__ */
 
 #endif	/* _SHFS_FS_H */
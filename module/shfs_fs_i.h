@@ -7,13 +7,27 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/fs.h>
 
 struct shfs_file;
+struct shfs_names;
 
 struct shfs_inode_info {
 	unsigned long oldmtime;		/* last time refreshed */
 	int unset_write_on_close;	/* created ro, opened for write */
+	int open_ok;			/* 1 << O_* s_open would allow */
+	unsigned long open_time;	/* when learnt, see shfs_set_open() */
 	struct shfs_file *cache;	/* readahead cache */
+	struct mutex cache_mutex;	/* guards cache, cache_users */
+	int cache_users;		/* files open, the last frees cache */
+	struct mutex refresh_mutex;	/* one shfs_refresh_inode() at a time */
+	spinlock_t names_lock;		/* guards names */
+	struct shfs_names *names;	/* directory name index */
+	unsigned int names_gen;		/* bumped by shfs_names_drop() */
+	unsigned long list_gen;		/* bumped when listed again */
+	struct iattr pending;		/* lazyattr changes not sent, i_lock */
 };
 
 #endif
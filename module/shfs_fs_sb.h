@@ -3,35 +3,95 @@
 
 #include <linux/version.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
 #include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/backing-dev.h>
 
 #ifdef __KERNEL__
 
+struct page;
+
+/* change of a file in a compound request, see shfs_seq() */
+#define SHFS_CHMOD	1
+#define SHFS_CHOWN	2
+#define SHFS_CHGRP	3
+#define SHFS_TRUNC	4
+#define SHFS_SETTIME	5
+
+struct shfs_step {
+	int op;				/* SHFS_CHMOD... */
+	char *file;
+	umode_t mode;
+	uid_t uid;
+	gid_t gid;
+	loff_t size;
+	int atime, mtime;		/* SHFS_SETTIME to *time */
+	struct timespec *time;
+	struct shfs_fattr *fattr;	/* as of the fileops below */
+	int result;			/* -ECANCELED if not run */
+};
+
+/*
+ * Changes fill fattr (may be NULL) with the attributes the file has
+ * afterwards if the server sends them (info->attrs); callers clear
+ * f_mode to tell.  Statv sets data[i] (data may be NULL) to a page
+ * holding file i if the server sent its content (info->lookup).
+ */
 struct shfs_fileops {
 	int (*readdir)(struct shfs_sb_info *info, char *dir, struct file *filp, void *dirent, filldir_t filldir, struct shfs_cache_control *ctl);
 	int (*stat)(struct shfs_sb_info *info, char *file, struct shfs_fattr *fattr);
+	int (*statv)(struct shfs_sb_info *info, int n, char **files, struct shfs_fattr **fattr, struct page **data, int *result);
 	int (*open)(struct shfs_sb_info *info, char *file, int mode);
 	int (*read)(struct shfs_sb_info *info, char *file, unsigned offset,
 		    unsigned count, char *buffer, unsigned long ino);
+	int (*readv)(struct shfs_sb_info *info, char *file, unsigned offset,
+		     unsigned count, struct kvec *iov, int nr);
 	int (*write)(struct shfs_sb_info *info, char *file, unsigned offset,
-		     unsigned count, char *buffer, unsigned long ino);
-	int (*mkdir)(struct shfs_sb_info *info, char *dir);
+		     unsigned count, char *buffer, unsigned long ino, struct shfs_fattr *fattr);
+	int (*mkdir)(struct shfs_sb_info *info, char *dir, struct shfs_fattr *fattr);
 	int (*rmdir)(struct shfs_sb_info *info, char *dir);
 	int (*rename)(struct shfs_sb_info *info, char *old, char *new);
 	int (*unlink)(struct shfs_sb_info *info, char *file);
-	int (*create)(struct shfs_sb_info *info, char *file, int mode);
-	int (*link)(struct shfs_sb_info *info, char *old, char *new);
-	int (*symlink)(struct shfs_sb_info *info, char *old, char *new);
+	int (*create)(struct shfs_sb_info *info, char *file, int mode, struct shfs_fattr *fattr);
+	int (*link)(struct shfs_sb_info *info, char *old, char *new, struct shfs_fattr *fattr);
+	int (*symlink)(struct shfs_sb_info *info, char *old, char *new, struct shfs_fattr *fattr);
 	int (*readlink)(struct shfs_sb_info *info, char *name, char *real_name);
-	int (*chmod)(struct shfs_sb_info *info, char *file, umode_t mode);
-	int (*chown)(struct shfs_sb_info *info, char *file, uid_t user);
-	int (*chgrp)(struct shfs_sb_info *info, char *file, gid_t group);
-	int (*trunc)(struct shfs_sb_info *info, char *file, loff_t size);
-	int (*settime)(struct shfs_sb_info *info, char *file, int atime, int mtime, struct timespec *time);
+	int (*chmod)(struct shfs_sb_info *info, char *file, umode_t mode, struct shfs_fattr *fattr);
+	int (*chown)(struct shfs_sb_info *info, char *file, uid_t user, struct shfs_fattr *fattr);
+	int (*chgrp)(struct shfs_sb_info *info, char *file, gid_t group, struct shfs_fattr *fattr);
+	int (*trunc)(struct shfs_sb_info *info, char *file, loff_t size, struct shfs_fattr *fattr);
+	int (*settime)(struct shfs_sb_info *info, char *file, int atime, int mtime, struct timespec *time, struct shfs_fattr *fattr);
+	int (*seq)(struct shfs_sb_info *info, struct shfs_step *step, int n);
 	int (*statfs)(struct shfs_sb_info *info, struct kstatfs *attr);
 	int (*finish)(struct shfs_sb_info *info);
 };
 
+/*
+ * One shell session.  Requests are pipelined: senders serialize on
+ * send_mutex, replies are matched to requests by tag (see req_wait()).
+ */
+struct shfs_conn {
+	struct mutex send_mutex;	/* garbage_write, tag order on the wire */
+	struct mutex recv_mutex;	/* readlnbuf, garbage_read, rx_tag */
+	wait_queue_head_t rx_wait;	/* waiting for own reply header */
+	atomic_t tag_next;
+	atomic_t pending;		/* requests sent, reply not finished */
+	unsigned int rx_tag;		/* header read, owner not yet woken */
+	int rx_status;			/* frame header of rx_tag (info->frame) */
+	unsigned int rx_len;
+	unsigned int gen;		/* bumped by SHFS_IOC_NEWCONN */
+	int dead;			/* i/o error, waiting for reconnect */
+	struct file *sock;
+	char *readlnbuf;
+	int readlnbuf_start;
+	int readlnbuf_len;
+	int garbage_read;
+	int garbage_write;
+};
+
 #define info_from_inode(inode) ((struct shfs_sb_info *)(inode)->i_sb->s_fs_info)
 #define info_from_dentry(dentry) ((struct shfs_sb_info *)(dentry)->d_sb->s_fs_info)
 #define info_from_sb(sb) ((struct shfs_sb_info *)(sb)->s_fs_info)
@@ -51,20 +111,31 @@ struct shfs_sb_info {
 	mode_t root_mode;
 	mode_t fmask;
 	char mount_point[SHFS_PATH_MAX];
-	//struct semaphore sock_sem;	/* next 4 vars are guarded */
-	struct file *sock;
-	char *sockbuf;
-	char *readlnbuf;
-	int readlnbuf_len;
+	char root[SHFS_PATH_MAX];	/* remote root (sftp only) */
+	struct shfs_conn conn[SHFS_MAX_CONNS];
+	int conns;			/* connections in use */
+	atomic_t conn_next;		/* round-robin hint for req_alloc() */
 	spinlock_t fcache_lock;		/* fcache_free is guarded */
 	int fcache_free;
 	int fcache_size; 
-	int garbage_read;
-	int garbage_write;
-	int garbage:1;
+	struct backing_dev_info bdi;	/* writeback of dirty pages */
+	spinlock_t statv_lock;		/* statv_queue, statv_busy */
+	struct list_head statv_queue;	/* shfs_stat() callers, see proc.c */
+	int statv_busy;			/* batches on the wire, up to conns */
+	unsigned int inline_max;	/* s_lookup files up to this size */
 	int readonly:1;
 	int preserve_own:1;
 	int stable_symlinks:1;
+	int wdata:1;			/* server takes s_dwrite */
+	int frame:1;			/* replies are framed, see req_wait() */
+	int sftp:1;			/* sftp-server session, see sftp.c */
+	int plus:1;			/* server has s_lsplus/s_statplus */
+	int statv:1;			/* server has s_statv */
+	int attrs:1;			/* changes reply a s_statplus row */
+	int seq:1;			/* server has s_seq */
+	int lookup:1;			/* server has s_lookup */
+	int range:1;			/* s_read of any range in one pass */
+	int lazyattr:1;			/* setattr waits for shfs_flush_attr() */
 };
 
 #endif /* __KERNEL__ */
@@ -2,12 +2,18 @@
 "use Fcntl;\n"
 "use IO::File;\n"
 "my $ROOT;\n"
-"my ($PRELIM) = (\"### 100\\n\");\n"
+"my ($PRELIM, $TAG) = (\"### 100\\n\", \"### 110\");\n"
 "my ($COMPLETE, $NOP, $NOTEMPTY) = (\"### 200\\n\", \"### 201\\n\", \"### 202\\n\");\n"
 "my ($CONTINUE, $TRANSIENT) = (\"### 300\\n\", \"### 400\\n\");\n"
 "my ($ERROR, $EPERM, $ENOSPC, $ENOENT) = (\"### 500\\n\", \"### 501\\n\", \"### 502\\n\", \"### 503\\n\");\n"
 "my $STABLE = \"\";\n"
 "my $PRESERVE = 0;\n"
+"my $ATTRS = 0;\n"
+"my $FTAG = \"\";\n"
+"my %FH;\n"
+"my $FHMAX = 8;\n"
+"my $FHCLOCK = 0;\n"
+"my $HIRES = eval { require Time::HiRes; Time::HiRes::lstat(\"/\"); 1 };\n"
 "sub s_init()\n"
 "{\n"
 "	my $args = $_[0];\n"
@@ -25,6 +31,8 @@
 "			$STABLE = \"L\";\n"
 "		} elsif ($s eq \"preserve\") {\n"
 "			$PRESERVE = 1;\n"
+"		} elsif ($s eq \"attrs\") {\n"
+"			$ATTRS = 1;\n"
 "		}\n"
 "	}\n"
 "	print($COMPLETE);\n"
@@ -33,6 +41,74 @@
 "{\n"
 "	print($COMPLETE);\n"
 "}\n"
+"sub s_frame()\n"
+"{\n"
+"	my $s;\n"
+"	$FTAG = $_[0];\n"
+"	foreach $s (\\$PRELIM, \\$COMPLETE, \\$NOP, \\$NOTEMPTY, \\$CONTINUE,\n"
+"	    \\$TRANSIENT, \\$ERROR, \\$EPERM, \\$ENOSPC, \\$ENOENT) {\n"
+"		$$s =~ s/^#+ ?(\\d{3}).*/#$1 $FTAG 00000000/;\n"
+"	}\n"
+"}\n"
+"sub data()\n"
+"{\n"
+"	my $data = $_[0];\n"
+"	printf(\"#000 %s %08x\\n\", $FTAG, length($data)) if ($FTAG);\n"
+"	print($data);\n"
+"}\n"
+"sub run()\n"
+"{\n"
+"	my ($pid, $out);\n"
+"	return system(@_) if (not $FTAG);\n"
+"	$pid = open(PIPE, \"-|\");\n"
+"	return -1 if (not defined $pid);\n"
+"	if ($pid == 0) {\n"
+"		exec(@_) or POSIX::_exit(1);\n"
+"	}\n"
+"	{\n"
+"		local $/;\n"
+"		$out = <PIPE>;\n"
+"	}\n"
+"	close(PIPE);\n"
+"	&data(defined $out ? $out : \"\");\n"
+"	return $?;\n"
+"}\n"
+"sub getfh()\n"
+"{\n"
+"	my ($file, $mode) = @_;\n"
+"	my $key = \"$mode $file\";\n"
+"	my ($fh, $k, $lru, @st, @fst);\n"
+"	if ($FH{$key}) {\n"
+"		@st = stat(\"$ROOT$file\");\n"
+"		@fst = stat($FH{$key}[0]);\n"
+"		if (@st and @fst and $st[0] == $fst[0] and $st[1] == $fst[1]) {\n"
+"			$FH{$key}[1] = ++$FHCLOCK;\n"
+"			return $FH{$key}[0];\n"
+"		}\n"
+"		delete $FH{$key};\n"
+"	}\n"
+"	$fh = new IO::File;\n"
+"	return undef if (not sysopen($fh, \"$ROOT$file\", $mode));\n"
+"	# other users may not share it, nor may other than regular files\n"
+"	return $fh if ($PRESERVE or not -f $fh);\n"
+"	if (keys(%FH) >= $FHMAX) {\n"
+"		foreach $k (keys(%FH)) {\n"
+"			$lru = $k if (not defined $lru or $FH{$k}[1] < $FH{$lru}[1]);\n"
+"		}\n"
+"		delete $FH{$lru};\n"
+"	}\n"
+"	$FH{$key} = [$fh, ++$FHCLOCK];\n"
+"	return $fh;\n"
+"}\n"
+"sub dropfh()\n"
+"{\n"
+"	my $file = $_[0];\n"
+"	my ($k, $path);\n"
+"	foreach $k (keys(%FH)) {\n"
+"		$path = substr($k, index($k, \" \") + 1);\n"
+"		delete $FH{$k} if ($path eq $file or index($path, \"$file/\") == 0);\n"
+"	}\n"
+"}\n"
 "sub s_lsdir()\n"
 "{\n"
 "	my $args = $_[0];\n"
@@ -42,7 +118,7 @@
 "		print($ENOENT);\n"
 "		return;\n"
 "	}\n"
-"	if (system(\"ls\", \"-lan$STABLE\", \"$ROOT$dir\") != 0) {\n"
+"	if (&run(\"ls\", \"-lan$STABLE\", \"$ROOT$dir\") != 0) {\n"
 "		print($EPERM);\n"
 "		return;\n"
 "	}\n"
@@ -57,10 +133,117 @@
 "		print($ENOENT);\n"
 "		return;\n"
 "	}\n"
-"	if (system(\"ls\", \"-land$STABLE\", \"$ROOT$dir\") != 0) {\n"
+"	if (&run(\"ls\", \"-land$STABLE\", \"$ROOT$dir\") != 0) {\n"
+"		print($EPERM);\n"
+"		return;\n"
+"	}\n"
+"	print($COMPLETE);\n"
+"}\n"
+"sub plus()\n"
+"{\n"
+"	my ($path, $name) = @_;\n"
+"	my (@st, $m, $type, $link);\n"
+"	return \"\" if ($name =~ /\\n/);\n"
+"	@st = ($HIRES ? Time::HiRes::stat($path) : stat($path)) if ($STABLE);\n"
+"	@st = ($HIRES ? Time::HiRes::lstat($path) : lstat($path)) if (not @st);\n"
+"	return \"\" if (not @st);\n"
+"	$m = $st[2] & 0170000;\n"
+"	$type = $m == 0040000 ? \"d\" : $m == 0120000 ? \"l\" :\n"
+"		$m == 0020000 ? \"c\" : $m == 0060000 ? \"b\" :\n"
+"		$m == 0010000 ? \"p\" : $m == 0140000 ? \"s\" : \"f\";\n"
+"	$link = \"\";\n"
+"	if ($type eq \"l\") {\n"
+"		$link = readlink($path);\n"
+"		$link = defined $link ? \"/$link\" : \"\";\n"
+"	}\n"
+"	return sprintf(\"%s %s%o %s %s %s %s %s %u %u %.9f %.9f %.9f %s%s\\n\",\n"
+"		$st[1], $type, $st[2] & 07777, $st[3], $st[4], $st[5], $st[7],\n"
+"		$st[12] || 0, ($st[6] >> 8) & 0xfff,\n"
+"		($st[6] & 0xff) | (($st[6] >> 12) & 0xfff00),\n"
+"		$st[8], $st[9], $st[10], $name, $link);\n"
+"}\n"
+"sub attrs()\n"
+"{\n"
+"	my $row;\n"
+"	return if (not $ATTRS);\n"
+"	$row = &plus(\"$ROOT$_[0]\", \".\");\n"
+"	&data($row) if ($row ne \"\");\n"
+"}\n"
+"sub s_lsplus()\n"
+"{\n"
+"	my $args = $_[0];\n"
+"	my $dir = $$args[0];\n"
+"	my ($name, $out);\n"
+"	if (not -d \"$ROOT$dir\") {\n"
+"		print($ENOENT);\n"
+"		return;\n"
+"	}\n"
+"	if (not opendir(DIR, \"$ROOT$dir\")) {\n"
 "		print($EPERM);\n"
 "		return;\n"
 "	}\n"
+"	$out = \"\";\n"
+"	while (defined($name = readdir(DIR))) {\n"
+"		next if ($name eq \".\" or $name eq \"..\");\n"
+"		$out .= &plus(\"$ROOT$dir/$name\", $name);\n"
+"	}\n"
+"	closedir(DIR);\n"
+"	&data($out);\n"
+"	print($COMPLETE);\n"
+"}\n"
+"sub s_statplus()\n"
+"{\n"
+"	my $args = $_[0];\n"
+"	my $file = $$args[0];\n"
+"	my $out;\n"
+"	$out = &plus(\"$ROOT$file\", \".\");\n"
+"	if ($out eq \"\") {\n"
+"		print($ENOENT);\n"
+"		return;\n"
+"	}\n"
+"	&data($out);\n"
+"	print($COMPLETE);\n"
+"}\n"
+"sub s_statv()\n"
+"{\n"
+"	my $args = $_[0];\n"
+"	my ($file, $row, $out);\n"
+"	$out = \"\";\n"
+"	foreach $file (@$args) {\n"
+"		$row = &plus(\"$ROOT$file\", \".\");\n"
+"		$out .= $row eq \"\" ? \"-\\n\" : $row;\n"
+"	}\n"
+"	&data($out);\n"
+"	print($COMPLETE);\n"
+"}\n"
+"sub s_lookup()\n"
+"{\n"
+"	my $args = $_[0];\n"
+"	my ($max, @files) = @$args;\n"
+"	my ($file, $row, $out, $fh, $size, $data, $o, $result);\n"
+"	$max = 65536 if ($max > 65536);\n"
+"	$out = \"\";\n"
+"	foreach $file (@files) {\n"
+"		$row = &plus(\"$ROOT$file\", \".\");\n"
+"		if ($row eq \"\") {\n"
+"			$out .= \"-\\n\";\n"
+"			next;\n"
+"		}\n"
+"		$out .= $row;\n"
+"		($size) = ($row =~ /^\\d+ f\\d+ \\d+ \\d+ \\d+ (\\d+) /);\n"
+"		next if (not $size or $size > $max);\n"
+"		next if (not ($fh = &getfh($file, O_RDONLY)));\n"
+"		sysseek($fh, 0, 0);\n"
+"		$data = \"\";\n"
+"		$o = 0;\n"
+"		$result = sysread($fh, $data, $size, 0);\n"
+"		while (defined $result and $result > 0 and $o + $result < $size) {\n"
+"			$o += $result;\n"
+"			$result = sysread($fh, $data, $size - $o, $o);\n"
+"		}\n"
+"		$out .= \":$size\\n$data\" if (length($data) == $size);\n"
+"	}\n"
+"	&data($out);\n"
 "	print($COMPLETE);\n"
 "}\n"
 "sub s_open()\n"
@@ -68,11 +251,12 @@
 "	my $args = $_[0];\n"
 "	my ($file, $mode) = ($$args[0], $$args[1]);\n"
 "	my $openmode = 0;\n"
-"	my ($data, $result);\n"
+"	my ($fh, $data, $result);\n"
 "	$openmode = O_RDONLY if ($mode eq \"R\");\n"
 "	$openmode = O_WRONLY if ($mode eq \"W\");\n"
 "	$openmode = O_RDWR if ($mode eq \"RW\");\n"
-"	if (not sysopen(FD, \"$ROOT$file\", $openmode)) {\n"
+"	$fh = &getfh($file, $openmode);\n"
+"	if (not $fh) {\n"
 "		if (-e \"$ROOT$file\") {\n"
 "			print($EPERM);\n"
 "		} else {\n"
@@ -80,24 +264,22 @@
 "		}\n"
 "		return;\n"
 "	}\n"
-"	if (-s \"$ROOT$file\") {\n"
+"	if (-s $fh) {\n"
 "		print($COMPLETE);\n"
-"		close FD;\n"
 "		return;\n"
 "	}\n"
-"	if (sysread(FD, $data, 1) == 1) {\n"
+"	if ($openmode != O_WRONLY and sysread($fh, $data, 1) == 1) {\n"
 "		print($NOTEMPTY);\n"
 "	} else {\n"
 "		print($COMPLETE);\n"
 "	}\n"
-"	close FD;\n"
 "}\n"
 "sub s_read()\n"
 "{\n"
 "	my $args = $_[0];\n"
 "	my ($file, $off, $size) = ($$args[0], $$args[1], $$args[2]);\n"
-"	my ($result, $data, $o, $s);\n"
-"	if (not sysopen(FD, \"$ROOT$file\", O_RDONLY)) {\n"
+"	my ($fh, $result, $data, $o, $s);\n"
+"	if (not ($fh = &getfh($file, O_RDONLY))) {\n"
 "		if (-e \"$ROOT$file\") {\n"
 "			print($EPERM);\n"
 "		} else {\n"
@@ -105,18 +287,17 @@
 "		}\n"
 "		return;\n"
 "	}\n"
-"	sysseek(FD, $off, 0);\n"
+"	sysseek($fh, $off, 0);\n"
 "	$o = 0; $s = $size;\n"
-"	$result = sysread(FD, $data, $size, 0);\n"
+"	$result = sysread($fh, $data, $size, 0);\n"
 "	while (defined $result and $result > 0) {\n"
 "		$o += $result; $s -= $result;\n"
-"		$result = sysread(FD, $data, $s, $o);\n"
+"		$result = sysread($fh, $data, $s, $o);\n"
 "	}\n"
-"	close FD;\n"
 "	if (defined $result) {\n"
 "select STDOUT; $| = 0;\n"
 "		print($PRELIM);\n"
-"		print(\"$data\".\"\\000\"x($size-$o));\n"
+"		&data(\"$data\".\"\\000\"x($size-$o));\n"
 "select STDOUT; $| = 1;\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
@@ -127,8 +308,8 @@
 "{\n"
 "	my $args = $_[0];\n"
 "	my ($file, $off, $size) = ($$args[0], $$args[1], $$args[2]);\n"
-"	my ($result, $data, $o, $s);\n"
-"	if (not sysopen(FD, \"$ROOT$file\", O_RDONLY)) {\n"
+"	my ($fh, $result, $data, $o, $s);\n"
+"	if (not ($fh = &getfh($file, O_RDONLY))) {\n"
 "		if (-e \"$ROOT$file\") {\n"
 "			print($EPERM);\n"
 "		} else {\n"
@@ -136,18 +317,18 @@
 "		}\n"
 "		return;\n"
 "	}\n"
-"	sysseek(FD, $off, 0);\n"
+"	sysseek($fh, $off, 0);\n"
 "	$o = 0; $s = $size;\n"
-"	$result = sysread(FD, $data, $size, 0);\n"
+"	$result = sysread($fh, $data, $size, 0);\n"
 "	while (defined $result and $result > 0) {\n"
 "		$o += $result; $s -= $result;\n"
-"		$result = sysread(FD, $data, $s, $o);\n"
+"		$result = sysread($fh, $data, $s, $o);\n"
 "	}\n"
-"	close FD;\n"
 "	if (defined $result) {\n"
 "		print($PRELIM);\n"
-"		print(\"$o\");\n"
-"		print(\"$data\");\n"
+"		# frame has the size already\n"
+"		print(\"$o\\n\") if (not $FTAG);\n"
+"		&data(\"$data\");\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($ERROR);\n"
@@ -157,8 +338,8 @@
 "{\n"
 "	my $args = $_[0];\n"
 "	my ($file, $off, $size) = ($$args[0], $$args[1], $$args[2]);\n"
-"	my ($result, $data, $o, $s);\n"
-"	if (not sysopen(FD, \"$ROOT$file\", O_WRONLY)) {\n"
+"	my ($fh, $result, $data, $o, $s);\n"
+"	if (not ($fh = &getfh($file, O_WRONLY))) {\n"
 "		if (-e \"$ROOT$file\") {\n"
 "			print($EPERM);\n"
 "		} else {\n"
@@ -166,28 +347,57 @@
 "		}\n"
 "		return;\n"
 "	}\n"
-"	sysseek(FD, $off, 0);\n"
+"	sysseek($fh, $off, 0);\n"
 "	print($PRELIM);\n"
-"	$o = 0; $s = $size;\n"
-"	$result = sysread(STDIN, $data, $size);\n"
-"	while (defined $result and $result > 0) {\n"
-"		$o += $result; $s -= $result;\n"
-"		$result = sysread(STDIN, $data, $s, $o);\n"
-"	}\n"
-"	if (not defined $result) {\n"
+"	$data = &getdata($size);\n"
+"	if (not defined $data) {\n"
 "		print($ERROR);\n"
-"		close FD;\n"
 "		return;\n"
 "	}\n"
-"	\n"
+"	&putdata($fh, $data, $size, $file);\n"
+"}\n"
+"sub s_dwrite()\n"
+"{\n"
+"	my $args = $_[0];\n"
+"	my ($file, $off, $size) = ($$args[0], $$args[1], $$args[2]);\n"
+"	my ($fh, $data);\n"
+"	$data = &getdata($size);\n"
+"	exit(0) if (not defined $data);\n"
+"	if (not ($fh = &getfh($file, O_WRONLY))) {\n"
+"		if (-e \"$ROOT$file\") {\n"
+"			print($EPERM);\n"
+"		} else {\n"
+"			print($ENOENT);\n"
+"		}\n"
+"		return;\n"
+"	}\n"
+"	sysseek($fh, $off, 0);\n"
+"	&putdata($fh, $data, $size, $file);\n"
+"}\n"
+"sub getdata()\n"
+"{\n"
+"	my $size = $_[0];\n"
+"	my ($result, $data, $o, $s);\n"
+"	$o = 0; $s = $size; $data = \"\";\n"
+"	while ($s > 0) {\n"
+"		$result = read(STDIN, $data, $s, $o);\n"
+"		return undef if (not $result);\n"
+"		$o += $result; $s -= $result;\n"
+"	}\n"
+"	return $data;\n"
+"}\n"
+"sub putdata()\n"
+"{\n"
+"	my ($fh, $data, $size, $file) = @_;\n"
+"	my ($result, $o, $s);\n"
 "	$o = 0; $s = $size;\n"
-"	$result = syswrite(FD, $data, $size, 0);\n"
+"	$result = syswrite($fh, $data, $size, 0);\n"
 "	while (defined $result and $result > 0 and $o+$result < $size) {\n"
 "		$o += $result; $s -= $result;\n"
-"		$result = syswrite(FD, $data, $s, $o);\n"
+"		$result = syswrite($fh, $data, $s, $o);\n"
 "	}\n"
-"	close FD;\n"
 "	if (defined $result) {\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($ERROR);\n"
@@ -198,6 +408,7 @@
 "	my $args = $_[0];\n"
 "	my $dir = $$args[0];\n"
 "	if (mkdir(\"$ROOT$dir\", 0777)) {\n"
+"		&attrs($dir);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -221,6 +432,8 @@
 "{\n"
 "	my $args = $_[0];\n"
 "	my ($file1, $file2) = ($$args[0], $$args[1]);\n"
+"	&dropfh($file1);\n"
+"	&dropfh($file2);\n"
 "	if (rename(\"$ROOT$file1\", \"$ROOT$file2\")) {\n"
 "		print($COMPLETE);\n"
 "	} elsif (-e \"$ROOT$file1\") {\n"
@@ -233,6 +446,7 @@
 "{\n"
 "	my $args = $_[0];\n"
 "	my $file = $$args[0];\n"
+"	&dropfh($file);\n"
 "	if (unlink(\"$ROOT$file\")) {\n"
 "		print($COMPLETE);\n"
 "	} elsif (-e \"$ROOT$file\") {\n"
@@ -246,8 +460,10 @@
 "	my $args = $_[0];\n"
 "	my ($file, $mode) = ($$args[0], $$args[1]);\n"
 "	\n"
+"	&dropfh($file);\n"
 "	if (sysopen(FD, \"$ROOT$file\", O_RDWR|O_TRUNC|O_CREAT, oct($mode))) {\n"
 "		close FD;\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -259,6 +475,7 @@
 "	my ($file1, $file2) = ($$args[0], $$args[1]);\n"
 "	\n"
 "	if (link(\"$file1\", \"$ROOT$file2\")) {\n"
+"		&attrs($file2);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -270,6 +487,7 @@
 "	my ($file1, $file2) = ($$args[0], $$args[1]);\n"
 "	\n"
 "	if (symlink(\"$file1\", \"$ROOT$file2\")) {\n"
+"		&attrs($file2);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -281,7 +499,7 @@
 "	my $file = $$args[0];\n"
 "	my $result;\n"
 "	if ($result = readlink(\"$ROOT$file\")) {\n"
-"		print(\"$result\\n\");\n"
+"		&data(\"$result\\n\");\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -293,6 +511,7 @@
 "	my ($file, $mode) = ($$args[0], $$args[1]);\n"
 "	\n"
 "	if (chmod(oct($mode), \"$ROOT$file\")) {\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -304,6 +523,7 @@
 "	my ($file, $user) = ($$args[0], $$args[1]);\n"
 "	\n"
 "	if (chown($user, -1, \"$ROOT$file\")) {\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -315,6 +535,7 @@
 "	my ($file, $group) = ($$args[0], $$args[1]);\n"
 "	\n"
 "	if (chown(-1, $group, \"$ROOT$file\")) {\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -324,7 +545,9 @@
 "{\n"
 "	my $args = $_[0];\n"
 "	my ($file, $size) = ($$args[0], $$args[1]);\n"
+"	&dropfh($file);\n"
 "	if (truncate(\"$ROOT$file\", $size)) {\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -344,6 +567,7 @@
 "		$atime = $attr[8] if ($type eq \"m\");\n"
 "	}\n"
 "	if (utime($atime, $mtime, \"$ROOT$file\")) {\n"
+"		&attrs($file);\n"
 "		print($COMPLETE);\n"
 "	} else {\n"
 "		print($EPERM);\n"
@@ -363,7 +587,7 @@
 "		@list = split(/ +/, $last);\n"
 "		$result = \"$list[1] $list[2] $list[3]\";\n"
 "	}\n"
-"	print(\"$result\\n\");\n"
+"	&data(\"$result\\n\");\n"
 "	print($COMPLETE);\n"
 "}\n"
 "sub s_ping()\n"
@@ -372,9 +596,36 @@
 "	my $seq = $$args[0];\n"
 "	\n"
 "	print($PRELIM);\n"
-"	print $seq.\"\\n\";\n"
+"	&data($seq.\"\\n\");\n"
 "	print($NOP);\n"
 "}\n"
+"my %SEQ = (\"s_mkdir\" => \\&s_mkdir, \"s_rmdir\" => \\&s_rmdir, \"s_mv\" => \\&s_mv,\n"
+"	\"s_rm\" => \\&s_rm, \"s_creat\" => \\&s_creat, \"s_ln\" => \\&s_ln,\n"
+"	\"s_sln\" => \\&s_sln, \"s_chmod\" => \\&s_chmod, \"s_chown\" => \\&s_chown,\n"
+"	\"s_chgrp\" => \\&s_chgrp, \"s_trunc\" => \\&s_trunc, \"s_settime\" => \\&s_settime);\n"
+"sub s_seq()\n"
+"{\n"
+"	my $args = $_[0];\n"
+"	my (@step, $cmd, $out, $fh, $status);\n"
+"	while (@$args) {\n"
+"		@step = ();\n"
+"		push(@step, shift @$args) while (@$args and $$args[0] ne \";\");\n"
+"		shift @$args;\n"
+"		$cmd = shift @step;\n"
+"		$out = \"\";\n"
+"		if (defined $cmd and $SEQ{$cmd} and open($fh, \">\", \\$out)) {\n"
+"			select($fh);\n"
+"			&{$SEQ{$cmd}}(\\@step);\n"
+"			select(STDOUT);\n"
+"			close($fh);\n"
+"		}\n"
+"		$status = $out =~ s/#+ ?(\\d{3})[^\\n]*\\n\\z// ? $1 : 500;\n"
+"		print($out);\n"
+"		&data(\"=$status\\n\");\n"
+"		last if ($status >= 300);\n"
+"	}\n"
+"	print($COMPLETE);\n"
+"}\n"
 "sub getline()\n"
 "{\n"
 "	my @args;\n"
@@ -420,6 +671,13 @@
 "	my ($cmd, $uid, $groups);\n"
 "	next if (not @args);\n"
 "	$cmd = shift @args;\n"
+"	if ($cmd eq \"s_tag\") {\n"
+"		print(\"$TAG \".(shift @args).\"\\n\");\n"
+"		$cmd = shift @args;\n"
+"	} elsif ($cmd eq \"s_frame\") {\n"
+"		&s_frame(shift @args);\n"
+"		$cmd = shift @args;\n"
+"	}\n"
 "	if ($PRESERVE) {\n"
 "		$uid = shift @args;\n"
 "		$groups = shift @args;\n"
@@ -440,6 +698,14 @@
 "		&s_lsdir(\\@args);\n"
 "	} elsif ($cmd eq \"s_stat\") {\n"
 "		&s_stat(\\@args);\n"
+"	} elsif ($cmd eq \"s_lsplus\") {\n"
+"		&s_lsplus(\\@args);\n"
+"	} elsif ($cmd eq \"s_statplus\") {\n"
+"		&s_statplus(\\@args);\n"
+"	} elsif ($cmd eq \"s_statv\") {\n"
+"		&s_statv(\\@args);\n"
+"	} elsif ($cmd eq \"s_lookup\") {\n"
+"		&s_lookup(\\@args);\n"
 "	} elsif ($cmd eq \"s_open\") {\n"
 "		&s_open(\\@args);\n"
 "	} elsif ($cmd eq \"s_read\") {\n"
@@ -448,6 +714,8 @@
 "		&s_sread(\\@args);\n"
 "	} elsif ($cmd eq \"s_write\") {\n"
 "		&s_write(\\@args);\n"
+"	} elsif ($cmd eq \"s_dwrite\") {\n"
+"		&s_dwrite(\\@args);\n"
 "	} elsif ($cmd eq \"s_mkdir\") {\n"
 "		&s_mkdir(\\@args);\n"
 "	} elsif ($cmd eq \"s_rmdir\") {\n"
@@ -478,6 +746,8 @@
 "		&s_statfs(\\@args);\n"
 "	} elsif ($cmd eq \"s_ping\") {\n"
 "		&s_ping(\\@args);\n"
+"	} elsif ($cmd eq \"s_seq\") {\n"
+"		&s_seq(\\@args);\n"
 "	} else {\n"
 "		print($ERROR);\n"
 "	}\n"
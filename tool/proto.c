@@ -23,11 +23,13 @@
 #include <errno.h>
 
 #include "shfsmount.h"
+#include "proto.h"
 
 struct proto {
 	char *id;
 	const char *test;
 	char *code;
+	int caps;
 };
 
 static char perl_test[] =
@@ -48,10 +50,25 @@ static char shell_code[] =
 #include "shell-code.h"
 "\n";
 
+/* shfsd.c is built on the remote side by the test, if need be */
+static char shfsd_test[] =
+"mkdir -p \"${HOME:-/tmp}/.shfs\" 2>/dev/null; "
+"cat >\"${HOME:-/tmp}/.shfs/shfsd-$$.c\" <<'SHFSD_EOF'\n"
+#include "shfsd-code.h"
+"SHFSD_EOF\n"
+#include "shfsd-test.h"
+"\n";
+
+static char shfsd_code[] =
+"exec \"$s_SHFSD\"\n";
+
 struct proto sh[] = {
-	{ "perl", perl_test, perl_code },
-	{ "shell", shell_test, shell_code },
-	{ NULL, NULL, NULL },
+	{ "shfsd", shfsd_test, shfsd_code, PROTO_WDATA|PROTO_FRAME|PROTO_PLUS|PROTO_STATV|PROTO_ATTRS|PROTO_SEQ|PROTO_LOOKUP|PROTO_RANGE },
+	{ "perl", perl_test, perl_code, PROTO_WDATA|PROTO_FRAME|PROTO_PLUS|PROTO_STATV|PROTO_ATTRS|PROTO_SEQ|PROTO_LOOKUP|PROTO_RANGE },
+	/* sh reads ahead, data cannot follow the command line; the test
+	   says "plus statv attrs" if there is GNU find */
+	{ "shell", shell_test, shell_code, PROTO_FRAME },
+	{ NULL, NULL, NULL, 0 },
 };
 
 static ssize_t
@@ -98,16 +115,17 @@ writeall(int fd, const void *data, size_t n)
 
 int
 init_sh(int fd, const char *desired, const char *root, 
-	int stable, int preserve)
+	int stable, int preserve, int *caps)
 {
 	char buffer[BUFFER_MAX];
 	struct proto *proto;
-	int rd;
+	int rd, rcaps = 0;
 
 	for (proto = sh; proto->id; proto++) {
 		char *r, *s = buffer;
 		int rok = 0, rstable = 0, rpreserve = 0;
 
+		rcaps = 0;
 		if (desired && strcmp(proto->id, desired))
 			continue;
 
@@ -134,6 +152,12 @@ init_sh(int fd, const char *desired, const char *root,
 				rstable = 1;
 			else if (!strcmp(r, "preserve"))
 				rpreserve = 1;
+			else if (!strcmp(r, "plus"))
+				rcaps |= PROTO_PLUS;
+			else if (!strcmp(r, "statv"))
+				rcaps |= PROTO_STATV;
+			else if (!strcmp(r, "attrs"))
+				rcaps |= PROTO_ATTRS;
 			else if (strcmp(r, "failed"))
 				fprintf(stderr, "Warning: unknown capability (%s): %s\n", proto->id, r);
 		}
@@ -167,10 +191,12 @@ init_sh(int fd, const char *desired, const char *root,
 	DEBUG("reply: %s", buffer);
 	if (strcmp(buffer, "### 200\n"))
 		return 0;
-	snprintf(buffer, sizeof(buffer), "s_init '%s'%s%s\n", 
+	rcaps |= proto->caps;
+	snprintf(buffer, sizeof(buffer), "s_init '%s'%s%s%s\n", 
 		 root ? root : "",
 		 stable ? " stable" : "",
-		 preserve ? " preserve" : "");
+		 preserve ? " preserve" : "",
+		 rcaps & PROTO_ATTRS ? " attrs" : "");
 	writeall(fd, buffer, strlen(buffer));
 	rd = readln(fd, &buffer, sizeof(buffer)-1);
 	if (rd < 0) {
@@ -182,5 +208,70 @@ init_sh(int fd, const char *desired, const char *root,
 	if (strcmp(buffer, "### 200\n"))
 		return 0;
 
+	*caps = rcaps;
+	return 1;
+}
+
+static ssize_t
+readall(int fd, void *data, size_t n)
+{
+	size_t rd, result;
+
+	rd = 0;
+	while (n > rd) {
+		result = read(fd, data + rd, n - rd);
+		if (result == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return rd;
+		}
+		if (result == 0)
+			return rd;
+		rd += result;
+	}
+	return rd;
+}
+
+static unsigned int
+get_u32(const unsigned char *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* SSH_FXP_INIT, version 3 */
+int
+init_sftp(int fd)
+{
+	static const unsigned char init[] = { 0, 0, 0, 5, 1, 0, 0, 0, 3 };
+	unsigned char buffer[BUFFER_MAX], *p;
+	unsigned int len, n, i;
+
+	VERBOSE("Testing sftp... ");
+	if (writeall(fd, init, sizeof(init)) != sizeof(init))
+		return 0;
+	if (readall(fd, buffer, 4) != 4)
+		return 0;
+	len = get_u32(buffer);
+	if (len < 5 || len > sizeof(buffer)) {
+		VERBOSE("invalid reply\n");
+		return 0;
+	}
+	if (readall(fd, buffer, len) != len)
+		return 0;
+	/* SSH_FXP_VERSION */
+	if (buffer[0] != 2 || get_u32(buffer + 1) < 3) {
+		VERBOSE("unsupported version\n");
+		return 0;
+	}
+	VERBOSE("version %u\n", get_u32(buffer + 1));
+
+	/* extension name/data pairs, the kernel probes what it needs */
+	for (p = buffer + 5, i = 0; p + 4 <= buffer + len; p += n, i++) {
+		n = get_u32(p);
+		p += 4;
+		if (n > buffer + len - p)
+			break;
+		DEBUG("%s %.*s\n", i & 1 ? "  data:" : "extension:", (int)n, p);
+	}
 	return 1;
 }
@@ -1,7 +1,18 @@
 #ifndef _PROTO_H_
 #define _PROTO_H_
 
+/* protocol extensions implemented by the remote code */
+#define PROTO_WDATA	1	/* s_dwrite: write data without PRELIM */
+#define PROTO_FRAME	2	/* s_frame: length prefixed replies */
+#define PROTO_PLUS	4	/* s_lsplus/s_statplus: stat records */
+#define PROTO_STATV	8	/* s_statv: s_statplus of many files */
+#define PROTO_ATTRS	16	/* s_init attrs: changes reply s_statplus row */
+#define PROTO_SEQ	32	/* s_seq: changes in one request */
+#define PROTO_LOOKUP	64	/* s_lookup: s_statv with small files inlined */
+#define PROTO_RANGE	128	/* s_read: any offset and size in one pass */
+
 extern int init_sh(int fd, const char *desired, const char *root,
-		   int stable, int preserve);
+		   int stable, int preserve, int *caps);
+extern int init_sftp(int fd);
 
 #endif
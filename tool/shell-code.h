@@ -8,9 +8,16 @@
 "		s_ROOT=\"$1\";\n"
 "	fi\n"
 "	shift\n"
-"	if test \"$1\" = \"stable\"; then\n"
-"		s_STABLE=\"$L\";\n"
-"	fi\n"
+"	s_FIND=\"\";\n"
+"	s_ATTRS=\"\";\n"
+"	for s_o; do\n"
+"		if test \"$s_o\" = \"stable\"; then\n"
+"			s_STABLE=\"$L\";\n"
+"			s_FIND=\"-L\";\n"
+"		elif test \"$s_o\" = \"attrs\"; then\n"
+"			s_ATTRS=1;\n"
+"		fi\n"
+"	done\n"
 "	\n"
 "	s_TMP=\"\";\n"
 "	i=0;\n"
@@ -40,7 +47,7 @@
 "	echo $s_COMPLETE;\n"
 "}\n"
 "s_lsdir () {\n"
-"	if ls -lan$s_STABLE \"$s_ROOT$1\" 2>/dev/null; then\n"
+"	if s_data ls -lan$s_STABLE \"$s_ROOT$1\" 2>/dev/null; then\n"
 "		echo $s_COMPLETE;\n"
 "	elif test -d \"$s_ROOT$1\"; then\n"
 "		if ls \"$s_ROOT$1\" >/dev/null 2>&1; then\n"
@@ -55,12 +62,45 @@
 "s_stat () {\n"
 "	if test -z \"`ls -1d \"$s_ROOT$1\" 2>/dev/null`\"; then\n"
 "		echo $s_ENOENT;\n"
-"	elif ls -land$s_STABLE \"$s_ROOT$1\" 2>/dev/null; then\n"
+"	elif s_data ls -land$s_STABLE \"$s_ROOT$1\" 2>/dev/null; then\n"
+"		echo $s_COMPLETE;\n"
+"	else\n"
+"		echo $s_EPERM;\n"
+"	fi;\n"
+"}\n"
+"s_PLUS=\"%i %y%m %n %U %G %s %b 0 0 %A@ %T@ %C@ %f/%l\\n\";\n"
+"s_attrs () {\n"
+"	if test \"$s_ATTRS\"; then\n"
+"		s_data find $s_FIND \"$s_ROOT$1\" -maxdepth 0 -printf \"$s_PLUS\" 2>/dev/null;\n"
+"	fi\n"
+"}\n"
+"s_lsplus () {\n"
+"	if test ! -d \"$s_ROOT$1\"; then\n"
+"		echo $s_ENOENT;\n"
+"	elif s_data find $s_FIND \"$s_ROOT$1\" -mindepth 1 -maxdepth 1 -printf \"$s_PLUS\" 2>/dev/null; then\n"
+"		echo $s_COMPLETE;\n"
+"	else\n"
+"		echo $s_EPERM;\n"
+"	fi;\n"
+"}\n"
+"s_statplus () {\n"
+"	if test -z \"`ls -1d \"$s_ROOT$1\" 2>/dev/null`\"; then\n"
+"		echo $s_ENOENT;\n"
+"	elif s_data find $s_FIND \"$s_ROOT$1\" -maxdepth 0 -printf \"$s_PLUS\" 2>/dev/null; then\n"
 "		echo $s_COMPLETE;\n"
 "	else\n"
 "		echo $s_EPERM;\n"
 "	fi;\n"
 "}\n"
+"s_statv () {\n"
+"	s_data s_statv1 \"$@\";\n"
+"	echo $s_COMPLETE;\n"
+"}\n"
+"s_statv1 () {\n"
+"	for s_f; do\n"
+"		find $s_FIND \"$s_ROOT$s_f\" -maxdepth 0 -printf \"$s_PLUS\" 2>/dev/null || echo \"-\";\n"
+"	done;\n"
+"}\n"
 "s_open () {\n"
 "	ok=0;\n"
 "	if test x$2 = xR -o x$2 = xRW; then\n"
@@ -96,14 +136,20 @@
 "		else\n"
 "			echo $s_EPERM;\n"
 "		fi\n"
+"		return;\n"
 "	fi\n"
 "	echo $s_PRELIM;\n"
-"	( dd if=\"$s_ROOT$1\" bs=$4 skip=$5 count=$6 conv=sync 2>&1 1>&3 | grep \"$6+0\" >/dev/null || dd if=/dev/zero bs=$4 count=$6 conv=sync 2>&1 1>&3 | grep \"$6+0\" >/dev/null ) 3>&1;\n"
+"	s_size $(($4 * $6));\n"
+"	{ s_n=$(dd if=\"$s_ROOT$1\" bs=$4 skip=$5 count=$6 conv=sync 2>&1 1>&4 | sed -n \"s/^\\([0-9]*\\)+\\([0-9]*\\) records in.*/\\1+\\2/p\"); } 4>&1;\n"
+"	s_n=$(($6 - (${s_n:-0})));\n"
+"	if test $s_n -gt 0; then\n"
+"		dd if=/dev/zero bs=$4 count=$s_n 2>/dev/null;\n"
+"	fi\n"
 "	echo $s_COMPLETE;\n"
 "}\n"
 "s_sread () {\n"
 "	if test -z \"$s_TMP\"; then\n"
-"		return $s_EPERM;\n"
+"		echo $s_EPERM;\n"
 "	elif test \"$3\" = 0; then\n"
 "		if test -r \"$s_ROOT$1\"; then\n"
 "			echo $s_PRELIM; echo $s_COMPLETE;\n"
@@ -113,7 +159,11 @@
 "	elif >\"$s_TMP._shfs_$$_$7\" 2>/dev/null; then\n"
 "		if x=`dd if=\"$s_ROOT$1\" bs=$4 skip=$5 count=$6 2>/dev/null|tee \"$s_TMP._shfs_$$_$7\"|wc -c`; then\n"
 "			echo $s_PRELIM;\n"
-"			echo $x;\n"
+"			if test \"$s_FTAG\"; then\n"
+"				s_size $x;\n"
+"			else\n"
+"				echo $x;\n"
+"			fi\n"
 "			cat \"$s_TMP._shfs_$$_$7\" 2>/dev/null;\n"
 "			echo $s_COMPLETE;\n"
 "		elif test -f \"$s_ROOT$1\"; then\n"
@@ -137,6 +187,7 @@
 "		fi\n"
 "		if test $result -eq 0; then\n"
 "			if dd if=\"$s_TMP._shfs_$$_$6\" of=\"$s_ROOT$1\" bs=$4 seek=$5 conv=notrunc 2>/dev/null; then\n"
+"				s_attrs \"$1\";\n"
 "				echo $s_COMPLETE;\n"
 "			elif test -w \"$s_ROOT$1\"; then\n"
 "				echo $s_ENOSPC;\n"
@@ -152,6 +203,7 @@
 "		if test \"$3\" = 0; then\n"
 "			echo $s_COMPLETE;\n"
 "		elif dd of=\"$s_ROOT$1\" bs=1 seek=$2 count=$3 conv=notrunc 2>/dev/null; then\n"
+"			s_attrs \"$1\";\n"
 "			echo $s_COMPLETE;\n"
 "		else\n"
 "			echo $s_ENOSPC; dd of=/dev/null bs=1 count=$3 2>/dev/null;\n"
@@ -160,6 +212,7 @@
 "}\n"
 "s_mkdir () {\n"
 "	if mkdir \"$s_ROOT$1\" 2>/dev/null; then\n"
+"		s_attrs \"$1\";\n"
 "		echo $s_COMPLETE;\n"
 "	else\n"
 "		echo $s_EPERM;\n"
@@ -173,7 +226,7 @@
 "			echo $s_EPERM;\n"
 "		fi\n"
 "	else\n"
-"		echo $_ENOENT;\n"
+"		echo $s_ENOENT;\n"
 "	fi\n"
 "}\n"
 "s_mv () {\n"
@@ -196,6 +249,7 @@
 "}\n"
 "s_creat () {\n"
 "	if ( >\"$s_ROOT$1\"; chmod $2 \"$s_ROOT$1\" ) 2>/dev/null; then\n"
+"		s_attrs \"$1\";\n"
 "		echo $s_COMPLETE;\n"
 "	else\n"
 "		echo $s_EPERM;\n"
@@ -203,6 +257,7 @@
 "}\n"
 "s_ln () {\n"
 "	if ln -f \"$s_ROOT$1\" \"$s_ROOT$2\" 2>/dev/null; then\n"
+"		s_attrs \"$2\";\n"
 "		echo $s_COMPLETE;\n"
 "	else\n"
 "		echo $s_EPERM;\n"
@@ -210,6 +265,7 @@
 "}\n"
 "s_sln () {\n"
 "	if ln -s -f \"$1\" \"$s_ROOT$2\" 2>/dev/null; then\n"
+"		s_attrs \"$2\";\n"
 "		echo $s_COMPLETE;\n"
 "	else\n"
 "		echo $s_EPERM;\n"
@@ -217,13 +273,13 @@
 "}\n"
 "s_readlink () {\n"
 "	if test \"$s_READLINK\"; then\n"
-"		if readlink \"$s_ROOT$1\" 2>/dev/null; then\n"
+"		if s_data readlink \"$s_ROOT$1\" 2>/dev/null; then\n"
 "			echo $s_COMPLETE;\n"
 "		else\n"
 "			echo $s_EPERM;\n"
 "		fi\n"
 "	else\n"
-"		if ls -ld \"$s_ROOT$1\" 2>/dev/null|sed \"s/.*-> \\(.*\\)/\\1/\" 2>/dev/null; then\n"
+"		if s_data s_lslink \"$s_ROOT$1\"; then\n"
 "			echo $s_COMPLETE;\n"
 "		else\n"
 "			echo $s_EPERM;\n"
@@ -232,6 +288,7 @@
 "}\n"
 "s_chmod () {\n"
 "	if chmod $2 \"$s_ROOT$1\" 2>/dev/null; then\n"
+"		s_attrs \"$1\";\n"
 "		echo $s_COMPLETE;\n"
 "	elif test -f \"$s_ROOT$1\"; then\n"
 "		echo $s_EPERM;\n"
@@ -241,6 +298,7 @@
 "}\n"
 "s_chown () {\n"
 "	if chown $2 \"$s_ROOT$1\" 2>/dev/null; then\n"
+"		s_attrs \"$1\";\n"
 "		echo $s_COMPLETE;\n"
 "	elif test -f \"$s_ROOT$1\"; then\n"
 "		echo $s_EPERM;\n"
@@ -250,6 +308,7 @@
 "}\n"
 "s_chgrp () {\n"
 "	if chgrp $2 \"$s_ROOT$1\" 2>/dev/null; then\n"
+"		s_attrs \"$1\";\n"
 "		echo $s_COMPLETE;\n"
 "	elif test -f \"$s_ROOT$1\"; then\n"
 "		echo $s_EPERM;\n"
@@ -260,6 +319,7 @@
 "s_trunc () {\n"
 "	if test \"$3\" = 0; then\n"
 "		if ( >\"$s_ROOT$1\" ) 2>/dev/null; then\n"
+"			s_attrs \"$1\";\n"
 "			echo $s_COMPLETE;\n"
 "		elif test -f \"$s_ROOT$1\"; then\n"
 "			echo $s_EPERM;\n"
@@ -267,6 +327,7 @@
 "			echo $s_ENOENT;\n"
 "		fi\n"
 "	elif dd if=/dev/zero of=\"$s_ROOT$1\" bs=$2 seek=$3 count=0 2>/dev/null; then\n"
+"		s_attrs \"$1\";\n"
 "		echo $s_COMPLETE;\n"
 "	elif test -f \"$s_ROOT$1\"; then\n"
 "		echo $s_EPERM;\n"
@@ -277,6 +338,7 @@
 "s_settime () {\n"
 "	if test -e \"$s_ROOT$1\"; then\n"
 "		if TZ=UTC touch -$2 -t $3 \"$s_ROOT$1\" 2>/dev/null; then\n"
+"			s_attrs \"$1\";\n"
 "			echo $s_COMPLETE;\n"
 "		else\n"
 "			echo $s_EPERM;\n"
@@ -285,7 +347,10 @@
 "		echo $s_ENOENT;\n"
 "	fi\n"
 "}\n"
-"s_statfs () {\n"
+"s_lslink () {\n"
+"	ls -ld \"$1\" 2>/dev/null|sed \"s/.*-> \\(.*\\)/\\1/\" 2>/dev/null;\n"
+"}\n"
+"s_df () {\n"
 "	LC_ALL=POSIX df -k \"$s_ROOT\" 2>/dev/null | (\n"
 "		xa=0; xb=0; xc=0;\n"
 "		while read x a b c z; do\n"
@@ -293,14 +358,55 @@
 "		done;\n"
 "		echo $xa $xb $xc\n"
 "	);\n"
+"}\n"
+"s_statfs () {\n"
+"	s_data s_df;\n"
 "	echo $s_COMPLETE;\n"
 "}\n"
+"s_tag () {\n"
+"	echo \"$s_TAG $1\";\n"
+"	shift;\n"
+"	\"$@\";\n"
+"}\n"
+"s_frame () {\n"
+"	s_FTAG=$1;\n"
+"	s_PRELIM=\"#100 $1 00000000\";\n"
+"	s_COMPLETE=\"#200 $1 00000000\";\n"
+"	s_NOP=\"#201 $1 00000000\";\n"
+"	s_NOTEMPTY=\"#202 $1 00000000\";\n"
+"	s_CONTINUE=\"#300 $1 00000000\";\n"
+"	s_TRANSIENT=\"#400 $1 00000000\";\n"
+"	s_ERROR=\"#500 $1 00000000\";\n"
+"	s_EPERM=\"#501 $1 00000000\";\n"
+"	s_ENOSPC=\"#502 $1 00000000\";\n"
+"	s_ENOENT=\"#503 $1 00000000\";\n"
+"	shift;\n"
+"	\"$@\";\n"
+"}\n"
+"s_size () {\n"
+"	if test \"$s_FTAG\"; then\n"
+"		printf \"#000 %s %08x\\n\" $s_FTAG $1;\n"
+"	fi\n"
+"}\n"
+"s_data () {\n"
+"	if test -z \"$s_FTAG\"; then\n"
+"		\"$@\";\n"
+"		return;\n"
+"	fi\n"
+"	s_x=`\"$@\"; echo \".$?\"`;\n"
+"	s_r=${s_x##*.};\n"
+"	s_x=${s_x%.*};\n"
+"	s_size ${#s_x};\n"
+"	printf \"%s\" \"$s_x\";\n"
+"	return $s_r;\n"
+"}\n"
 "s_ping () {\n"
 "	echo $s_PRELIM;\n"
-"	echo $1;\n"
+"	s_data echo $1;\n"
 "	echo $s_NOP;\n"
 "}\n"
 "s_PRELIM=\"### 100\";\n"
+"s_TAG=\"### 110\";\n"
 "s_COMPLETE=\"### 200\";\n"
 "s_NOP=\"### 201\";\n"
 "s_NOTEMPTY=\"### 202\";\n"
@@ -310,4 +416,5 @@
 "s_EPERM=\"### 501\";\n"
 "s_ENOSPC=\"### 502\";\n"
 "s_ENOENT=\"### 503\";\n"
+"s_FTAG=\"\";\n"
 "echo $s_COMPLETE;\n"
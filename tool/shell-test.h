@@ -2,8 +2,12 @@
 "for cmd in echo chgrp chmod chown cut dd df expr ln ls mkdir mv rm read rmdir tee test touch wc; do\n"
 "	type $cmd >/dev/null 2>&1 || posix=0;\n"
 "done;\n"
+"plus=\"\";\n"
+"if find / -maxdepth 0 -printf \"\" >/dev/null 2>&1; then\n"
+"	plus=\" plus statv attrs\";\n"
+"fi;\n"
 "if test $posix = 1; then\n"
-"	echo \"ok stable\";\n"
+"	echo \"ok stable$plus\";\n"
 "else\n"
 "	echo failed;\n"
 "fi;\n"
@@ -0,0 +1,1211 @@
+"/*\n"
+" *  This file is part of SHell File System.\n"
+" *  See http://shfs.sourceforge.net/ for more info.\n"
+" *\n"
+" *  Native remote server, speaks the protocol of perl-code.in without\n"
+" *  forking a process per request.  shfsmount sends this file to the\n"
+" *  remote shell and builds it there (see shfsd-test.in), unless a\n"
+" *  matching binary is already installed.  It has to stay a single,\n"
+" *  plain POSIX source file.\n"
+" *\n"
+" *  This program is free software; you can redistribute it and/or modify\n"
+" *  it under the terms of the GNU General Public License as published by\n"
+" *  the Free Software Foundation; either version 2 of the License, or\n"
+" *  (at your option) any later version.\n"
+" *\n"
+" *  This program is distributed in the hope that it will be useful,\n"
+" *  but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
+" *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the\n"
+" *  GNU General Public License for more details.\n"
+" */\n"
+"\n"
+"#define _GNU_SOURCE\n"
+"#define _FILE_OFFSET_BITS 64\n"
+"\n"
+"#include <stdlib.h>\n"
+"#include <string.h>\n"
+"#include <stdio.h>\n"
+"#include <stdarg.h>\n"
+"#include <errno.h>\n"
+"#include <unistd.h>\n"
+"#include <fcntl.h>\n"
+"#include <dirent.h>\n"
+"#include <grp.h>\n"
+"#include <time.h>\n"
+"#include <sys/types.h>\n"
+"#include <sys/stat.h>\n"
+"#include <sys/statvfs.h>\n"
+"#ifdef __linux__\n"
+"#include <sys/sysmacros.h>\n"
+"#endif\n"
+"\n"
+"#ifdef __APPLE__\n"
+"#define st_atim st_atimespec\n"
+"#define st_mtim st_mtimespec\n"
+"#define st_ctim st_ctimespec\n"
+"#endif\n"
+"\n"
+"#ifndef SHFSD_ID\n"
+"#define SHFSD_ID \"unknown\"\n"
+"#endif\n"
+"\n"
+"#define LINE_MAX_	8192\n"
+"#define INLINE_MAX	65536\n"
+"#define ARGS_MAX	64\n"
+"#define FD_CACHE	8\n"
+"\n"
+"#define PRELIM		100\n"
+"#define TAG		110\n"
+"#define COMPLETE	200\n"
+"#define NOP		201\n"
+"#define NOTEMPTY	202\n"
+"#define ERROR		500\n"
+"#define EPERM_		501\n"
+"#define ENOSPC_		502\n"
+"#define ENOENT_		503\n"
+"\n"
+"/* directory all paths are relative to */\n"
+"static int root = -1;\n"
+"static int stable = 0;\n"
+"static int preserve = 0;\n"
+"static int attrs = 0;\n"
+"\n"
+"/* frame tag of the current request, NULL for plain replies */\n"
+"static char *ftag = NULL;\n"
+"\n"
+"/* in s_seq: status of the last step, see reply() */\n"
+"static int seq = 0;\n"
+"static int seq_status;\n"
+"\n"
+"struct command {\n"
+"	const char *name;\n"
+"	int args;\n"
+"	void (*fn)(char **args, int n);\n"
+"	int seq;			/* may be a step of s_seq */\n"
+"};\n"
+"\n"
+"static struct command *find_command(const char *name);\n"
+"\n"
+"static char ibuf[65536];\n"
+"static size_t ipos = 0, ilen = 0;\n"
+"\n"
+"static char obuf[65536];\n"
+"static size_t olen = 0;\n"
+"\n"
+"/* read/list buffer, grows as needed */\n"
+"static char *dbuf = NULL;\n"
+"static size_t dsize = 0;\n"
+"\n"
+"/* open files, looked up by path and checked by inode on every use */\n"
+"struct fd_entry {\n"
+"	char *path;\n"
+"	int flags;\n"
+"	int fd;\n"
+"	dev_t dev;\n"
+"	ino_t ino;\n"
+"	unsigned long used;\n"
+"};\n"
+"\n"
+"static struct fd_entry fd_cache[FD_CACHE];\n"
+"static unsigned long fd_clock = 0;\n"
+"\n"
+"static void\n"
+"writeall(const char *data, size_t n)\n"
+"{\n"
+"	ssize_t res;\n"
+"\n"
+"	while (n) {\n"
+"		res = write(STDOUT_FILENO, data, n);\n"
+"		if (res < 0) {\n"
+"			if (errno == EINTR || errno == EAGAIN)\n"
+"				continue;\n"
+"			exit(1);\n"
+"		}\n"
+"		data += res;\n"
+"		n -= res;\n"
+"	}\n"
+"}\n"
+"\n"
+"static void\n"
+"flush(void)\n"
+"{\n"
+"	writeall(obuf, olen);\n"
+"	olen = 0;\n"
+"}\n"
+"\n"
+"static void\n"
+"out(const char *data, size_t n)\n"
+"{\n"
+"	if (olen + n > sizeof(obuf)) {\n"
+"		flush();\n"
+"		if (n > sizeof(obuf)) {\n"
+"			writeall(data, n);\n"
+"			return;\n"
+"		}\n"
+"	}\n"
+"	memcpy(obuf + olen, data, n);\n"
+"	olen += n;\n"
+"}\n"
+"\n"
+"static void\n"
+"outf(const char *fmt, ...)\n"
+"{\n"
+"	char buffer[LINE_MAX_];\n"
+"	va_list ap;\n"
+"	int n;\n"
+"\n"
+"	va_start(ap, fmt);\n"
+"	n = vsnprintf(buffer, sizeof(buffer), fmt, ap);\n"
+"	va_end(ap);\n"
+"	if (n >= (int)sizeof(buffer))\n"
+"		n = sizeof(buffer) - 1;\n"
+"	if (n > 0)\n"
+"		out(buffer, n);\n"
+"}\n"
+"\n"
+"/* command output, a frame of its own if framed */\n"
+"static void\n"
+"data(const char *s, size_t n)\n"
+"{\n"
+"	if (ftag)\n"
+"		outf(\"#000 %s %08x\\n\", ftag, (unsigned)n);\n"
+"	out(s, n);\n"
+"}\n"
+"\n"
+"/* status line, \"#NNN tag 00000000\" if framed; \"=NNN\" data in s_seq */\n"
+"static void\n"
+"reply(int status)\n"
+"{\n"
+"	char buffer[8];\n"
+"\n"
+"	if (seq) {\n"
+"		seq_status = status;\n"
+"		data(buffer, snprintf(buffer, sizeof(buffer), \"=%03d\\n\", status));\n"
+"		return;\n"
+"	}\n"
+"	if (ftag)\n"
+"		outf(\"#%03d %s 00000000\\n\", status, ftag);\n"
+"	else\n"
+"		outf(\"### %03d\\n\", status);\n"
+"}\n"
+"\n"
+"static char *\n"
+"dbuf_get(size_t n)\n"
+"{\n"
+"	if (n > dsize) {\n"
+"		free(dbuf);\n"
+"		dsize = n < 65536 ? 65536 : n;\n"
+"		dbuf = malloc(dsize);\n"
+"		if (!dbuf)\n"
+"			exit(1);\n"
+"	}\n"
+"	return dbuf;\n"
+"}\n"
+"\n"
+"static int\n"
+"getch(void)\n"
+"{\n"
+"	ssize_t res;\n"
+"\n"
+"	if (ipos == ilen) {\n"
+"		flush();\n"
+"		do {\n"
+"			res = read(STDIN_FILENO, ibuf, sizeof(ibuf));\n"
+"		} while (res < 0 && errno == EINTR);\n"
+"		if (res <= 0)\n"
+"			return EOF;\n"
+"		ipos = 0;\n"
+"		ilen = res;\n"
+"	}\n"
+"	return (unsigned char)ibuf[ipos++];\n"
+"}\n"
+"\n"
+"/* n bytes of request data, buffered input first; exits on EOF */\n"
+"static void\n"
+"getdata(char *buf, size_t n)\n"
+"{\n"
+"	size_t c;\n"
+"	ssize_t res;\n"
+"\n"
+"	c = ilen - ipos < n ? ilen - ipos : n;\n"
+"	memcpy(buf, ibuf + ipos, c);\n"
+"	ipos += c;\n"
+"	while (c < n) {\n"
+"		res = read(STDIN_FILENO, buf + c, n - c);\n"
+"		if (res < 0 && errno == EINTR)\n"
+"			continue;\n"
+"		if (res <= 0)\n"
+"			exit(0);\n"
+"		c += res;\n"
+"	}\n"
+"}\n"
+"\n"
+"/* split command line, 'quoted'\\''words' like the shell does */\n"
+"static int\n"
+"getline_args(char *line, char **args)\n"
+"{\n"
+"	int c, i = 0, state = 0;\n"
+"	char *s = line;\n"
+"\n"
+"	while (1) {\n"
+"		c = getch();\n"
+"		if (c == EOF) {\n"
+"			if (state == 1 || state == 3) {\n"
+"				*s = '\\0';\n"
+"				return i + 1;\n"
+"			}\n"
+"			if (i)\n"
+"				return i;\n"
+"			exit(0);\n"
+"		}\n"
+"		if (s - line >= LINE_MAX_ - 1)\n"
+"			state = 5;\n"
+"		switch (state) {\n"
+"		case 0:\n"
+"			if (c == '\\n')\n"
+"				return i;\n"
+"			if (c == ' ')\n"
+"				break;\n"
+"			if (i == ARGS_MAX) {\n"
+"				state = 5;\n"
+"				break;\n"
+"			}\n"
+"			args[i] = s;\n"
+"			if (c == '\\'') {\n"
+"				state = 2;\n"
+"			} else {\n"
+"				*s++ = c;\n"
+"				state = 1;\n"
+"			}\n"
+"			break;\n"
+"		case 1:\n"
+"		case 3:\n"
+"			if (c == '\\n' || c == ' ') {\n"
+"				*s++ = '\\0';\n"
+"				i++;\n"
+"				if (c == '\\n')\n"
+"					return i;\n"
+"				state = 0;\n"
+"			} else if (state == 1) {\n"
+"				*s++ = c;\n"
+"			} else if (c == '\\'') {\n"
+"				state = 2;\n"
+"			} else if (c == '\\\\') {\n"
+"				state = 4;\n"
+"			}\n"
+"			break;\n"
+"		case 2:\n"
+"			if (c == '\\'')\n"
+"				state = 3;\n"
+"			else\n"
+"				*s++ = c;\n"
+"			break;\n"
+"		case 4:\n"
+"			if (c == '\\'')\n"
+"				*s++ = c;\n"
+"			state = 3;\n"
+"			break;\n"
+"		case 5:\n"
+"			/* too long, skip it */\n"
+"			if (c == '\\n')\n"
+"				return -1;\n"
+"			break;\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
+"/* \"/dir/file\" -> \"dir/file\" relative to root */\n"
+"static const char *\n"
+"rel(const char *path)\n"
+"{\n"
+"	while (*path == '/')\n"
+"		path++;\n"
+"	return *path ? path : \".\";\n"
+"}\n"
+"\n"
+"static int\n"
+"exists(const char *path)\n"
+"{\n"
+"	struct stat st;\n"
+"\n"
+"	return !fstatat(root, rel(path), &st, AT_SYMLINK_NOFOLLOW);\n"
+"}\n"
+"\n"
+"static void\n"
+"fd_drop(struct fd_entry *e)\n"
+"{\n"
+"	close(e->fd);\n"
+"	free(e->path);\n"
+"	e->path = NULL;\n"
+"}\n"
+"\n"
+"/* open file, reused while the path names the same inode */\n"
+"static int\n"
+"fd_get(const char *path, int flags)\n"
+"{\n"
+"	struct fd_entry *e, *lru = fd_cache;\n"
+"	struct stat st;\n"
+"	int fd, i;\n"
+"\n"
+"	if (preserve)\n"
+"		return openat(root, rel(path), flags);\n"
+"	if (fstatat(root, rel(path), &st, 0) < 0)\n"
+"		return -1;\n"
+"	for (i = 0; i < FD_CACHE; i++) {\n"
+"		e = &fd_cache[i];\n"
+"		if (!e->path) {\n"
+"			lru = e;\n"
+"			continue;\n"
+"		}\n"
+"		if (e->flags == flags && !strcmp(e->path, path)) {\n"
+"			if (e->dev == st.st_dev && e->ino == st.st_ino) {\n"
+"				e->used = ++fd_clock;\n"
+"				return dup(e->fd);\n"
+"			}\n"
+"			fd_drop(e);\n"
+"			lru = e;\n"
+"			continue;\n"
+"		}\n"
+"		if (lru->path && e->used < lru->used)\n"
+"			lru = e;\n"
+"	}\n"
+"	fd = openat(root, rel(path), flags);\n"
+"	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))\n"
+"		return fd;\n"
+"	if (lru->path)\n"
+"		fd_drop(lru);\n"
+"	lru->path = strdup(path);\n"
+"	if (!lru->path)\n"
+"		return fd;\n"
+"	lru->fd = dup(fd);\n"
+"	if (lru->fd < 0) {\n"
+"		free(lru->path);\n"
+"		lru->path = NULL;\n"
+"		return fd;\n"
+"	}\n"
+"	lru->flags = flags;\n"
+"	lru->dev = st.st_dev;\n"
+"	lru->ino = st.st_ino;\n"
+"	lru->used = ++fd_clock;\n"
+"	return fd;\n"
+"}\n"
+"\n"
+"static ssize_t\n"
+"readall(int fd, char *buf, size_t n, off_t off)\n"
+"{\n"
+"	size_t c = 0;\n"
+"	ssize_t res;\n"
+"\n"
+"	while (c < n) {\n"
+"		res = pread(fd, buf + c, n - c, off + c);\n"
+"		if (res < 0 && errno == EINTR)\n"
+"			continue;\n"
+"		if (res < 0)\n"
+"			return -1;\n"
+"		if (res == 0)\n"
+"			break;\n"
+"		c += res;\n"
+"	}\n"
+"	return c;\n"
+"}\n"
+"\n"
+"static int\n"
+"writeall_fd(int fd, const char *buf, size_t n, off_t off)\n"
+"{\n"
+"	ssize_t res;\n"
+"\n"
+"	while (n) {\n"
+"		res = pwrite(fd, buf, n, off);\n"
+"		if (res < 0 && errno == EINTR)\n"
+"			continue;\n"
+"		if (res <= 0)\n"
+"			return -1;\n"
+"		buf += res;\n"
+"		off += res;\n"
+"		n -= res;\n"
+"	}\n"
+"	return 0;\n"
+"}\n"
+"\n"
+"/* ls -ln line, as parsed by the kernel (shell.c) */\n"
+"static int\n"
+"ls_line(char *buf, size_t max, const char *name, int dirfd, const char *file, struct stat *st, time_t now)\n"
+"{\n"
+"	static const char *months[] = { \"Jan\", \"Feb\", \"Mar\", \"Apr\", \"May\", \"Jun\", \"Jul\", \"Aug\", \"Sep\", \"Oct\", \"Nov\", \"Dec\" };\n"
+"	char perm[11], size[48], when[16], link[4096];\n"
+"	mode_t m = st->st_mode;\n"
+"	struct tm *tm;\n"
+"	ssize_t l;\n"
+"	int n;\n"
+"\n"
+"	switch (m & S_IFMT) {\n"
+"	case S_IFDIR: perm[0] = 'd'; break;\n"
+"	case S_IFLNK: perm[0] = 'l'; break;\n"
+"	case S_IFCHR: perm[0] = 'c'; break;\n"
+"	case S_IFBLK: perm[0] = 'b'; break;\n"
+"	case S_IFIFO: perm[0] = 'p'; break;\n"
+"	case S_IFSOCK: perm[0] = 's'; break;\n"
+"	default: perm[0] = '-'; break;\n"
+"	}\n"
+"	perm[1] = m & S_IRUSR ? 'r' : '-';\n"
+"	perm[2] = m & S_IWUSR ? 'w' : '-';\n"
+"	perm[3] = m & S_ISUID ? (m & S_IXUSR ? 's' : 'S') : (m & S_IXUSR ? 'x' : '-');\n"
+"	perm[4] = m & S_IRGRP ? 'r' : '-';\n"
+"	perm[5] = m & S_IWGRP ? 'w' : '-';\n"
+"	perm[6] = m & S_ISGID ? (m & S_IXGRP ? 's' : 'S') : (m & S_IXGRP ? 'x' : '-');\n"
+"	perm[7] = m & S_IROTH ? 'r' : '-';\n"
+"	perm[8] = m & S_IWOTH ? 'w' : '-';\n"
+"	perm[9] = m & S_ISVTX ? (m & S_IXOTH ? 't' : 'T') : (m & S_IXOTH ? 'x' : '-');\n"
+"	perm[10] = '\\0';\n"
+"\n"
+"	if (S_ISCHR(m) || S_ISBLK(m))\n"
+"		snprintf(size, sizeof(size), \"%u, %u\", (unsigned)major(st->st_rdev), (unsigned)minor(st->st_rdev));\n"
+"	else\n"
+"		snprintf(size, sizeof(size), \"%llu\", (unsigned long long)st->st_size);\n"
+"\n"
+"	/* like ls: time of day for the last six months, year otherwise */\n"
+"	tm = gmtime(&st->st_mtime);\n"
+"	if (!tm)\n"
+"		return 0;\n"
+"	if (st->st_mtime <= now && st->st_mtime > now - 6L * 30 * 24 * 3600)\n"
+"		snprintf(when, sizeof(when), \"%02d:%02d\", tm->tm_hour, tm->tm_min);\n"
+"	else\n"
+"		snprintf(when, sizeof(when), \"%d\", tm->tm_year + 1900);\n"
+"\n"
+"	n = snprintf(buf, max, \"%s %lu %lu %lu %s %s %2d %s %s\",\n"
+"		     perm, (unsigned long)st->st_nlink, (unsigned long)st->st_uid,\n"
+"		     (unsigned long)st->st_gid, size, months[tm->tm_mon],\n"
+"		     tm->tm_mday, when, name);\n"
+"	if (n < 0 || n >= (int)max)\n"
+"		return 0;\n"
+"	if (S_ISLNK(m)) {\n"
+"		l = readlinkat(dirfd, file, link, sizeof(link) - 1);\n"
+"		if (l >= 0) {\n"
+"			link[l] = '\\0';\n"
+"			n += snprintf(buf + n, max - n, \" -> %s\", link);\n"
+"			if (n >= (int)max)\n"
+"				return 0;\n"
+"		}\n"
+"	}\n"
+"	buf[n++] = '\\n';\n"
+"	return n;\n"
+"}\n"
+"\n"
+"/* s_lsplus row, see parse_plus() in shell.c */\n"
+"static int\n"
+"plus_line(char *buf, size_t max, const char *name, int dirfd, const char *file, struct stat *st)\n"
+"{\n"
+"	char type, link[4096];\n"
+"	mode_t m = st->st_mode;\n"
+"	ssize_t l;\n"
+"	int n;\n"
+"\n"
+"	switch (m & S_IFMT) {\n"
+"	case S_IFDIR: type = 'd'; break;\n"
+"	case S_IFLNK: type = 'l'; break;\n"
+"	case S_IFCHR: type = 'c'; break;\n"
+"	case S_IFBLK: type = 'b'; break;\n"
+"	case S_IFIFO: type = 'p'; break;\n"
+"	case S_IFSOCK: type = 's'; break;\n"
+"	default: type = 'f'; break;\n"
+"	}\n"
+"	n = snprintf(buf, max, \"%llu %c%o %lu %lu %lu %llu %llu %u %u %ld.%09ld %ld.%09ld %ld.%09ld %s\",\n"
+"		     (unsigned long long)st->st_ino, type, (unsigned)(m & 07777),\n"
+"		     (unsigned long)st->st_nlink, (unsigned long)st->st_uid,\n"
+"		     (unsigned long)st->st_gid, (unsigned long long)st->st_size,\n"
+"		     (unsigned long long)st->st_blocks,\n"
+"		     (unsigned)major(st->st_rdev), (unsigned)minor(st->st_rdev),\n"
+"		     (long)st->st_atim.tv_sec, (long)st->st_atim.tv_nsec,\n"
+"		     (long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,\n"
+"		     (long)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec, name);\n"
+"	if (n < 0 || n >= (int)max)\n"
+"		return 0;\n"
+"	if (S_ISLNK(m)) {\n"
+"		l = readlinkat(dirfd, file, link, sizeof(link) - 1);\n"
+"		if (l >= 0) {\n"
+"			link[l] = '\\0';\n"
+"			n += snprintf(buf + n, max - n, \"/%s\", link);\n"
+"			if (n >= (int)max)\n"
+"				return 0;\n"
+"		}\n"
+"	}\n"
+"	buf[n++] = '\\n';\n"
+"	return n;\n"
+"}\n"
+"\n"
+"static int\n"
+"get_stat(int dirfd, const char *file, struct stat *st)\n"
+"{\n"
+"	/* stable: dereference, unless the link is dangling (ls -L) */\n"
+"	if (stable && !fstatat(dirfd, file, st, 0))\n"
+"		return 0;\n"
+"	return fstatat(dirfd, file, st, AT_SYMLINK_NOFOLLOW);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_init(char **args, int n)\n"
+"{\n"
+"	const char *dir = n > 0 && *args[0] ? args[0] : getenv(\"HOME\");\n"
+"	int i;\n"
+"\n"
+"	for (i = 1; i < n; i++) {\n"
+"		if (!strcmp(args[i], \"stable\"))\n"
+"			stable = 1;\n"
+"		else if (!strcmp(args[i], \"preserve\"))\n"
+"			preserve = 1;\n"
+"		else if (!strcmp(args[i], \"attrs\"))\n"
+"			attrs = 1;\n"
+"	}\n"
+"	if (root >= 0)\n"
+"		close(root);\n"
+"	root = open(dir ? dir : \"/\", O_RDONLY | O_DIRECTORY);\n"
+"	reply(root < 0 ? ERROR : COMPLETE);\n"
+"}\n"
+"\n"
+"/* s_lsdir or s_lsplus rows */\n"
+"static void\n"
+"do_lsdir(char **args, int n, int plus)\n"
+"{\n"
+"	struct dirent *de;\n"
+"	struct stat st;\n"
+"	size_t len = 0;\n"
+"	time_t now = time(NULL);\n"
+"	DIR *d;\n"
+"	int fd, l;\n"
+"\n"
+"	if (fstatat(root, rel(args[0]), &st, stable ? 0 : AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode)) {\n"
+"		reply(ENOENT_);\n"
+"		return;\n"
+"	}\n"
+"	fd = openat(root, rel(args[0]), O_RDONLY | O_DIRECTORY);\n"
+"	if (fd < 0 || !(d = fdopendir(fd))) {\n"
+"		if (fd >= 0)\n"
+"			close(fd);\n"
+"		reply(EPERM_);\n"
+"		return;\n"
+"	}\n"
+"	dbuf_get(65536);\n"
+"	while ((de = readdir(d))) {\n"
+"		if (!strcmp(de->d_name, \".\") || !strcmp(de->d_name, \"..\"))\n"
+"			continue;\n"
+"		if (strchr(de->d_name, '\\n') || get_stat(fd, de->d_name, &st))\n"
+"			continue;\n"
+"		if (dsize - len < LINE_MAX_) {\n"
+"			char *p = malloc(dsize * 2);\n"
+"\n"
+"			if (!p)\n"
+"				break;\n"
+"			memcpy(p, dbuf, len);\n"
+"			free(dbuf);\n"
+"			dbuf = p;\n"
+"			dsize *= 2;\n"
+"		}\n"
+"		if (plus)\n"
+"			l = plus_line(dbuf + len, LINE_MAX_, de->d_name, fd, de->d_name, &st);\n"
+"		else\n"
+"			l = ls_line(dbuf + len, LINE_MAX_, de->d_name, fd, de->d_name, &st, now);\n"
+"		len += l;\n"
+"	}\n"
+"	closedir(d);\n"
+"	data(dbuf, len);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_lsdir(char **args, int n)\n"
+"{\n"
+"	do_lsdir(args, n, 0);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_lsplus(char **args, int n)\n"
+"{\n"
+"	do_lsdir(args, n, 1);\n"
+"}\n"
+"\n"
+"static void\n"
+"do_stat(char **args, int n, int plus)\n"
+"{\n"
+"	char buffer[LINE_MAX_];\n"
+"	struct stat st;\n"
+"	int l;\n"
+"\n"
+"	if (get_stat(root, rel(args[0]), &st)) {\n"
+"		reply(ENOENT_);\n"
+"		return;\n"
+"	}\n"
+"	if (plus)\n"
+"		l = plus_line(buffer, sizeof(buffer), \".\", root, rel(args[0]), &st);\n"
+"	else\n"
+"		l = ls_line(buffer, sizeof(buffer), args[0], root, rel(args[0]), &st, time(NULL));\n"
+"	data(buffer, l);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_stat(char **args, int n)\n"
+"{\n"
+"	do_stat(args, n, 0);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_statplus(char **args, int n)\n"
+"{\n"
+"	do_stat(args, n, 1);\n"
+"}\n"
+"\n"
+"/* COMPLETE of a change, after the s_statplus row of file if attrs */\n"
+"static void\n"
+"complete(const char *file)\n"
+"{\n"
+"	char buffer[LINE_MAX_];\n"
+"	struct stat st;\n"
+"	int l;\n"
+"\n"
+"	if (attrs && !get_stat(root, rel(file), &st)) {\n"
+"		l = plus_line(buffer, sizeof(buffer), \".\", root, rel(file), &st);\n"
+"		if (l)\n"
+"			data(buffer, l);\n"
+"	}\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"/* s_statplus row or \"-\" for each file */\n"
+"static void\n"
+"s_statv(char **args, int n)\n"
+"{\n"
+"	struct stat st;\n"
+"	size_t len = 0;\n"
+"	int i;\n"
+"\n"
+"	dbuf_get(n * LINE_MAX_);\n"
+"	for (i = 0; i < n; i++) {\n"
+"		if (get_stat(root, rel(args[i]), &st))\n"
+"			len += snprintf(dbuf + len, LINE_MAX_, \"-\\n\");\n"
+"		else\n"
+"			len += plus_line(dbuf + len, LINE_MAX_, \".\", root, rel(args[i]), &st);\n"
+"	}\n"
+"	data(dbuf, len);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"/*\n"
+" * s_lookup max file...: s_statv, the row of a regular file of up to\n"
+" * max bytes is followed by \":len\" and its content\n"
+" */\n"
+"static void\n"
+"s_lookup(char **args, int n)\n"
+"{\n"
+"	size_t max = strtoul(args[0], NULL, 10);\n"
+"	struct stat st;\n"
+"	size_t len = 0;\n"
+"	ssize_t r;\n"
+"	int i, l, fd;\n"
+"\n"
+"	if (max > INLINE_MAX)\n"
+"		max = INLINE_MAX;\n"
+"	dbuf_get(n * (LINE_MAX_ + max + 16));\n"
+"	for (i = 1; i < n; i++) {\n"
+"		if (get_stat(root, rel(args[i]), &st)) {\n"
+"			len += snprintf(dbuf + len, LINE_MAX_, \"-\\n\");\n"
+"			continue;\n"
+"		}\n"
+"		len += plus_line(dbuf + len, LINE_MAX_, \".\", root, rel(args[i]), &st);\n"
+"		if (!S_ISREG(st.st_mode) || !st.st_size || st.st_size > max)\n"
+"			continue;\n"
+"		fd = fd_get(args[i], O_RDONLY);\n"
+"		if (fd < 0)\n"
+"			continue;\n"
+"		l = sprintf(dbuf + len, \":%ld\\n\", (long)st.st_size);\n"
+"		r = readall(fd, dbuf + len + l, st.st_size, 0);\n"
+"		close(fd);\n"
+"		/* changed since the stat, the reader does s_read */\n"
+"		if (r == st.st_size)\n"
+"			len += l + r;\n"
+"	}\n"
+"	data(dbuf, len);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_open(char **args, int n)\n"
+"{\n"
+"	int flags = O_RDWR, fd;\n"
+"	struct stat st;\n"
+"	char c;\n"
+"\n"
+"	if (!strcmp(args[1], \"R\"))\n"
+"		flags = O_RDONLY;\n"
+"	else if (!strcmp(args[1], \"W\"))\n"
+"		flags = O_WRONLY;\n"
+"	fd = fd_get(args[0], flags);\n"
+"	if (fd < 0) {\n"
+"		reply(exists(args[0]) ? EPERM_ : ENOENT_);\n"
+"		return;\n"
+"	}\n"
+"	/* zero sized, but readable (/proc) */\n"
+"	if (!fstat(fd, &st) && !st.st_size && flags != O_WRONLY && read(fd, &c, 1) == 1)\n"
+"		reply(NOTEMPTY);\n"
+"	else\n"
+"		reply(COMPLETE);\n"
+"	close(fd);\n"
+"}\n"
+"\n"
+"/* s_read: padded to size; s_sread: size read follows PRELIM */\n"
+"static void\n"
+"do_read(char **args, int n, int sread)\n"
+"{\n"
+"	size_t size = strtoul(args[2], NULL, 10);\n"
+"	off_t off = strtoull(args[1], NULL, 10);\n"
+"	ssize_t res;\n"
+"	char *buf;\n"
+"	int fd;\n"
+"\n"
+"	fd = fd_get(args[0], O_RDONLY);\n"
+"	if (fd < 0) {\n"
+"		reply(exists(args[0]) ? EPERM_ : COMPLETE);\n"
+"		return;\n"
+"	}\n"
+"	buf = dbuf_get(size);\n"
+"	res = readall(fd, buf, size, off);\n"
+"	close(fd);\n"
+"	if (res < 0) {\n"
+"		reply(ERROR);\n"
+"		return;\n"
+"	}\n"
+"	reply(PRELIM);\n"
+"	if (sread) {\n"
+"		/* frame has the size already */\n"
+"		if (!ftag)\n"
+"			outf(\"%ld\\n\", (long)res);\n"
+"		size = res;\n"
+"	} else {\n"
+"		memset(buf + res, 0, size - res);\n"
+"	}\n"
+"	data(buf, size);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_read(char **args, int n)\n"
+"{\n"
+"	do_read(args, n, 0);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_sread(char **args, int n)\n"
+"{\n"
+"	do_read(args, n, 1);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_write(char **args, int n)\n"
+"{\n"
+"	size_t size = strtoul(args[2], NULL, 10);\n"
+"	off_t off = strtoull(args[1], NULL, 10);\n"
+"	char *buf;\n"
+"	int fd;\n"
+"\n"
+"	fd = fd_get(args[0], O_WRONLY);\n"
+"	if (fd < 0) {\n"
+"		reply(exists(args[0]) ? EPERM_ : COMPLETE);\n"
+"		return;\n"
+"	}\n"
+"	reply(PRELIM);\n"
+"	flush();\n"
+"	buf = dbuf_get(size);\n"
+"	getdata(buf, size);\n"
+"	if (!writeall_fd(fd, buf, size, off)) {\n"
+"		complete(args[0]);\n"
+"	} else if (errno == ENOSPC) {\n"
+"		/* the kernel sends the data once more (set_garbage()) */\n"
+"		reply(ENOSPC_);\n"
+"		getdata(buf, size);\n"
+"	} else {\n"
+"		reply(ERROR);\n"
+"	}\n"
+"	close(fd);\n"
+"}\n"
+"\n"
+"/* data right after the command line (no PRELIM), consumed in any case */\n"
+"static void\n"
+"s_dwrite(char **args, int n)\n"
+"{\n"
+"	size_t size = strtoul(args[2], NULL, 10);\n"
+"	off_t off = strtoull(args[1], NULL, 10);\n"
+"	char *buf;\n"
+"	int fd;\n"
+"\n"
+"	buf = dbuf_get(size);\n"
+"	getdata(buf, size);\n"
+"	fd = fd_get(args[0], O_WRONLY);\n"
+"	if (fd < 0) {\n"
+"		reply(exists(args[0]) ? EPERM_ : ENOENT_);\n"
+"		return;\n"
+"	}\n"
+"	if (!writeall_fd(fd, buf, size, off))\n"
+"		complete(args[0]);\n"
+"	else\n"
+"		reply(errno == ENOSPC ? ENOSPC_ : ERROR);\n"
+"	close(fd);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_mkdir(char **args, int n)\n"
+"{\n"
+"	if (mkdirat(root, rel(args[0]), 0777))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[0]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_rmdir(char **args, int n)\n"
+"{\n"
+"	struct stat st;\n"
+"\n"
+"	if (fstatat(root, rel(args[0]), &st, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode))\n"
+"		reply(ENOENT_);\n"
+"	else\n"
+"		reply(unlinkat(root, rel(args[0]), AT_REMOVEDIR) ? EPERM_ : COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_mv(char **args, int n)\n"
+"{\n"
+"	if (!renameat(root, rel(args[0]), root, rel(args[1])))\n"
+"		reply(COMPLETE);\n"
+"	else\n"
+"		reply(exists(args[0]) ? EPERM_ : ENOENT_);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_rm(char **args, int n)\n"
+"{\n"
+"	if (!unlinkat(root, rel(args[0]), 0))\n"
+"		reply(COMPLETE);\n"
+"	else\n"
+"		reply(exists(args[0]) ? EPERM_ : ENOENT_);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_creat(char **args, int n)\n"
+"{\n"
+"	int fd;\n"
+"\n"
+"	fd = openat(root, rel(args[0]), O_RDWR | O_TRUNC | O_CREAT, strtoul(args[1], NULL, 8));\n"
+"	if (fd < 0) {\n"
+"		reply(EPERM_);\n"
+"		return;\n"
+"	}\n"
+"	close(fd);\n"
+"	complete(args[0]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_ln(char **args, int n)\n"
+"{\n"
+"	if (linkat(root, rel(args[0]), root, rel(args[1]), 0))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[1]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_sln(char **args, int n)\n"
+"{\n"
+"	if (symlinkat(args[0], root, rel(args[1])))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[1]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_readlink(char **args, int n)\n"
+"{\n"
+"	char buffer[4096];\n"
+"	ssize_t l;\n"
+"\n"
+"	l = readlinkat(root, rel(args[0]), buffer, sizeof(buffer) - 1);\n"
+"	if (l < 0) {\n"
+"		reply(EPERM_);\n"
+"		return;\n"
+"	}\n"
+"	buffer[l++] = '\\n';\n"
+"	data(buffer, l);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_chmod(char **args, int n)\n"
+"{\n"
+"	if (fchmodat(root, rel(args[0]), strtoul(args[1], NULL, 8), 0))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[0]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_chown(char **args, int n)\n"
+"{\n"
+"	if (fchownat(root, rel(args[0]), strtoul(args[1], NULL, 10), -1, 0))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[0]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_chgrp(char **args, int n)\n"
+"{\n"
+"	if (fchownat(root, rel(args[0]), -1, strtoul(args[1], NULL, 10), 0))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[0]);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_trunc(char **args, int n)\n"
+"{\n"
+"	int fd, result;\n"
+"\n"
+"	fd = fd_get(args[0], O_WRONLY);\n"
+"	if (fd < 0) {\n"
+"		reply(EPERM_);\n"
+"		return;\n"
+"	}\n"
+"	result = ftruncate(fd, strtoull(args[1], NULL, 10));\n"
+"	close(fd);\n"
+"	if (result)\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[0]);\n"
+"}\n"
+"\n"
+"/* days since the epoch, proleptic Gregorian */\n"
+"static long\n"
+"days(int y, int m, int d)\n"
+"{\n"
+"	y -= m <= 2;\n"
+"	return 365L * y + y / 4 - y / 100 + y / 400 + (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1 - 719468;\n"
+"}\n"
+"\n"
+"/* \"[am] YYYYMMDDhhmm.ss\" (GMT) */\n"
+"static void\n"
+"s_settime(char **args, int n)\n"
+"{\n"
+"	struct timespec ts[2];\n"
+"	int y, mo, d, h, mi, s;\n"
+"\n"
+"	if (sscanf(args[2], \"%4d%2d%2d%2d%2d.%2d\", &y, &mo, &d, &h, &mi, &s) != 6) {\n"
+"		reply(ERROR);\n"
+"		return;\n"
+"	}\n"
+"	if (!exists(args[0])) {\n"
+"		reply(ENOENT_);\n"
+"		return;\n"
+"	}\n"
+"	ts[0].tv_sec = ((days(y, mo, d) * 24 + h) * 60 + mi) * 60 + s;\n"
+"	ts[0].tv_nsec = strchr(args[1], 'a') ? 0 : UTIME_OMIT;\n"
+"	ts[1].tv_sec = ts[0].tv_sec;\n"
+"	ts[1].tv_nsec = strchr(args[1], 'm') ? 0 : UTIME_OMIT;\n"
+"	if (utimensat(root, rel(args[0]), ts, 0))\n"
+"		reply(EPERM_);\n"
+"	else\n"
+"		complete(args[0]);\n"
+"}\n"
+"\n"
+"/*\n"
+" * Steps separated by \";\" args, each replies its output and \"=NNN\";\n"
+" * the first one that fails ends the sequence\n"
+" */\n"
+"static void\n"
+"s_seq(char **args, int n)\n"
+"{\n"
+"	struct command *c;\n"
+"	int i, j;\n"
+"\n"
+"	seq = 1;\n"
+"	for (i = 0; i < n; i = j + 1) {\n"
+"		for (j = i; j < n && strcmp(args[j], \";\"); j++)\n"
+"			;\n"
+"		c = find_command(args[i]);\n"
+"		if (!c || !c->seq || j - i - 1 < c->args)\n"
+"			reply(ERROR);\n"
+"		else\n"
+"			c->fn(args + i + 1, j - i - 1);\n"
+"		if (seq_status >= 300)\n"
+"			break;\n"
+"	}\n"
+"	seq = 0;\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"/* \"total used available\" 1024 byte blocks, as df -k */\n"
+"static void\n"
+"s_statfs(char **args, int n)\n"
+"{\n"
+"	char buffer[128];\n"
+"	struct statvfs sv;\n"
+"	unsigned long long bs;\n"
+"	int l;\n"
+"\n"
+"	if (fstatvfs(root, &sv)) {\n"
+"		l = snprintf(buffer, sizeof(buffer), \"0 0 0\\n\");\n"
+"	} else {\n"
+"		bs = sv.f_frsize ? sv.f_frsize : sv.f_bsize;\n"
+"		l = snprintf(buffer, sizeof(buffer), \"%llu %llu %llu\\n\",\n"
+"			     (unsigned long long)sv.f_blocks * bs / 1024,\n"
+"			     (unsigned long long)(sv.f_blocks - sv.f_bfree) * bs / 1024,\n"
+"			     (unsigned long long)sv.f_bavail * bs / 1024);\n"
+"	}\n"
+"	data(buffer, l);\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_finish(char **args, int n)\n"
+"{\n"
+"	reply(COMPLETE);\n"
+"}\n"
+"\n"
+"static void\n"
+"s_ping(char **args, int n)\n"
+"{\n"
+"	char buffer[LINE_MAX_ + 1];\n"
+"	int l;\n"
+"\n"
+"	l = snprintf(buffer, sizeof(buffer), \"%s\\n\", args[0]);\n"
+"	reply(PRELIM);\n"
+"	data(buffer, l);\n"
+"	reply(NOP);\n"
+"}\n"
+"\n"
+"/* \"uid 'gid gid...'\", the first gid is the effective one */\n"
+"static void\n"
+"set_owner(const char *uid, const char *groups)\n"
+"{\n"
+"	static char old[LINE_MAX_] = \"\";\n"
+"	gid_t list[ARGS_MAX * 4];\n"
+"	char *s, *e;\n"
+"	int n = 0;\n"
+"	uid_t u = strtoul(uid, NULL, 10);\n"
+"\n"
+"	if (strcmp(groups, old)) {\n"
+"		if (seteuid(0))\n"
+"			return;\n"
+"		for (s = (char *)groups; n < ARGS_MAX * 4; s = e) {\n"
+"			list[n] = strtoul(s, &e, 10);\n"
+"			if (e == s)\n"
+"				break;\n"
+"			n++;\n"
+"		}\n"
+"		if (n) {\n"
+"			setegid(list[0]);\n"
+"			setgroups(n > 1 ? n - 1 : 1, n > 1 ? list + 1 : list);\n"
+"		}\n"
+"		snprintf(old, sizeof(old), \"%s\", groups);\n"
+"	}\n"
+"	if (u != geteuid())\n"
+"		seteuid(u);\n"
+"}\n"
+"\n"
+"static struct command commands[] = {\n"
+"	{ \"s_init\", 0, s_init },\n"
+"	{ \"s_finish\", 0, s_finish },\n"
+"	{ \"s_lsdir\", 1, s_lsdir },\n"
+"	{ \"s_stat\", 1, s_stat },\n"
+"	{ \"s_lsplus\", 1, s_lsplus },\n"
+"	{ \"s_statplus\", 1, s_statplus },\n"
+"	{ \"s_statv\", 0, s_statv },\n"
+"	{ \"s_lookup\", 1, s_lookup },\n"
+"	{ \"s_open\", 2, s_open },\n"
+"	{ \"s_read\", 3, s_read },\n"
+"	{ \"s_sread\", 3, s_sread },\n"
+"	{ \"s_write\", 3, s_write },\n"
+"	{ \"s_dwrite\", 3, s_dwrite },\n"
+"	{ \"s_mkdir\", 1, s_mkdir, 1 },\n"
+"	{ \"s_rmdir\", 1, s_rmdir, 1 },\n"
+"	{ \"s_mv\", 2, s_mv, 1 },\n"
+"	{ \"s_rm\", 1, s_rm, 1 },\n"
+"	{ \"s_creat\", 2, s_creat, 1 },\n"
+"	{ \"s_ln\", 2, s_ln, 1 },\n"
+"	{ \"s_sln\", 2, s_sln, 1 },\n"
+"	{ \"s_readlink\", 1, s_readlink },\n"
+"	{ \"s_chmod\", 2, s_chmod, 1 },\n"
+"	{ \"s_chown\", 2, s_chown, 1 },\n"
+"	{ \"s_chgrp\", 2, s_chgrp, 1 },\n"
+"	{ \"s_trunc\", 2, s_trunc, 1 },\n"
+"	{ \"s_settime\", 3, s_settime, 1 },\n"
+"	{ \"s_statfs\", 0, s_statfs },\n"
+"	{ \"s_ping\", 1, s_ping },\n"
+"	{ \"s_seq\", 0, s_seq },\n"
+"	{ NULL, 0, NULL },\n"
+"};\n"
+"\n"
+"static struct command *\n"
+"find_command(const char *name)\n"
+"{\n"
+"	struct command *c;\n"
+"\n"
+"	for (c = commands; c->name; c++)\n"
+"		if (!strcmp(name, c->name))\n"
+"			return c;\n"
+"	return NULL;\n"
+"}\n"
+"\n"
+"int\n"
+"main(int argc, char **argv)\n"
+"{\n"
+"	static char line[LINE_MAX_];\n"
+"	char *args[ARGS_MAX + 1], **a, *cmd;\n"
+"	struct command *c;\n"
+"	int n, fd;\n"
+"\n"
+"	if (argc > 1 && !strcmp(argv[1], \"-v\")) {\n"
+"		printf(\"%s\\n\", SHFSD_ID);\n"
+"		return 0;\n"
+"	}\n"
+"\n"
+"	fd = open(\"/dev/null\", O_WRONLY);\n"
+"	if (fd >= 0) {\n"
+"		dup2(fd, STDERR_FILENO);\n"
+"		if (fd != STDERR_FILENO)\n"
+"			close(fd);\n"
+"	}\n"
+"\n"
+"	reply(COMPLETE);\n"
+"	while (1) {\n"
+"		flush();\n"
+"		n = getline_args(line, args);\n"
+"		if (n <= 0) {\n"
+"			if (n < 0)\n"
+"				reply(ERROR);\n"
+"			continue;\n"
+"		}\n"
+"		a = args;\n"
+"		ftag = NULL;\n"
+"		if (!strcmp(a[0], \"s_tag\") && n > 2) {\n"
+"			outf(\"### %03d %s\\n\", TAG, a[1]);\n"
+"			a += 2;\n"
+"			n -= 2;\n"
+"		} else if (!strcmp(a[0], \"s_frame\") && n > 2) {\n"
+"			ftag = a[1];\n"
+"			a += 2;\n"
+"			n -= 2;\n"
+"		}\n"
+"		cmd = *a++;\n"
+"		n--;\n"
+"		if (preserve && n >= 2) {\n"
+"			set_owner(a[0], a[1]);\n"
+"			a += 2;\n"
+"			n -= 2;\n"
+"		}\n"
+"\n"
+"		c = find_command(cmd);\n"
+"		if (!c || n < c->args)\n"
+"			reply(ERROR);\n"
+"		else\n"
+"			c->fn(a, n);\n"
+"	}\n"
+"	return 0;\n"
+"}\n"
@@ -0,0 +1,28 @@
+"s_D=\"${HOME:-/tmp}/.shfs\";\n"
+"s_S=\"$s_D/shfsd-$$.c\";\n"
+"s_H=`cksum <\"$s_S\" 2>/dev/null | cut -d\" \" -f1`;\n"
+"s_SHFSD=\"$s_D/shfsd-$s_H-`uname -s`-`uname -m`\";\n"
+"if test -z \"$s_H\"; then\n"
+"	s_SHFSD=\"\";\n"
+"elif test \"`shfsd -v 2>/dev/null`\" = \"$s_H\"; then\n"
+"	s_SHFSD=shfsd;\n"
+"elif test ! -x \"$s_SHFSD\"; then\n"
+"	for s_CC in cc gcc c99; do\n"
+"		if $s_CC -O2 -DSHFSD_ID=\"\\\"$s_H\\\"\" -o \"$s_SHFSD.$$\" \"$s_S\" >/dev/null 2>&1; then\n"
+"			mv -f \"$s_SHFSD.$$\" \"$s_SHFSD\";\n"
+"			break;\n"
+"		fi;\n"
+"	done;\n"
+"	rm -f \"$s_SHFSD.$$\";\n"
+"fi;\n"
+"rm -f \"$s_S\";\n"
+"if test \"$s_SHFSD\" = shfsd || test -x \"$s_SHFSD\"; then\n"
+"	if test \"`id -u`\" = 0; then\n"
+"		echo \"ok stable preserve\";\n"
+"	else\n"
+"		echo \"ok stable\";\n"
+"	fi;\n"
+"else\n"
+"	s_SHFSD=\"\";\n"
+"	echo failed;\n"
+"fi;\n"
@@ -0,0 +1,1211 @@
+/*
+ *  This file is part of SHell File System.
+ *  See http://shfs.sourceforge.net/ for more info.
+ *
+ *  Native remote server, speaks the protocol of perl-code.in without
+ *  forking a process per request.  shfsmount sends this file to the
+ *  remote shell and builds it there (see shfsd-test.in), unless a
+ *  matching binary is already installed.  It has to stay a single,
+ *  plain POSIX source file.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <grp.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#ifdef __APPLE__
+#define st_atim st_atimespec
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+#ifndef SHFSD_ID
+#define SHFSD_ID "unknown"
+#endif
+
+#define LINE_MAX_	8192
+#define INLINE_MAX	65536
+#define ARGS_MAX	64
+#define FD_CACHE	8
+
+#define PRELIM		100
+#define TAG		110
+#define COMPLETE	200
+#define NOP		201
+#define NOTEMPTY	202
+#define ERROR		500
+#define EPERM_		501
+#define ENOSPC_		502
+#define ENOENT_		503
+
+/* directory all paths are relative to */
+static int root = -1;
+static int stable = 0;
+static int preserve = 0;
+static int attrs = 0;
+
+/* frame tag of the current request, NULL for plain replies */
+static char *ftag = NULL;
+
+/* in s_seq: status of the last step, see reply() */
+static int seq = 0;
+static int seq_status;
+
+struct command {
+	const char *name;
+	int args;
+	void (*fn)(char **args, int n);
+	int seq;			/* may be a step of s_seq */
+};
+
+static struct command *find_command(const char *name);
+
+static char ibuf[65536];
+static size_t ipos = 0, ilen = 0;
+
+static char obuf[65536];
+static size_t olen = 0;
+
+/* read/list buffer, grows as needed */
+static char *dbuf = NULL;
+static size_t dsize = 0;
+
+/* open files, looked up by path and checked by inode on every use */
+struct fd_entry {
+	char *path;
+	int flags;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	unsigned long used;
+};
+
+static struct fd_entry fd_cache[FD_CACHE];
+static unsigned long fd_clock = 0;
+
+static void
+writeall(const char *data, size_t n)
+{
+	ssize_t res;
+
+	while (n) {
+		res = write(STDOUT_FILENO, data, n);
+		if (res < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			exit(1);
+		}
+		data += res;
+		n -= res;
+	}
+}
+
+static void
+flush(void)
+{
+	writeall(obuf, olen);
+	olen = 0;
+}
+
+static void
+out(const char *data, size_t n)
+{
+	if (olen + n > sizeof(obuf)) {
+		flush();
+		if (n > sizeof(obuf)) {
+			writeall(data, n);
+			return;
+		}
+	}
+	memcpy(obuf + olen, data, n);
+	olen += n;
+}
+
+static void
+outf(const char *fmt, ...)
+{
+	char buffer[LINE_MAX_];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	if (n >= (int)sizeof(buffer))
+		n = sizeof(buffer) - 1;
+	if (n > 0)
+		out(buffer, n);
+}
+
+/* command output, a frame of its own if framed */
+static void
+data(const char *s, size_t n)
+{
+	if (ftag)
+		outf("#000 %s %08x\n", ftag, (unsigned)n);
+	out(s, n);
+}
+
+/* status line, "#NNN tag 00000000" if framed; "=NNN" data in s_seq */
+static void
+reply(int status)
+{
+	char buffer[8];
+
+	if (seq) {
+		seq_status = status;
+		data(buffer, snprintf(buffer, sizeof(buffer), "=%03d\n", status));
+		return;
+	}
+	if (ftag)
+		outf("#%03d %s 00000000\n", status, ftag);
+	else
+		outf("### %03d\n", status);
+}
+
+static char *
+dbuf_get(size_t n)
+{
+	if (n > dsize) {
+		free(dbuf);
+		dsize = n < 65536 ? 65536 : n;
+		dbuf = malloc(dsize);
+		if (!dbuf)
+			exit(1);
+	}
+	return dbuf;
+}
+
+static int
+getch(void)
+{
+	ssize_t res;
+
+	if (ipos == ilen) {
+		flush();
+		do {
+			res = read(STDIN_FILENO, ibuf, sizeof(ibuf));
+		} while (res < 0 && errno == EINTR);
+		if (res <= 0)
+			return EOF;
+		ipos = 0;
+		ilen = res;
+	}
+	return (unsigned char)ibuf[ipos++];
+}
+
+/* n bytes of request data, buffered input first; exits on EOF */
+static void
+getdata(char *buf, size_t n)
+{
+	size_t c;
+	ssize_t res;
+
+	c = ilen - ipos < n ? ilen - ipos : n;
+	memcpy(buf, ibuf + ipos, c);
+	ipos += c;
+	while (c < n) {
+		res = read(STDIN_FILENO, buf + c, n - c);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			exit(0);
+		c += res;
+	}
+}
+
+/* split command line, 'quoted'\''words' like the shell does */
+static int
+getline_args(char *line, char **args)
+{
+	int c, i = 0, state = 0;
+	char *s = line;
+
+	while (1) {
+		c = getch();
+		if (c == EOF) {
+			if (state == 1 || state == 3) {
+				*s = '\0';
+				return i + 1;
+			}
+			if (i)
+				return i;
+			exit(0);
+		}
+		if (s - line >= LINE_MAX_ - 1)
+			state = 5;
+		switch (state) {
+		case 0:
+			if (c == '\n')
+				return i;
+			if (c == ' ')
+				break;
+			if (i == ARGS_MAX) {
+				state = 5;
+				break;
+			}
+			args[i] = s;
+			if (c == '\'') {
+				state = 2;
+			} else {
+				*s++ = c;
+				state = 1;
+			}
+			break;
+		case 1:
+		case 3:
+			if (c == '\n' || c == ' ') {
+				*s++ = '\0';
+				i++;
+				if (c == '\n')
+					return i;
+				state = 0;
+			} else if (state == 1) {
+				*s++ = c;
+			} else if (c == '\'') {
+				state = 2;
+			} else if (c == '\\') {
+				state = 4;
+			}
+			break;
+		case 2:
+			if (c == '\'')
+				state = 3;
+			else
+				*s++ = c;
+			break;
+		case 4:
+			if (c == '\'')
+				*s++ = c;
+			state = 3;
+			break;
+		case 5:
+			/* too long, skip it */
+			if (c == '\n')
+				return -1;
+			break;
+		}
+	}
+}
+
+/* "/dir/file" -> "dir/file" relative to root */
+static const char *
+rel(const char *path)
+{
+	while (*path == '/')
+		path++;
+	return *path ? path : ".";
+}
+
+static int
+exists(const char *path)
+{
+	struct stat st;
+
+	return !fstatat(root, rel(path), &st, AT_SYMLINK_NOFOLLOW);
+}
+
+static void
+fd_drop(struct fd_entry *e)
+{
+	close(e->fd);
+	free(e->path);
+	e->path = NULL;
+}
+
+/* open file, reused while the path names the same inode */
+static int
+fd_get(const char *path, int flags)
+{
+	struct fd_entry *e, *lru = fd_cache;
+	struct stat st;
+	int fd, i;
+
+	if (preserve)
+		return openat(root, rel(path), flags);
+	if (fstatat(root, rel(path), &st, 0) < 0)
+		return -1;
+	for (i = 0; i < FD_CACHE; i++) {
+		e = &fd_cache[i];
+		if (!e->path) {
+			lru = e;
+			continue;
+		}
+		if (e->flags == flags && !strcmp(e->path, path)) {
+			if (e->dev == st.st_dev && e->ino == st.st_ino) {
+				e->used = ++fd_clock;
+				return dup(e->fd);
+			}
+			fd_drop(e);
+			lru = e;
+			continue;
+		}
+		if (lru->path && e->used < lru->used)
+			lru = e;
+	}
+	fd = openat(root, rel(path), flags);
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return fd;
+	if (lru->path)
+		fd_drop(lru);
+	lru->path = strdup(path);
+	if (!lru->path)
+		return fd;
+	lru->fd = dup(fd);
+	if (lru->fd < 0) {
+		free(lru->path);
+		lru->path = NULL;
+		return fd;
+	}
+	lru->flags = flags;
+	lru->dev = st.st_dev;
+	lru->ino = st.st_ino;
+	lru->used = ++fd_clock;
+	return fd;
+}
+
+static ssize_t
+readall(int fd, char *buf, size_t n, off_t off)
+{
+	size_t c = 0;
+	ssize_t res;
+
+	while (c < n) {
+		res = pread(fd, buf + c, n - c, off + c);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return -1;
+		if (res == 0)
+			break;
+		c += res;
+	}
+	return c;
+}
+
+static int
+writeall_fd(int fd, const char *buf, size_t n, off_t off)
+{
+	ssize_t res;
+
+	while (n) {
+		res = pwrite(fd, buf, n, off);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		buf += res;
+		off += res;
+		n -= res;
+	}
+	return 0;
+}
+
+/* ls -ln line, as parsed by the kernel (shell.c) */
+static int
+ls_line(char *buf, size_t max, const char *name, int dirfd, const char *file, struct stat *st, time_t now)
+{
+	static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	char perm[11], size[48], when[16], link[4096];
+	mode_t m = st->st_mode;
+	struct tm *tm;
+	ssize_t l;
+	int n;
+
+	switch (m & S_IFMT) {
+	case S_IFDIR: perm[0] = 'd'; break;
+	case S_IFLNK: perm[0] = 'l'; break;
+	case S_IFCHR: perm[0] = 'c'; break;
+	case S_IFBLK: perm[0] = 'b'; break;
+	case S_IFIFO: perm[0] = 'p'; break;
+	case S_IFSOCK: perm[0] = 's'; break;
+	default: perm[0] = '-'; break;
+	}
+	perm[1] = m & S_IRUSR ? 'r' : '-';
+	perm[2] = m & S_IWUSR ? 'w' : '-';
+	perm[3] = m & S_ISUID ? (m & S_IXUSR ? 's' : 'S') : (m & S_IXUSR ? 'x' : '-');
+	perm[4] = m & S_IRGRP ? 'r' : '-';
+	perm[5] = m & S_IWGRP ? 'w' : '-';
+	perm[6] = m & S_ISGID ? (m & S_IXGRP ? 's' : 'S') : (m & S_IXGRP ? 'x' : '-');
+	perm[7] = m & S_IROTH ? 'r' : '-';
+	perm[8] = m & S_IWOTH ? 'w' : '-';
+	perm[9] = m & S_ISVTX ? (m & S_IXOTH ? 't' : 'T') : (m & S_IXOTH ? 'x' : '-');
+	perm[10] = '\0';
+
+	if (S_ISCHR(m) || S_ISBLK(m))
+		snprintf(size, sizeof(size), "%u, %u", (unsigned)major(st->st_rdev), (unsigned)minor(st->st_rdev));
+	else
+		snprintf(size, sizeof(size), "%llu", (unsigned long long)st->st_size);
+
+	/* like ls: time of day for the last six months, year otherwise */
+	tm = gmtime(&st->st_mtime);
+	if (!tm)
+		return 0;
+	if (st->st_mtime <= now && st->st_mtime > now - 6L * 30 * 24 * 3600)
+		snprintf(when, sizeof(when), "%02d:%02d", tm->tm_hour, tm->tm_min);
+	else
+		snprintf(when, sizeof(when), "%d", tm->tm_year + 1900);
+
+	n = snprintf(buf, max, "%s %lu %lu %lu %s %s %2d %s %s",
+		     perm, (unsigned long)st->st_nlink, (unsigned long)st->st_uid,
+		     (unsigned long)st->st_gid, size, months[tm->tm_mon],
+		     tm->tm_mday, when, name);
+	if (n < 0 || n >= (int)max)
+		return 0;
+	if (S_ISLNK(m)) {
+		l = readlinkat(dirfd, file, link, sizeof(link) - 1);
+		if (l >= 0) {
+			link[l] = '\0';
+			n += snprintf(buf + n, max - n, " -> %s", link);
+			if (n >= (int)max)
+				return 0;
+		}
+	}
+	buf[n++] = '\n';
+	return n;
+}
+
+/* s_lsplus row, see parse_plus() in shell.c */
+static int
+plus_line(char *buf, size_t max, const char *name, int dirfd, const char *file, struct stat *st)
+{
+	char type, link[4096];
+	mode_t m = st->st_mode;
+	ssize_t l;
+	int n;
+
+	switch (m & S_IFMT) {
+	case S_IFDIR: type = 'd'; break;
+	case S_IFLNK: type = 'l'; break;
+	case S_IFCHR: type = 'c'; break;
+	case S_IFBLK: type = 'b'; break;
+	case S_IFIFO: type = 'p'; break;
+	case S_IFSOCK: type = 's'; break;
+	default: type = 'f'; break;
+	}
+	n = snprintf(buf, max, "%llu %c%o %lu %lu %lu %llu %llu %u %u %ld.%09ld %ld.%09ld %ld.%09ld %s",
+		     (unsigned long long)st->st_ino, type, (unsigned)(m & 07777),
+		     (unsigned long)st->st_nlink, (unsigned long)st->st_uid,
+		     (unsigned long)st->st_gid, (unsigned long long)st->st_size,
+		     (unsigned long long)st->st_blocks,
+		     (unsigned)major(st->st_rdev), (unsigned)minor(st->st_rdev),
+		     (long)st->st_atim.tv_sec, (long)st->st_atim.tv_nsec,
+		     (long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+		     (long)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec, name);
+	if (n < 0 || n >= (int)max)
+		return 0;
+	if (S_ISLNK(m)) {
+		l = readlinkat(dirfd, file, link, sizeof(link) - 1);
+		if (l >= 0) {
+			link[l] = '\0';
+			n += snprintf(buf + n, max - n, "/%s", link);
+			if (n >= (int)max)
+				return 0;
+		}
+	}
+	buf[n++] = '\n';
+	return n;
+}
+
+static int
+get_stat(int dirfd, const char *file, struct stat *st)
+{
+	/* stable: dereference, unless the link is dangling (ls -L) */
+	if (stable && !fstatat(dirfd, file, st, 0))
+		return 0;
+	return fstatat(dirfd, file, st, AT_SYMLINK_NOFOLLOW);
+}
+
+static void
+s_init(char **args, int n)
+{
+	const char *dir = n > 0 && *args[0] ? args[0] : getenv("HOME");
+	int i;
+
+	for (i = 1; i < n; i++) {
+		if (!strcmp(args[i], "stable"))
+			stable = 1;
+		else if (!strcmp(args[i], "preserve"))
+			preserve = 1;
+		else if (!strcmp(args[i], "attrs"))
+			attrs = 1;
+	}
+	if (root >= 0)
+		close(root);
+	root = open(dir ? dir : "/", O_RDONLY | O_DIRECTORY);
+	reply(root < 0 ? ERROR : COMPLETE);
+}
+
+/* s_lsdir or s_lsplus rows */
+static void
+do_lsdir(char **args, int n, int plus)
+{
+	struct dirent *de;
+	struct stat st;
+	size_t len = 0;
+	time_t now = time(NULL);
+	DIR *d;
+	int fd, l;
+
+	if (fstatat(root, rel(args[0]), &st, stable ? 0 : AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode)) {
+		reply(ENOENT_);
+		return;
+	}
+	fd = openat(root, rel(args[0]), O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || !(d = fdopendir(fd))) {
+		if (fd >= 0)
+			close(fd);
+		reply(EPERM_);
+		return;
+	}
+	dbuf_get(65536);
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (strchr(de->d_name, '\n') || get_stat(fd, de->d_name, &st))
+			continue;
+		if (dsize - len < LINE_MAX_) {
+			char *p = malloc(dsize * 2);
+
+			if (!p)
+				break;
+			memcpy(p, dbuf, len);
+			free(dbuf);
+			dbuf = p;
+			dsize *= 2;
+		}
+		if (plus)
+			l = plus_line(dbuf + len, LINE_MAX_, de->d_name, fd, de->d_name, &st);
+		else
+			l = ls_line(dbuf + len, LINE_MAX_, de->d_name, fd, de->d_name, &st, now);
+		len += l;
+	}
+	closedir(d);
+	data(dbuf, len);
+	reply(COMPLETE);
+}
+
+static void
+s_lsdir(char **args, int n)
+{
+	do_lsdir(args, n, 0);
+}
+
+static void
+s_lsplus(char **args, int n)
+{
+	do_lsdir(args, n, 1);
+}
+
+static void
+do_stat(char **args, int n, int plus)
+{
+	char buffer[LINE_MAX_];
+	struct stat st;
+	int l;
+
+	if (get_stat(root, rel(args[0]), &st)) {
+		reply(ENOENT_);
+		return;
+	}
+	if (plus)
+		l = plus_line(buffer, sizeof(buffer), ".", root, rel(args[0]), &st);
+	else
+		l = ls_line(buffer, sizeof(buffer), args[0], root, rel(args[0]), &st, time(NULL));
+	data(buffer, l);
+	reply(COMPLETE);
+}
+
+static void
+s_stat(char **args, int n)
+{
+	do_stat(args, n, 0);
+}
+
+static void
+s_statplus(char **args, int n)
+{
+	do_stat(args, n, 1);
+}
+
+/* COMPLETE of a change, after the s_statplus row of file if attrs */
+static void
+complete(const char *file)
+{
+	char buffer[LINE_MAX_];
+	struct stat st;
+	int l;
+
+	if (attrs && !get_stat(root, rel(file), &st)) {
+		l = plus_line(buffer, sizeof(buffer), ".", root, rel(file), &st);
+		if (l)
+			data(buffer, l);
+	}
+	reply(COMPLETE);
+}
+
+/* s_statplus row or "-" for each file */
+static void
+s_statv(char **args, int n)
+{
+	struct stat st;
+	size_t len = 0;
+	int i;
+
+	dbuf_get(n * LINE_MAX_);
+	for (i = 0; i < n; i++) {
+		if (get_stat(root, rel(args[i]), &st))
+			len += snprintf(dbuf + len, LINE_MAX_, "-\n");
+		else
+			len += plus_line(dbuf + len, LINE_MAX_, ".", root, rel(args[i]), &st);
+	}
+	data(dbuf, len);
+	reply(COMPLETE);
+}
+
+/*
+ * s_lookup max file...: s_statv, the row of a regular file of up to
+ * max bytes is followed by ":len" and its content
+ */
+static void
+s_lookup(char **args, int n)
+{
+	size_t max = strtoul(args[0], NULL, 10);
+	struct stat st;
+	size_t len = 0;
+	ssize_t r;
+	int i, l, fd;
+
+	if (max > INLINE_MAX)
+		max = INLINE_MAX;
+	dbuf_get(n * (LINE_MAX_ + max + 16));
+	for (i = 1; i < n; i++) {
+		if (get_stat(root, rel(args[i]), &st)) {
+			len += snprintf(dbuf + len, LINE_MAX_, "-\n");
+			continue;
+		}
+		len += plus_line(dbuf + len, LINE_MAX_, ".", root, rel(args[i]), &st);
+		if (!S_ISREG(st.st_mode) || !st.st_size || st.st_size > max)
+			continue;
+		fd = fd_get(args[i], O_RDONLY);
+		if (fd < 0)
+			continue;
+		l = sprintf(dbuf + len, ":%ld\n", (long)st.st_size);
+		r = readall(fd, dbuf + len + l, st.st_size, 0);
+		close(fd);
+		/* changed since the stat, the reader does s_read */
+		if (r == st.st_size)
+			len += l + r;
+	}
+	data(dbuf, len);
+	reply(COMPLETE);
+}
+
+static void
+s_open(char **args, int n)
+{
+	int flags = O_RDWR, fd;
+	struct stat st;
+	char c;
+
+	if (!strcmp(args[1], "R"))
+		flags = O_RDONLY;
+	else if (!strcmp(args[1], "W"))
+		flags = O_WRONLY;
+	fd = fd_get(args[0], flags);
+	if (fd < 0) {
+		reply(exists(args[0]) ? EPERM_ : ENOENT_);
+		return;
+	}
+	/* zero sized, but readable (/proc) */
+	if (!fstat(fd, &st) && !st.st_size && flags != O_WRONLY && read(fd, &c, 1) == 1)
+		reply(NOTEMPTY);
+	else
+		reply(COMPLETE);
+	close(fd);
+}
+
+/* s_read: padded to size; s_sread: size read follows PRELIM */
+static void
+do_read(char **args, int n, int sread)
+{
+	size_t size = strtoul(args[2], NULL, 10);
+	off_t off = strtoull(args[1], NULL, 10);
+	ssize_t res;
+	char *buf;
+	int fd;
+
+	fd = fd_get(args[0], O_RDONLY);
+	if (fd < 0) {
+		reply(exists(args[0]) ? EPERM_ : COMPLETE);
+		return;
+	}
+	buf = dbuf_get(size);
+	res = readall(fd, buf, size, off);
+	close(fd);
+	if (res < 0) {
+		reply(ERROR);
+		return;
+	}
+	reply(PRELIM);
+	if (sread) {
+		/* frame has the size already */
+		if (!ftag)
+			outf("%ld\n", (long)res);
+		size = res;
+	} else {
+		memset(buf + res, 0, size - res);
+	}
+	data(buf, size);
+	reply(COMPLETE);
+}
+
+static void
+s_read(char **args, int n)
+{
+	do_read(args, n, 0);
+}
+
+static void
+s_sread(char **args, int n)
+{
+	do_read(args, n, 1);
+}
+
+static void
+s_write(char **args, int n)
+{
+	size_t size = strtoul(args[2], NULL, 10);
+	off_t off = strtoull(args[1], NULL, 10);
+	char *buf;
+	int fd;
+
+	fd = fd_get(args[0], O_WRONLY);
+	if (fd < 0) {
+		reply(exists(args[0]) ? EPERM_ : COMPLETE);
+		return;
+	}
+	reply(PRELIM);
+	flush();
+	buf = dbuf_get(size);
+	getdata(buf, size);
+	if (!writeall_fd(fd, buf, size, off)) {
+		complete(args[0]);
+	} else if (errno == ENOSPC) {
+		/* the kernel sends the data once more (set_garbage()) */
+		reply(ENOSPC_);
+		getdata(buf, size);
+	} else {
+		reply(ERROR);
+	}
+	close(fd);
+}
+
+/* data right after the command line (no PRELIM), consumed in any case */
+static void
+s_dwrite(char **args, int n)
+{
+	size_t size = strtoul(args[2], NULL, 10);
+	off_t off = strtoull(args[1], NULL, 10);
+	char *buf;
+	int fd;
+
+	buf = dbuf_get(size);
+	getdata(buf, size);
+	fd = fd_get(args[0], O_WRONLY);
+	if (fd < 0) {
+		reply(exists(args[0]) ? EPERM_ : ENOENT_);
+		return;
+	}
+	if (!writeall_fd(fd, buf, size, off))
+		complete(args[0]);
+	else
+		reply(errno == ENOSPC ? ENOSPC_ : ERROR);
+	close(fd);
+}
+
+static void
+s_mkdir(char **args, int n)
+{
+	if (mkdirat(root, rel(args[0]), 0777))
+		reply(EPERM_);
+	else
+		complete(args[0]);
+}
+
+static void
+s_rmdir(char **args, int n)
+{
+	struct stat st;
+
+	if (fstatat(root, rel(args[0]), &st, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode))
+		reply(ENOENT_);
+	else
+		reply(unlinkat(root, rel(args[0]), AT_REMOVEDIR) ? EPERM_ : COMPLETE);
+}
+
+static void
+s_mv(char **args, int n)
+{
+	if (!renameat(root, rel(args[0]), root, rel(args[1])))
+		reply(COMPLETE);
+	else
+		reply(exists(args[0]) ? EPERM_ : ENOENT_);
+}
+
+static void
+s_rm(char **args, int n)
+{
+	if (!unlinkat(root, rel(args[0]), 0))
+		reply(COMPLETE);
+	else
+		reply(exists(args[0]) ? EPERM_ : ENOENT_);
+}
+
+static void
+s_creat(char **args, int n)
+{
+	int fd;
+
+	fd = openat(root, rel(args[0]), O_RDWR | O_TRUNC | O_CREAT, strtoul(args[1], NULL, 8));
+	if (fd < 0) {
+		reply(EPERM_);
+		return;
+	}
+	close(fd);
+	complete(args[0]);
+}
+
+static void
+s_ln(char **args, int n)
+{
+	if (linkat(root, rel(args[0]), root, rel(args[1]), 0))
+		reply(EPERM_);
+	else
+		complete(args[1]);
+}
+
+static void
+s_sln(char **args, int n)
+{
+	if (symlinkat(args[0], root, rel(args[1])))
+		reply(EPERM_);
+	else
+		complete(args[1]);
+}
+
+static void
+s_readlink(char **args, int n)
+{
+	char buffer[4096];
+	ssize_t l;
+
+	l = readlinkat(root, rel(args[0]), buffer, sizeof(buffer) - 1);
+	if (l < 0) {
+		reply(EPERM_);
+		return;
+	}
+	buffer[l++] = '\n';
+	data(buffer, l);
+	reply(COMPLETE);
+}
+
+static void
+s_chmod(char **args, int n)
+{
+	if (fchmodat(root, rel(args[0]), strtoul(args[1], NULL, 8), 0))
+		reply(EPERM_);
+	else
+		complete(args[0]);
+}
+
+static void
+s_chown(char **args, int n)
+{
+	if (fchownat(root, rel(args[0]), strtoul(args[1], NULL, 10), -1, 0))
+		reply(EPERM_);
+	else
+		complete(args[0]);
+}
+
+static void
+s_chgrp(char **args, int n)
+{
+	if (fchownat(root, rel(args[0]), -1, strtoul(args[1], NULL, 10), 0))
+		reply(EPERM_);
+	else
+		complete(args[0]);
+}
+
+static void
+s_trunc(char **args, int n)
+{
+	int fd, result;
+
+	fd = fd_get(args[0], O_WRONLY);
+	if (fd < 0) {
+		reply(EPERM_);
+		return;
+	}
+	result = ftruncate(fd, strtoull(args[1], NULL, 10));
+	close(fd);
+	if (result)
+		reply(EPERM_);
+	else
+		complete(args[0]);
+}
+
+/* days since the epoch, proleptic Gregorian */
+static long
+days(int y, int m, int d)
+{
+	y -= m <= 2;
+	return 365L * y + y / 4 - y / 100 + y / 400 + (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1 - 719468;
+}
+
+/* "[am] YYYYMMDDhhmm.ss" (GMT) */
+static void
+s_settime(char **args, int n)
+{
+	struct timespec ts[2];
+	int y, mo, d, h, mi, s;
+
+	if (sscanf(args[2], "%4d%2d%2d%2d%2d.%2d", &y, &mo, &d, &h, &mi, &s) != 6) {
+		reply(ERROR);
+		return;
+	}
+	if (!exists(args[0])) {
+		reply(ENOENT_);
+		return;
+	}
+	ts[0].tv_sec = ((days(y, mo, d) * 24 + h) * 60 + mi) * 60 + s;
+	ts[0].tv_nsec = strchr(args[1], 'a') ? 0 : UTIME_OMIT;
+	ts[1].tv_sec = ts[0].tv_sec;
+	ts[1].tv_nsec = strchr(args[1], 'm') ? 0 : UTIME_OMIT;
+	if (utimensat(root, rel(args[0]), ts, 0))
+		reply(EPERM_);
+	else
+		complete(args[0]);
+}
+
+/*
+ * Steps separated by ";" args, each replies its output and "=NNN";
+ * the first one that fails ends the sequence
+ */
+static void
+s_seq(char **args, int n)
+{
+	struct command *c;
+	int i, j;
+
+	seq = 1;
+	for (i = 0; i < n; i = j + 1) {
+		for (j = i; j < n && strcmp(args[j], ";"); j++)
+			;
+		c = find_command(args[i]);
+		if (!c || !c->seq || j - i - 1 < c->args)
+			reply(ERROR);
+		else
+			c->fn(args + i + 1, j - i - 1);
+		if (seq_status >= 300)
+			break;
+	}
+	seq = 0;
+	reply(COMPLETE);
+}
+
+/* "total used available" 1024 byte blocks, as df -k */
+static void
+s_statfs(char **args, int n)
+{
+	char buffer[128];
+	struct statvfs sv;
+	unsigned long long bs;
+	int l;
+
+	if (fstatvfs(root, &sv)) {
+		l = snprintf(buffer, sizeof(buffer), "0 0 0\n");
+	} else {
+		bs = sv.f_frsize ? sv.f_frsize : sv.f_bsize;
+		l = snprintf(buffer, sizeof(buffer), "%llu %llu %llu\n",
+			     (unsigned long long)sv.f_blocks * bs / 1024,
+			     (unsigned long long)(sv.f_blocks - sv.f_bfree) * bs / 1024,
+			     (unsigned long long)sv.f_bavail * bs / 1024);
+	}
+	data(buffer, l);
+	reply(COMPLETE);
+}
+
+static void
+s_finish(char **args, int n)
+{
+	reply(COMPLETE);
+}
+
+static void
+s_ping(char **args, int n)
+{
+	char buffer[LINE_MAX_ + 1];
+	int l;
+
+	l = snprintf(buffer, sizeof(buffer), "%s\n", args[0]);
+	reply(PRELIM);
+	data(buffer, l);
+	reply(NOP);
+}
+
+/* "uid 'gid gid...'", the first gid is the effective one */
+static void
+set_owner(const char *uid, const char *groups)
+{
+	static char old[LINE_MAX_] = "";
+	gid_t list[ARGS_MAX * 4];
+	char *s, *e;
+	int n = 0;
+	uid_t u = strtoul(uid, NULL, 10);
+
+	if (strcmp(groups, old)) {
+		if (seteuid(0))
+			return;
+		for (s = (char *)groups; n < ARGS_MAX * 4; s = e) {
+			list[n] = strtoul(s, &e, 10);
+			if (e == s)
+				break;
+			n++;
+		}
+		if (n) {
+			setegid(list[0]);
+			setgroups(n > 1 ? n - 1 : 1, n > 1 ? list + 1 : list);
+		}
+		snprintf(old, sizeof(old), "%s", groups);
+	}
+	if (u != geteuid())
+		seteuid(u);
+}
+
+static struct command commands[] = {
+	{ "s_init", 0, s_init },
+	{ "s_finish", 0, s_finish },
+	{ "s_lsdir", 1, s_lsdir },
+	{ "s_stat", 1, s_stat },
+	{ "s_lsplus", 1, s_lsplus },
+	{ "s_statplus", 1, s_statplus },
+	{ "s_statv", 0, s_statv },
+	{ "s_lookup", 1, s_lookup },
+	{ "s_open", 2, s_open },
+	{ "s_read", 3, s_read },
+	{ "s_sread", 3, s_sread },
+	{ "s_write", 3, s_write },
+	{ "s_dwrite", 3, s_dwrite },
+	{ "s_mkdir", 1, s_mkdir, 1 },
+	{ "s_rmdir", 1, s_rmdir, 1 },
+	{ "s_mv", 2, s_mv, 1 },
+	{ "s_rm", 1, s_rm, 1 },
+	{ "s_creat", 2, s_creat, 1 },
+	{ "s_ln", 2, s_ln, 1 },
+	{ "s_sln", 2, s_sln, 1 },
+	{ "s_readlink", 1, s_readlink },
+	{ "s_chmod", 2, s_chmod, 1 },
+	{ "s_chown", 2, s_chown, 1 },
+	{ "s_chgrp", 2, s_chgrp, 1 },
+	{ "s_trunc", 2, s_trunc, 1 },
+	{ "s_settime", 3, s_settime, 1 },
+	{ "s_statfs", 0, s_statfs },
+	{ "s_ping", 1, s_ping },
+	{ "s_seq", 0, s_seq },
+	{ NULL, 0, NULL },
+};
+
+static struct command *
+find_command(const char *name)
+{
+	struct command *c;
+
+	for (c = commands; c->name; c++)
+		if (!strcmp(name, c->name))
+			return c;
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	static char line[LINE_MAX_];
+	char *args[ARGS_MAX + 1], **a, *cmd;
+	struct command *c;
+	int n, fd;
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) {
+		printf("%s\n", SHFSD_ID);
+		return 0;
+	}
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDERR_FILENO);
+		if (fd != STDERR_FILENO)
+			close(fd);
+	}
+
+	reply(COMPLETE);
+	while (1) {
+		flush();
+		n = getline_args(line, args);
+		if (n <= 0) {
+			if (n < 0)
+				reply(ERROR);
+			continue;
+		}
+		a = args;
+		ftag = NULL;
+		if (!strcmp(a[0], "s_tag") && n > 2) {
+			outf("### %03d %s\n", TAG, a[1]);
+			a += 2;
+			n -= 2;
+		} else if (!strcmp(a[0], "s_frame") && n > 2) {
+			ftag = a[1];
+			a += 2;
+			n -= 2;
+		}
+		cmd = *a++;
+		n--;
+		if (preserve && n >= 2) {
+			set_owner(a[0], a[1]);
+			a += 2;
+			n -= 2;
+		}
+
+		c = find_command(cmd);
+		if (!c || n < c->args)
+			reply(ERROR);
+		else
+			c->fn(a, n);
+	}
+	return 0;
+}
@@ -42,6 +42,7 @@
 #include "shfs_fs.h"
 
 #define SHELL		"/bin/sh"
+#define SFTP		"sftp"
 #define BUFFER_MAX	1024
 
 /* remote root dir */
@@ -91,6 +92,15 @@ static int persistent = 0;
 /* preferred type of connection */
 static char *type = NULL;
 
+/* talk to sftp-server instead of a shell (type=sftp) */
+static int sftp = 0;
+
+/* number of parallel shell sessions */
+static int conns = 1;
+
+/* protocol extensions common to all sessions (-1: not known yet) */
+static int caps = -1;
+
 /* should shfsmount print debug messages? */
 int verbose = 0;
 
@@ -115,7 +125,7 @@ usage(FILE *fp, int res)
 		"  -c, --cmd=COMMAND\tcommand to connect to remote side (see below)\n"
 		"  -P, --port=PORT\tconnect to this port\n"
 		"  -p, --persistent\tmake connection persistent\n"
-		"  -t, --type=TYPE\tconnection type (shell, perl)\n"
+		"  -t, --type=TYPE\tconnection type (shfsd, perl, shell, sftp)\n"
 		"  -s, --stable\t\tderefference symbolic links (if possible)\n"
 		"  -o, --options=OPTIONS\tmount options (see below)\n"
 		"  -n, --nomtab\t\tdo not update /etc/mtab\n"
@@ -128,12 +138,16 @@ usage(FILE *fp, int res)
 		"mount options (separated by comma):\n"
 		"  cachesize=N\tread-ahead and write-back cache size in pages,\n"
 		"  \t\tpage size is 4KB on i386; 0 = disable (default is 32)\n"
-		"  cachemax=N\tmaximum number of cached files (default is 10)\n"
+		"  cachemax=N\tmaximum number of cached files (default is 256)\n"
 		"  preserve\tpreserve uid/gid (root only)\n"
+		"  lazyattr\tsend mode/owner/time changes on close or sync\n"
+		"  inline[=N]\tget files of up to N bytes (default one page) with\n"
+		"  \t\ttheir lookup, shfsd and perl only\n"
 		"  ttl=TIME\ttime to live (sec) for directory cache\n"
 		"  uid=USER\towner of all files/dirs on mounted filesystem (root only)\n"
 		"  gid=GROUP\tgroup of all files/dirs on mounted filesystem (root only)\n"
 		"  rmode=MODE\troot dir mode (default is 700)\n"
+		"  conns=N\tnumber of parallel shell sessions (default is 1)\n"
 		"  suid, dev\tsee mount(8) (root only)\n"
 		"  ro, rw, nosuid, nodev, exec, noexec, user, users: see mount(8)\n"
 		"  cmd-user, cmd, port, persistent, type, stable: see above\n\n"
@@ -291,8 +305,9 @@ get_gid(char *s)
 	return group->gr_gid;
 }
 
+/* run cmd, return our end of its stdin/stdout */
 static int
-create_socket_sh(void)
+spawn_cmd(void)
 {
 	pid_t child;
 	int fd[2], null;
@@ -342,20 +357,49 @@ create_socket_sh(void)
 	close(fd[0]);
 	close(null);
 
-	if (!init_sh(fd[1], type, root, stable, preserve)) {
-		close(fd[1]);
+	return fd[1];
+}
+
+static int
+create_socket_sh(void)
+{
+	int fd, c;
+
+	fd = spawn_cmd();
+	if (!init_sh(fd, type, root, stable, preserve, &c)) {
+		close(fd);
+		return -1;
+	}
+	/* kernel was told what the first session can do */
+	if (caps == -1) {
+		caps = c;
+	} else if ((caps & c) != caps) {
+		VERBOSE("Remote side lacks protocol extensions of the mount\n");
+		close(fd);
 		return -1;
 	}
 
-	return fd[1];
+	return fd;
+}
+
+static int
+create_socket_sftp(void)
+{
+	int fd;
+
+	fd = spawn_cmd();
+	if (!init_sftp(fd)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
 static void
-wait_on_socket_sh(int fd)
+wait_on_socket_sh(void)
 {
 	int status;
 
-	close(fd);
 	if (wait(&status) < 0)
 		error("wait: %s", strerror(errno));
 }
@@ -363,7 +407,8 @@ wait_on_socket_sh(int fd)
 static int
 create_socket(void)
 {
-	/* possible sftp/ssh extension here */
+	if (sftp)
+		return create_socket_sftp();
 	return create_socket_sh();
 }
 
@@ -372,7 +417,7 @@ create_socket(void)
 
 /* exponential slowdown upto five mins */
 static void
-wait_on_socket(int fd)
+wait_on_socket(void)
 {
 	static int sleeptime = MIN_SLEEP;
 	static time_t last = 0;
@@ -391,7 +436,7 @@ wait_on_socket(int fd)
 	}
 	last = time(NULL);
 	
-	wait_on_socket_sh(fd);
+	wait_on_socket_sh();
 }
 
 static void
@@ -426,7 +471,7 @@ main(int argc, char **argv)
 {
 	char buf[BUFFER_MAX];
 	char *s, *c, *tmp;
-	int res, sock;
+	int res, sock[SHFS_MAX_CONNS], i;
 
 	snprintf(options, sizeof(options), "version=%d", PROTO_VERSION);
 	while(1) {
@@ -485,6 +530,10 @@ main(int argc, char **argv)
 					if (strtol(s+5, &r, 10) == 0 || *r)
 						error("Invalid port: %s", s+5);
 					port = s+5;
+				} else if (!strncmp(s, "conns=", 6)) {
+					conns = strtol(s+6, &r, 10);
+					if (conns < 1 || conns > SHFS_MAX_CONNS || *r)
+						error("Invalid number of connections: %s", s+6);
 				} else if (!strncmp(s, "persistent", 10)) {
 					persistent = 1;
 				} else if (!strncmp(s, "preserve", 8)) {
@@ -581,6 +630,12 @@ main(int argc, char **argv)
 		strnconcat(options, sizeof(options), buf, NULL);
 	}
 
+	/* no shell code, no protocol extensions */
+	if (type && !strcmp(type, "sftp")) {
+		sftp = 1;
+		caps = 0;
+	}
+
 	/* setup cmd */
 	cmd = malloc(BUFFER_MAX);
 	if (!cmd)
@@ -616,10 +671,10 @@ main(int argc, char **argv)
 	} else {
 		if (!host)
 			error("Unknown remote host");
-		snprintf(cmd, BUFFER_MAX, "exec ssh %s%s %s%s %s %s", 
+		snprintf(cmd, BUFFER_MAX, "exec ssh %s%s %s%s %s%s %s", 
 			 port ? "-p " : "", port ? port : "",
 			 user ? "-l " : "", user ? user : "",
-			 host, SHELL);
+			 sftp ? "-s " : "", host, sftp ? SFTP : SHELL);
 	}
 
 	VERBOSE("cmd: %s, options: \"%s\"\n", cmd, options);
@@ -628,12 +683,36 @@ main(int argc, char **argv)
 	if (persistent)
 		daemonize();
 
-	sock = create_socket();
-	if (sock < 0)
-		error("Cannot create connection");
+	for (i = 0; i < conns; i++) {
+		sock[i] = create_socket();
+		if (sock[i] < 0)
+			error("Cannot create connection");
 
-	snprintf(buf, sizeof(buf), ",fd=%d", sock);
-	strnconcat(options, sizeof(options), buf, NULL);
+		snprintf(buf, sizeof(buf), ",fd=%d", sock[i]);
+		strnconcat(options, sizeof(options), buf, NULL);
+	}
+	if (sftp) {
+		strnconcat(options, sizeof(options), ",sftp", NULL);
+		/* shell code does s_init cd, sftp paths are prefixed */
+		if (root && *root)
+			strnconcat(options, sizeof(options), ",root=", root, NULL);
+	}
+	if (caps & PROTO_WDATA)
+		strnconcat(options, sizeof(options), ",wdata", NULL);
+	if (caps & PROTO_FRAME)
+		strnconcat(options, sizeof(options), ",frame", NULL);
+	if (caps & PROTO_PLUS)
+		strnconcat(options, sizeof(options), ",plus", NULL);
+	if (caps & PROTO_STATV)
+		strnconcat(options, sizeof(options), ",statv", NULL);
+	if (caps & PROTO_ATTRS)
+		strnconcat(options, sizeof(options), ",attrs", NULL);
+	if (caps & PROTO_SEQ)
+		strnconcat(options, sizeof(options), ",seq", NULL);
+	if (caps & PROTO_LOOKUP)
+		strnconcat(options, sizeof(options), ",lookup", NULL);
+	if (caps & PROTO_RANGE)
+		strnconcat(options, sizeof(options), ",range", NULL);
 
 	if (mount("none", mnt, "shfs", 0, options) < 0) {
 		if (errno == ENODEV)
@@ -648,23 +727,29 @@ main(int argc, char **argv)
 	}
 	free(host_long);
 
+	/* kernel holds its own references */
+	for (i = 0; i < conns; i++)
+		close(sock[i]);
+
 	if (persistent) {
 		while (1) {
-			int fdmnt;
+			int fdmnt, fd;
 
-			wait_on_socket(sock);
-			sock = create_socket();
+			/* one of the sessions died, kernel picks the slot */
+			wait_on_socket();
+			fd = create_socket();
+			if (fd < 0)
+				continue;
 		
 			/* pass new socket to the kernel */
 			fdmnt = open(mnt, 0);
 			if (fdmnt == -1)
 				error("open: %s", strerror(errno));
-			if (ioctl(fdmnt, SHFS_IOC_NEWCONN, sock) != 0)
+			if (ioctl(fdmnt, SHFS_IOC_NEWCONN, fd) != 0)
 				exit(0);
 			close(fdmnt);
+			close(fd);
 		}
-	} else {
-		close(sock);
 	}
 
 	free(mnt);